@@ -0,0 +1,102 @@
+/*
+ * Micro-benchmark of the guest memory accessors: host time per instruction
+ * fetch, load and store to RAM, the best of N_ROUNDS rounds.
+ *
+ * rv32emu is freely redistributable under the MIT License. See the file
+ * "LICENSE" for information on usage and redistribution of this file.
+ */
+
+#include <stdio.h>
+
+#include "emu-rv32i.h"
+
+#define N_ACCESSES 10000000
+#define N_ROUNDS 10
+
+#define N_TESTS 7
+static const char *const names[N_TESTS] = {
+    "get_insn32",      "target_read_u8",   "target_read_u16", "target_read_u32",
+    "target_write_u8", "target_write_u16", "target_write_u32"};
+
+/* keeps the loaded values alive */
+static volatile uint32_t sink;
+
+static void report(const char *name, const int64_t *ns)
+{
+    int64_t best = ns[0];
+    for (int r = 1; r < N_ROUNDS; r++) {
+        if (ns[r] < best)
+            best = ns[r];
+    }
+    printf("%-16s %6.2f ns/access\n", name, (double) best / N_ACCESSES);
+}
+
+int main(void)
+{
+    struct machine *m = machine_new(1, RAM_SIZE);
+    struct hart *h;
+    uint32_t sum = 0;
+    int64_t t, ns[N_TESTS][N_ROUNDS];
+
+    if (m == NULL)
+        return 1;
+    h = &m->hart[0];
+    m->ram_start = 0x1000;
+    for (uint32_t i = 0; i < RAM_SIZE; i++)
+        m->ram[i] = i * 7;
+
+    /* sequential aligned addresses, wrapping around in the RAM */
+#define ADDR(i, size) (m->ram_start + (((i) * (size)) & (RAM_SIZE - 1)))
+
+    for (int r = 0; r < N_ROUNDS; r++) {
+        t = get_clock();
+        for (uint32_t i = 0; i < N_ACCESSES; i++)
+            sum += get_insn32(h, ADDR(i, 4));
+        ns[0][r] = get_clock() - t;
+
+        t = get_clock();
+        for (uint32_t i = 0; i < N_ACCESSES; i++) {
+            uint8_t val;
+            target_read_u8(h, &val, ADDR(i, 1));
+            sum += val;
+        }
+        ns[1][r] = get_clock() - t;
+
+        t = get_clock();
+        for (uint32_t i = 0; i < N_ACCESSES; i++) {
+            uint16_t val;
+            target_read_u16(h, &val, ADDR(i, 2));
+            sum += val;
+        }
+        ns[2][r] = get_clock() - t;
+
+        t = get_clock();
+        for (uint32_t i = 0; i < N_ACCESSES; i++) {
+            uint32_t val;
+            target_read_u32(h, &val, ADDR(i, 4));
+            sum += val;
+        }
+        ns[3][r] = get_clock() - t;
+
+        t = get_clock();
+        for (uint32_t i = 0; i < N_ACCESSES; i++)
+            target_write_u8(h, ADDR(i, 1), i);
+        ns[4][r] = get_clock() - t;
+
+        t = get_clock();
+        for (uint32_t i = 0; i < N_ACCESSES; i++)
+            target_write_u16(h, ADDR(i, 2), i);
+        ns[5][r] = get_clock() - t;
+
+        t = get_clock();
+        for (uint32_t i = 0; i < N_ACCESSES; i++)
+            target_write_u32(h, ADDR(i, 4), i);
+        ns[6][r] = get_clock() - t;
+    }
+    for (int i = 0; i < N_TESTS; i++)
+        report(names[i], ns[i]);
+
+    sink = sum + m->ram[0];
+    machine_free(m);
+    return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * On-disk checkpoints of a stopped machine.
+ *
+ * rv32emu is freely redistributable under the MIT License. See the file
+ * "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/*
+ * File layout, all values in host byte order:
+ *
+ *   struct checkpoint_header
+ *   struct checkpoint_hart      n_harts times
+ *   uint32_t                    page number of each stored page, n_pages
+ *   (padding to the next page boundary, at pages_offset)
+ *   page data                   n_pages * page_size bytes
+ *
+ * Only RAM pages which are not all zero are stored. The page data is page
+ * aligned in the file, so a resume maps it copy on write into RAM (see
+ * machine_load_file()) without any parsing or copying. The machine is
+ * created with the RAM size stored in the file. Files of another version,
+ * page size or byte order are rejected.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC "RV32CKPT"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_BYTE_ORDER 0x01020304
+
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t ram_size;
+    uint32_t page_size;
+    uint32_t n_harts;
+    uint32_t n_pages;
+    uint64_t pages_offset;
+
+    uint32_t ram_start;
+    uint32_t ram_last;
+    uint32_t begin_signature;
+    uint32_t end_signature;
+    uint32_t timer_deterministic;
+    uint32_t reserved;
+};
+
+/* architectural state of a hart */
+struct checkpoint_hart {
+    uint32_t pc;
+    uint32_t reg[32];
+    uint32_t priv;
+    uint32_t fs;
+    uint32_t mxl;
+
+    uint32_t mstatus;
+    uint32_t mtvec;
+    uint32_t mscratch;
+    uint32_t mepc;
+    uint32_t mcause;
+    uint32_t mtval;
+    uint32_t mhartid;
+    uint32_t misa;
+    uint32_t zext;
+    uint32_t mie;
+    uint32_t mip;
+    uint32_t medeleg;
+    uint32_t mideleg;
+    uint32_t mcounteren;
+    uint32_t stvec;
+    uint32_t sscratch;
+    uint32_t sepc;
+    uint32_t scause;
+    uint32_t stval;
+    uint32_t satp;
+    uint32_t scounteren;
+    uint32_t load_res;
+    uint32_t load_val;
+    uint32_t pmpaddr[PMP_COUNT];
+    uint8_t pmpcfg[PMP_COUNT];
+
+    uint64_t mtimecmp;
+    uint64_t insn_counter;
+    uint64_t jump_counter;
+    uint64_t backward_counter;
+    uint64_t forward_counter;
+    uint64_t true_counter;
+    uint64_t false_counter;
+};
+
+static void checkpoint_save_hart(struct checkpoint_hart *c,
+                                 const struct hart *h)
+{
+    memset(c, 0, sizeof(*c));
+    c->pc = h->pc;
+    memcpy(c->reg, h->reg, sizeof(c->reg));
+    c->priv = h->priv;
+    c->fs = h->fs;
+    c->mxl = h->mxl;
+    c->mstatus = h->mstatus;
+    c->mtvec = h->mtvec;
+    c->mscratch = h->mscratch;
+    c->mepc = h->mepc;
+    c->mcause = h->mcause;
+    c->mtval = h->mtval;
+    c->mhartid = h->mhartid;
+    c->misa = h->misa;
+    c->zext = h->zext;
+    c->mie = h->mie;
+    c->mip = h->mip;
+    c->medeleg = h->medeleg;
+    c->mideleg = h->mideleg;
+    c->mcounteren = h->mcounteren;
+    c->stvec = h->stvec;
+    c->sscratch = h->sscratch;
+    c->sepc = h->sepc;
+    c->scause = h->scause;
+    c->stval = h->stval;
+    c->satp = h->satp;
+    c->scounteren = h->scounteren;
+    c->load_res = h->load_res;
+    c->load_val = h->load_val;
+    memcpy(c->pmpaddr, h->pmpaddr, sizeof(c->pmpaddr));
+    memcpy(c->pmpcfg, h->pmpcfg, sizeof(c->pmpcfg));
+    c->mtimecmp = h->mtimecmp;
+    c->insn_counter = h->insn_counter;
+    c->jump_counter = h->jump_counter;
+    c->backward_counter = h->backward_counter;
+    c->forward_counter = h->forward_counter;
+    c->true_counter = h->true_counter;
+    c->false_counter = h->false_counter;
+}
+
+static void checkpoint_load_hart(struct hart *h,
+                                 const struct checkpoint_hart *c)
+{
+    h->pc = c->pc;
+    memcpy(h->reg, c->reg, sizeof(h->reg));
+    h->priv = c->priv;
+    h->fs = c->fs;
+    h->mxl = c->mxl;
+    h->mstatus = c->mstatus;
+    h->mtvec = c->mtvec;
+    h->mscratch = c->mscratch;
+    h->mepc = c->mepc;
+    h->mcause = c->mcause;
+    h->mtval = c->mtval;
+    h->mhartid = c->mhartid;
+    h->misa = c->misa;
+    h->zext = c->zext;
+    h->mie = c->mie;
+    h->mip = c->mip;
+    h->medeleg = c->medeleg;
+    h->mideleg = c->mideleg;
+    h->mcounteren = c->mcounteren;
+    h->stvec = c->stvec;
+    h->sscratch = c->sscratch;
+    h->sepc = c->sepc;
+    h->scause = c->scause;
+    h->stval = c->stval;
+    h->satp = c->satp;
+    h->scounteren = c->scounteren;
+    h->load_res = c->load_res;
+    h->load_val = c->load_val;
+    memcpy(h->pmpaddr, c->pmpaddr, sizeof(h->pmpaddr));
+    memcpy(h->pmpcfg, c->pmpcfg, sizeof(h->pmpcfg));
+    h->mtimecmp = c->mtimecmp;
+    h->insn_counter = c->insn_counter;
+    h->jump_counter = c->jump_counter;
+    h->backward_counter = c->backward_counter;
+    h->forward_counter = c->forward_counter;
+    h->true_counter = c->true_counter;
+    h->false_counter = c->false_counter;
+    h->timer_deadline = 0;
+    pmp_update(h);
+    irq_update(h);
+}
+
+static int page_is_zero(const uint8_t *p)
+{
+    static const uint8_t zero[RAM_PAGE_SIZE];
+    return memcmp(p, zero, RAM_PAGE_SIZE) == 0;
+}
+
+/* write the state of the stopped machine 'm' to 'file', returns -1 on
+ * error */
+int checkpoint_write(const struct machine *m, const char *file)
+{
+    struct checkpoint_header hdr;
+    struct checkpoint_hart c;
+    uint32_t *pages = malloc(m->ram_pages * sizeof(uint32_t));
+    uint32_t n_pages = 0;
+    FILE *f;
+
+    if (pages == NULL)
+        return -1;
+    for (uint32_t i = 0; i < m->ram_pages; i++) {
+        if ((m->used_pages[i] || m->dirty_pages[i]) &&
+            !page_is_zero(m->ram + (size_t) i * RAM_PAGE_SIZE))
+            pages[n_pages++] = i;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+    hdr.version = CHECKPOINT_VERSION;
+    hdr.byte_order = CHECKPOINT_BYTE_ORDER;
+    hdr.ram_size = m->ram_size;
+    hdr.page_size = RAM_PAGE_SIZE;
+    hdr.n_harts = m->n_harts;
+    hdr.n_pages = n_pages;
+    hdr.pages_offset = sizeof(hdr) + m->n_harts * sizeof(c) +
+                       n_pages * sizeof(uint32_t);
+    hdr.pages_offset = (hdr.pages_offset + RAM_PAGE_SIZE - 1) &
+                       ~(uint64_t)(RAM_PAGE_SIZE - 1);
+    hdr.ram_start = m->ram_start;
+    hdr.ram_last = m->ram_last;
+    hdr.begin_signature = m->begin_signature;
+    hdr.end_signature = m->end_signature;
+    hdr.timer_deterministic = m->timer_deterministic != 0;
+
+    f = fopen(file, "wb");
+    if (f == NULL) {
+        free(pages);
+        return -1;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    for (uint32_t i = 0; i < m->n_harts; i++) {
+        checkpoint_save_hart(&c, &m->hart[i]);
+        fwrite(&c, sizeof(c), 1, f);
+    }
+    fwrite(pages, sizeof(uint32_t), n_pages, f);
+    fseek(f, hdr.pages_offset, SEEK_SET);
+    for (uint32_t i = 0; i < n_pages; i++)
+        fwrite(m->ram + (size_t) pages[i] * RAM_PAGE_SIZE, RAM_PAGE_SIZE, 1, f);
+    free(pages);
+    if (ferror(f)) {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/* create a machine in the state saved in 'file', in the guard page mode if
+ * 'guard_pages' and the host can do it. Returns NULL if the file can't be
+ * read or was not written by this version. */
+struct machine *checkpoint_load(const char *file, int guard_pages)
+{
+    const struct checkpoint_header *hdr;
+    const struct checkpoint_hart *c;
+    const uint32_t *pages;
+    struct machine *m = NULL;
+    struct stat st;
+    uint8_t *p;
+
+    int fd = open(file, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    hdr = (const struct checkpoint_header *) p;
+    c = (const struct checkpoint_hart *) (hdr + 1);
+    if (memcmp(hdr->magic, CHECKPOINT_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != CHECKPOINT_VERSION ||
+        hdr->byte_order != CHECKPOINT_BYTE_ORDER ||
+        hdr->page_size != RAM_PAGE_SIZE ||
+        hdr->n_harts < 1 || hdr->n_harts > MAX_HARTS ||
+        hdr->n_pages > (hdr->ram_size >> RAM_PAGE_BITS) ||
+        hdr->pages_offset < sizeof(*hdr) + hdr->n_harts * sizeof(*c) +
+                                hdr->n_pages * sizeof(uint32_t) ||
+        hdr->pages_offset > (uint64_t) st.st_size ||
+        (uint64_t) hdr->n_pages * RAM_PAGE_SIZE >
+            (uint64_t) st.st_size - hdr->pages_offset) {
+        debug_out("incompatible checkpoint %s\n", file);
+        goto done;
+    }
+    pages = (const uint32_t *) (c + hdr->n_harts);
+
+    m = machine_new(hdr->n_harts, hdr->ram_size);
+    if (m == NULL)
+        goto done;
+    m->ram_start = hdr->ram_start;
+    if (guard_pages)
+        machine_map_guest(m);
+    m->ram_last = hdr->ram_last;
+    m->begin_signature = hdr->begin_signature;
+    m->end_signature = hdr->end_signature;
+    m->timer_deterministic = hdr->timer_deterministic ? TRUE : FALSE;
+    for (uint32_t i = 0, n; i < hdr->n_pages; i += n) {
+        /* each run of consecutive pages is mapped at once */
+        for (n = 1; i + n < hdr->n_pages && pages[i + n] == pages[i] + n; n++)
+            ;
+        if (pages[i] >= m->ram_pages || n > m->ram_pages - pages[i] ||
+            machine_load_file(m, pages[i] << RAM_PAGE_BITS, fd,
+                              hdr->pages_offset + (uint64_t) i * RAM_PAGE_SIZE,
+                              n * RAM_PAGE_SIZE)) {
+            machine_free(m);
+            m = NULL;
+            goto done;
+        }
+    }
+    for (uint32_t i = 0; i < hdr->n_harts; i++)
+        checkpoint_load_hart(&m->hart[i], &c[i]);
+
+done:
+    munmap(p, st.st_size);
+    close(fd);
+    return m;
+}
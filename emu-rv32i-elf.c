@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #include <gelf.h>
 #include <libelf.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,210 +19,906 @@
 #include <unistd.h>
 
 #include "emu-rv32i.h"
+#include "emu-rv32i-checkpoint.h"
+#include "emu-rv32i-jit.h"
+#include "emu-rv32i-symbols.h"
 
-/* returns realtime in nanoseconds */
-int64_t get_clock()
+void riscv_cpu_interp_x32(struct hart *h)
 {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
-}
-
+    struct block *b = NULL;
 
-void riscv_cpu_interp_x32()
-{
     /* we use a single execution loop to keep a simple control flow for
-     * emscripten */
-    while (machine_running) {
-#if 1
-        /* update timer, assuming 10 MHz clock (100 ns period) for the mtime
-         * counter */
-        mtime = get_clock() / 100ll;
-
-        /* for reproducible debug runs, you can use a fixed fixed increment per
-         * instruction */
-#else
-        mtime += 10;
-#endif
-        /* default value for next PC is next instruction, can be changed by
-         * branches or exceptions */
-        next_pc = pc + 4;
-
-        /* test for timer interrupt */
-        if (mtimecmp <= mtime) {
-            mip |= MIP_MTIP;
+     * emscripten. Timer and interrupts are handled between basic blocks. */
+    while (__atomic_load_n(&h->m->running, __ATOMIC_RELAXED)) {
+        /* test for timer interrupt, see timer_update() */
+        timer_check(h);
+        /* irq_pending may be set by another hart, see mip_set() */
+        if (__atomic_load_n(&h->irq_pending, __ATOMIC_RELAXED) &&
+            raise_interrupt(h)) {
+            h->pc = h->next_pc;
+            continue;
         }
-        if ((mip & mie) != 0 && (mstatus & MSTATUS_MIE)) {
-            raise_interrupt();
-        } else {
+        /* blocks end before break_pc, see block_translate() */
+        if (h->pc == h->m->break_pc) {
+            machine_stop(h->m, STOP_BREAK);
+            break;
+        }
+
+        if (h->m->engine == ENGINE_SWITCH) {
+            uint32_t paddr = h->pc, len, last;
+
             /* normal instruction execution */
-            insn = get_insn32(pc);
-            insn_counter++;
+            if (fetch_translate(h, &paddr) ||
+                fetch_insn(h, h->pc, paddr, &h->insn, &len, &last)) {
+                raise_exception(h, h->pending_exception, h->pending_tval);
+                h->pc = h->next_pc;
+                continue;
+            }
+            h->next_pc = h->pc + len;
+            h->insn_counter++;
 
-            debug_out("[%08x]=%08x, mtime: %lx, mtimecmp: %lx\n", pc, insn,
-                      mtime, mtimecmp);
-            execute_instruction();
+            debug_out("[%08x]=%08x, mtime: %lx, mtimecmp: %lx\n", h->pc,
+                      h->insn, timer_read(h), h->mtimecmp);
+            execute_instruction(h);
+        } else {
+            /* every block is decoded only once and chained to its
+             * successors */
+            b = block_find(h, b, h->pc);
+            if (b == NULL) {
+                /* fetch page fault */
+                raise_exception(h, h->pending_exception, h->pending_tval);
+                h->pc = h->next_pc;
+                continue;
+            }
+            h->block = b;
+            switch (h->m->engine) {
+#ifdef HAVE_JIT
+            case ENGINE_JIT:
+                jit_block_exec(h, b);
+                break;
+#endif
+#ifdef HAVE_THREADED_CODE
+            case ENGINE_THREADED:
+                block_exec_threaded(h, b);
+                break;
+#endif
+            default:
+                block_exec(h, b);
+                break;
+            }
+            /* insn_counter is exact again, see insn_retired() */
+            h->block = NULL;
         }
 
         /* test for misaligned fetches */
-        if (next_pc & 3) {
-            raise_exception(CAUSE_MISALIGNED_FETCH, next_pc);
+        if (h->next_pc & pc_align_mask(h)) {
+            raise_exception(h, CAUSE_MISALIGNED_FETCH, h->next_pc);
         }
 
         /* update current PC */
-        pc = next_pc;
+        h->pc = h->next_pc;
     }
 
     debug_out("done interp %lx int=%x mstatus=%lx prv=%d\n",
-              (uint64_t) insn_counter, mip & mie, (uint64_t) mstatus, priv);
+              (uint64_t) h->insn_counter, h->mip & h->mie,
+              (uint64_t) h->mstatus, h->priv);
 }
 
-int main(int argc, char **argv)
+/* run 'h' until the machine stops */
+static void hart_run(struct hart *h)
 {
-#ifdef DEBUG_OUTPUT
-    FILE *fo;
-    char *po, hex_file[100];
-#endif
+    /* faulting accesses of the guard page mode come back here, see
+     * machine_map_guest(). The handler is set up whenever the machine has
+     * the guard mapping, mmu_update() may only enable it later. */
+    if (h->m->guest_base) {
+        guard_hart = h;
+        if (sigsetjmp(h->fault_env, 0))
+            guard_fault(h);
+    }
+    riscv_cpu_interp_x32(h);
+    guard_hart = NULL;
+}
 
-    /* automatic STDOUT flushing, no fflush needed */
-    setvbuf(stdout, NULL, _IONBF, 0);
+/* harts other than hart 0 run on their own host thread */
+static void *hart_thread(void *arg)
+{
+    hart_run(arg);
+    return NULL;
+}
 
-    /* parse command line */
-    const char *elf_file = NULL;
-    const char *signature_file = NULL;
-    for (int i = 1; i < argc; i++) {
-        char *arg = argv[i];
-        if (arg == strstr(arg, "+signature=")) {
-            signature_file = arg + 11;
-        } else if (arg[0] != '-') {
-            elf_file = arg;
-        }
-    }
-    if (elf_file == NULL) {
-        printf("missing ELF file\n");
-        return 1;
-    }
+/* PT_LOAD program header of an ELF file */
+struct segment {
+    uint32_t vaddr;
+    uint32_t filesz;
+    uint32_t memsz; /* the rest after filesz is zero */
+    uint64_t offset; /* of the data in the file */
+};
+
+/* guest image of an ELF file. Every machine running it loads the segments
+ * from the file, see machine_load_file(). */
+struct program {
+    const char *elf_file;
+    struct segment *segments;
+    uint32_t n_segments;
+    uint32_t ram_start; /* lowest segment address, page aligned */
+    uint32_t ram_last;  /* last byte of the file data, from ram_start */
+    uint64_t mem_size;  /* bytes of RAM needed, including .bss */
+    uint32_t entry;
+    uint32_t mtvec;
+    uint32_t begin_signature;
+    uint32_t end_signature;
+
+    struct symtab symtab;
+};
+
+/* one run of a program, with its options and results */
+struct job {
+    char *line; /* manifest line the options point into */
+    const char *elf_file;
+    const char *signature_file;
+    int timer_deterministic;
+    uint32_t n_harts;
+    uint32_t ram_size;
+    uint32_t misa, zext; /* extensions of the harts, see isa_parse() */
+    int guard_pages; /* see machine_map_guest() */
+    uint64_t insn_budget; /* per hart, 0 for none */
+    uint64_t timeout_ms;  /* 0 for none */
+    uint32_t repeat;      /* runs from a snapshot of the initial state */
+    const char *resume_file;     /* checkpoint to start from */
+    const char *checkpoint_file; /* written at checkpoint_at */
+    const char *checkpoint_at;   /* instruction count or symbol */
+
+    struct program *prog;
+    int status; /* see STOP_x, or JOB_FAILED */
+    uint64_t ns;
+    uint64_t insn_counter;
+    uint64_t jump_counter;
+    uint64_t backward_counter;
+    uint64_t forward_counter;
+    uint64_t true_counter;
+    uint64_t false_counter;
+    uint32_t pc; /* of hart 0 when the run stopped */
+};
+
+#define JOB_FAILED (-1)
+
+/* jobs of a manifest, taken in order by the worker threads */
+struct batch {
+    struct job *jobs;
+    uint32_t n_jobs;
+    uint32_t next_job;
+
+    /* every ELF file is parsed once */
+    struct program **progs;
+    uint32_t n_progs;
+};
+
+static void program_free(struct program *p)
+{
+    if (p == NULL)
+        return;
+    symtab_free(&p->symtab);
+    free(p->segments);
+    free(p);
+}
 
-    for (uint32_t u = 0; u < RAM_SIZE; u++)
-        ram[u] = 0;
+/* address of the symbol 'name', returns -1 if not found */
+static int program_symbol(const struct program *p, const char *name,
+                          uint32_t *paddr)
+{
+    const struct symbol *s = symtab_lookup(&p->symtab, name);
 
+    if (s == NULL)
+        return -1;
+    *paddr = s->addr;
+    return 0;
+}
 
-#ifdef DEBUG_EXTRA
-    init_stats();
-#endif
+/* read the program headers and the symbols of an ELF file, returns NULL on
+ * error */
+static struct program *program_load(const char *elf_file)
+{
+    struct program *p;
+    struct stat st;
+    GElf_Ehdr ehdr;
+    GElf_Phdr phdr;
+    size_t n_phdrs;
+    uint64_t start = UINT64_MAX, end = 0, last = 0;
 
-    uint32_t start = 0;
-    
-    /* open ELF file */
-    elf_version(EV_CURRENT);
     int fd = open(elf_file, O_RDONLY);
     if (fd == -1) {
         printf("can't open file %s\n", elf_file);
-        return 1;
+        return NULL;
+    }
+    p = calloc(1, sizeof(struct program));
+    if (p == NULL) {
+        close(fd);
+        return NULL;
     }
+    p->elf_file = elf_file;
     Elf *elf = elf_begin(fd, ELF_C_READ, NULL);
+    if (elf == NULL || gelf_getehdr(elf, &ehdr) == NULL ||
+        elf_getphdrnum(elf, &n_phdrs) || fstat(fd, &st)) {
+        printf("%s is not an ELF file\n", elf_file);
+        goto fail;
+    }
+    p->entry = ehdr.e_entry;
+
+    /* the loadable segments, .bss is the part of memsz after filesz */
+    p->segments = calloc(n_phdrs ? n_phdrs : 1, sizeof(struct segment));
+    if (p->segments == NULL) {
+        printf("out of memory\n");
+        goto fail;
+    }
+    for (size_t i = 0; i < n_phdrs; i++) {
+        if (gelf_getphdr(elf, i, &phdr) == NULL || phdr.p_type != PT_LOAD ||
+            phdr.p_memsz == 0)
+            continue;
+        if (phdr.p_filesz > phdr.p_memsz ||
+            phdr.p_vaddr + phdr.p_memsz > 0x100000000 ||
+            phdr.p_offset + phdr.p_filesz > (uint64_t) st.st_size) {
+            printf("invalid segment at address 0x%08x\n",
+                   (uint32_t) phdr.p_vaddr);
+            goto fail;
+        }
+        struct segment *sg = &p->segments[p->n_segments++];
+        sg->vaddr = phdr.p_vaddr;
+        sg->filesz = phdr.p_filesz;
+        sg->memsz = phdr.p_memsz;
+        sg->offset = phdr.p_offset;
+        if (sg->vaddr < start)
+            start = sg->vaddr;
+        if (sg->vaddr + (uint64_t) sg->memsz > end)
+            end = sg->vaddr + (uint64_t) sg->memsz;
+        if (sg->vaddr + (uint64_t) sg->filesz > last)
+            last = sg->vaddr + (uint64_t) sg->filesz;
+    }
+    if (p->n_segments == 0) {
+        printf("%s has nothing to load\n", elf_file);
+        goto fail;
+    }
+    p->ram_start = start & ~(uint64_t)(RAM_PAGE_SIZE - 1);
+    p->mem_size = end - p->ram_start;
+    p->ram_last = last > p->ram_start ? last - p->ram_start - 1 : 0;
+    if (p->mem_size > RAM_SIZE_MAX) {
+        printf("segments at 0x%08x to 0x%08x do not fit in RAM\n",
+               p->ram_start, (uint32_t)(end - 1));
+        goto fail;
+    }
 
     /* scan for symbol table */
     Elf_Scn *scn = NULL;
     GElf_Shdr shdr;
     while ((scn = elf_nextscn(elf, scn)) != NULL) {
         gelf_getshdr(scn, &shdr);
-        if (shdr.sh_type == SHT_SYMTAB) {
-            Elf_Data *data = elf_getdata(scn, NULL);
-            int count = shdr.sh_size / shdr.sh_entsize;
-            for (int i = 0; i < count; i++) {
-                GElf_Sym sym;
-                gelf_getsym(data, i, &sym);
-                char *name = elf_strptr(elf, shdr.sh_link, sym.st_name);
-                if (strcmp(name, "begin_signature") == 0) {
-                    begin_signature = sym.st_value;
-                }
-                if (strcmp(name, "end_signature") == 0) {
-                    end_signature = sym.st_value;
-                }
+        if (shdr.sh_type != SHT_SYMTAB)
+            continue;
+        Elf_Data *data = elf_getdata(scn, NULL);
+        int count = shdr.sh_size / shdr.sh_entsize;
+        for (int i = 0; data && i < count; i++) {
+            GElf_Sym sym;
+            gelf_getsym(data, i, &sym);
+            char *name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+            int type = GELF_ST_TYPE(sym.st_info);
+            if (name == NULL || name[0] == 0 || type == STT_SECTION ||
+                type == STT_FILE)
+                continue;
+            if (symtab_add(&p->symtab, name, sym.st_value, sym.st_size,
+                           GELF_ST_BIND(sym.st_info) != STB_LOCAL)) {
+                printf("out of memory\n");
+                goto fail;
+            }
+        }
+    }
+    if (symtab_index(&p->symtab)) {
+        printf("out of memory\n");
+        goto fail;
+    }
+    program_symbol(p, "begin_signature", &p->begin_signature);
+    program_symbol(p, "end_signature", &p->end_signature);
+    /* for compliance test */
+    program_symbol(p, "_start", &p->entry);
+    /* for zephyr */
+    program_symbol(p, "__reset", &p->entry);
+    program_symbol(p, "__irq_wrapper", &p->mtvec);
+
+    debug_out("begin_signature: 0x%08x\n", p->begin_signature);
+    debug_out("end_signature: 0x%08x\n", p->end_signature);
+    debug_out("ram_start: 0x%08x\n", p->ram_start);
+    debug_out("entry point: 0x%08x\n", p->entry);
 
-                /* for compliance test */
-                if (strcmp(name, "_start") == 0) {
-                    start = sym.st_value;
-                }
+    /* close ELF file */
+    elf_end(elf);
+    close(fd);
+    return p;
 
-                /* for zephyr */
-                if (strcmp(name, "__reset") == 0) {
-                    start = sym.st_value;
-                }
-                if (strcmp(name, "__irq_wrapper") == 0) {
-                    mtvec = sym.st_value;
+fail:
+    elf_end(elf);
+    close(fd);
+    program_free(p);
+    return NULL;
+}
+
+/* load the segments of 'p' to the RAM of 'm', returns -1 on error */
+static int program_map(const struct program *p, struct machine *m)
+{
+    int ret = 0;
+    int fd = open(p->elf_file, O_RDONLY);
+
+    if (fd == -1)
+        return -1;
+    for (uint32_t i = 0; i < p->n_segments && ret == 0; i++) {
+        const struct segment *sg = &p->segments[i];
+        ret = machine_load_file(m, sg->vaddr - p->ram_start, fd, sg->offset,
+                                sg->filesz);
+    }
+    close(fd);
+    return ret;
+}
+
+#ifdef DEBUG_OUTPUT
+/* the file data of 'p' from ram_start to ram_last, for the dumps */
+static uint8_t *program_image(const struct program *p)
+{
+    uint8_t *image = calloc(p->ram_last + 1, 1);
+    int fd = open(p->elf_file, O_RDONLY);
+
+    for (uint32_t i = 0; image && fd != -1 && i < p->n_segments; i++) {
+        const struct segment *sg = &p->segments[i];
+        file_read(fd, image + (sg->vaddr - p->ram_start), sg->filesz,
+                  sg->offset);
+    }
+    if (fd != -1)
+        close(fd);
+    return image;
+}
+#endif
+
+/* parse an option of a job, returns -1 if it is not valid */
+static int job_option(struct job *j, const char *arg)
+{
+    if (arg == strstr(arg, "+signature=")) {
+        j->signature_file = arg + 11;
+    } else if (arg == strstr(arg, "+timer=")) {
+        if (strcmp(arg + 7, "host") == 0) {
+            j->timer_deterministic = FALSE;
+        } else if (strcmp(arg + 7, "deterministic") == 0) {
+            j->timer_deterministic = TRUE;
+        } else {
+            printf("unknown timer %s\n", arg + 7);
+            return -1;
+        }
+    } else if (arg == strstr(arg, "+harts=")) {
+        j->n_harts = strtoul(arg + 7, NULL, 0);
+        if (j->n_harts < 1 || j->n_harts > MAX_HARTS) {
+            printf("number of harts must be 1 to %d\n", MAX_HARTS);
+            return -1;
+        }
+    } else if (arg == strstr(arg, "+ram=")) {
+        char *end;
+        uint64_t size = strtoull(arg + 5, &end, 0);
+        if (*end == 'k' || *end == 'K')
+            size <<= 10, end++;
+        else if (*end == 'm' || *end == 'M')
+            size <<= 20, end++;
+        else if (*end == 'g' || *end == 'G')
+            size <<= 30, end++;
+        if (*end || size < RAM_PAGE_SIZE || size > RAM_SIZE_MAX ||
+            (size & (RAM_PAGE_SIZE - 1))) {
+            printf("RAM size must be a multiple of %d bytes up to 2G\n",
+                   RAM_PAGE_SIZE);
+            return -1;
+        }
+        j->ram_size = size;
+    } else if (arg == strstr(arg, "+isa=")) {
+        if (isa_parse(arg + 5, &j->misa, &j->zext)) {
+            printf("unsupported ISA %s\n", arg + 5);
+            return -1;
+        }
+    } else if (arg == strstr(arg, "+memory=")) {
+        if (strcmp(arg + 8, "checked") == 0) {
+            j->guard_pages = FALSE;
+        } else if (strcmp(arg + 8, "guard") == 0) {
+            j->guard_pages = TRUE;
+        } else {
+            printf("unknown memory mode %s\n", arg + 8);
+            return -1;
+        }
+    } else if (arg == strstr(arg, "+budget=")) {
+        j->insn_budget = strtoull(arg + 8, NULL, 0);
+    } else if (arg == strstr(arg, "+timeout=")) {
+        j->timeout_ms = strtoull(arg + 9, NULL, 0);
+    } else if (arg == strstr(arg, "+resume=")) {
+        j->resume_file = arg + 8;
+    } else if (arg == strstr(arg, "+checkpoint=")) {
+        j->checkpoint_file = arg + 12;
+    } else if (arg == strstr(arg, "+checkpoint-at=")) {
+        j->checkpoint_at = arg + 15;
+    } else if (arg == strstr(arg, "+repeat=")) {
+        j->repeat = strtoul(arg + 8, NULL, 0);
+        if (j->repeat < 1)
+            j->repeat = 1;
+    } else if (arg[0] == '+') {
+        printf("unknown option %s\n", arg);
+        return -1;
+    } else {
+        j->elf_file = arg;
+    }
+    return 0;
+}
+
+/* run all harts of 'm' until it stops, returns the STOP_x reason */
+static int machine_run(struct machine *m)
+{
+    pthread_t threads[MAX_HARTS];
+    uint32_t n_threads = 1;
+    int status = JOB_FAILED;
+
+    for (; n_threads < m->n_harts; n_threads++) {
+        if (pthread_create(&threads[n_threads], NULL, hart_thread,
+                           &m->hart[n_threads])) {
+            printf("can't start hart %u\n", n_threads);
+            machine_stop(m, STOP_EXIT);
+            break;
+        }
+    }
+    if (n_threads == m->n_harts) {
+        hart_run(&m->hart[0]);
+        status = m->stop_reason;
+    }
+    for (uint32_t i = 1; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+    return status;
+}
+
+/* add the counters of all harts to the results of 'j' */
+static void job_count(struct job *j, const struct machine *m)
+{
+    for (uint32_t i = 0; i < m->n_harts; i++) {
+        const struct hart *h = &m->hart[i];
+        j->insn_counter += h->insn_counter;
+        j->jump_counter += h->jump_counter;
+        j->forward_counter += h->forward_counter;
+        j->backward_counter += h->backward_counter;
+        j->true_counter += h->true_counter;
+        j->false_counter += h->false_counter;
+    }
+}
+
+/* run 'm' up to the checkpoint of 'j' and write it, returns -1 if the
+ * checkpoint was not reached or can't be written */
+static int job_checkpoint(struct job *j, struct machine *m)
+{
+    const char *at = j->checkpoint_at ? j->checkpoint_at : "0";
+    char *end;
+    uint64_t n = strtoull(at, &end, 0);
+
+    if (*end == 0) {
+        /* instructions of hart 0 from its current count, 0 for the initial
+         * state */
+        if (n)
+            m->break_insns = m->hart[0].insn_counter + n;
+    } else if (j->prog == NULL ||
+               program_symbol(j->prog, at, &m->break_pc)) {
+        printf("symbol %s not found\n", at);
+        return -1;
+    }
+    if (m->break_insns || m->break_pc != BREAK_NONE) {
+        j->status = machine_run(m);
+        if (j->status != STOP_BREAK) {
+            printf("checkpoint %s not reached\n", at);
+            j->status = JOB_FAILED;
+            return -1;
+        }
+    }
+    if (checkpoint_write(m, j->checkpoint_file)) {
+        printf("can't write checkpoint %s\n", j->checkpoint_file);
+        j->status = JOB_FAILED;
+        return -1;
+    }
+
+    /* continue the run after the checkpoint */
+    m->break_insns = 0;
+    m->break_pc = BREAK_NONE;
+    m->running = TRUE;
+    m->stop_reason = STOP_EXIT;
+    for (uint32_t i = 0; i < m->n_harts; i++)
+        m->hart[i].timer_deadline = 0;
+    return 0;
+}
+
+/* run the program of 'j' on a new machine and collect the results */
+static void job_run(struct job *j)
+{
+    const struct program *p = j->prog;
+    struct machine *m;
+    struct snapshot *s = NULL;
+
+    j->status = JOB_FAILED;
+    if (j->resume_file) {
+        m = checkpoint_load(j->resume_file, j->guard_pages);
+        if (m == NULL) {
+            printf("can't resume from checkpoint %s\n", j->resume_file);
+            return;
+        }
+    } else {
+        if (p == NULL)
+            return;
+        if (p->mem_size > j->ram_size ||
+            (uint64_t) p->ram_start + j->ram_size > 0x100000000) {
+            printf("%s does not fit in %u bytes of RAM at 0x%08x\n",
+                   p->elf_file, j->ram_size, p->ram_start);
+            return;
+        }
+        m = machine_new(j->n_harts, j->ram_size);
+        if (m == NULL) {
+            printf("out of memory\n");
+            return;
+        }
+        m->ram_start = p->ram_start;
+        /* before the segments are mapped into the reservation */
+        if (j->guard_pages)
+            machine_map_guest(m);
+        if (program_map(p, m)) {
+            printf("can't load %s\n", p->elf_file);
+            machine_free(m);
+            return;
+        }
+        m->ram_last = p->ram_last;
+        m->begin_signature = p->begin_signature;
+        m->end_signature = p->end_signature;
+        m->timer_deterministic = j->timer_deterministic;
+
+        /* All harts start at the entry point with the same stack pointer,
+         * software sets up its own stacks from mhartid. */
+        for (uint32_t i = 0; i < m->n_harts; i++) {
+            m->hart[i].pc = p->entry;
+            m->hart[i].reg[2] = m->ram_start + m->ram_size;
+            m->hart[i].mtvec = p->mtvec;
+            m->hart[i].misa = j->misa;
+            m->hart[i].zext = j->zext;
+        }
+    }
+    m->insn_budget = j->insn_budget;
+    if (j->guard_pages && m->guest_base == NULL) {
+        debug_out("can't reserve the guest address space, checking the "
+                  "bounds of memory accesses\n");
+    }
+
+#ifdef HAVE_JIT
+    /* only this machine falls back, the jobs of a batch share exec_engine */
+    for (uint32_t i = 0; i < m->n_harts && m->engine == ENGINE_JIT; i++) {
+        if (jit_init(&m->hart[i]) != 0) {
+            debug_out("no executable memory, falling back to the "
+                      "interpreter\n");
+            m->engine = ENGINE_BLOCK;
+#ifdef HAVE_THREADED_CODE
+            m->engine = ENGINE_THREADED;
+#endif
+        }
+    }
+#endif
+
+    uint64_t ns1 = get_clock();
+    if (j->checkpoint_file && job_checkpoint(j, m)) {
+        j->ns = get_clock() - ns1;
+        goto done;
+    }
+
+    /* repeated runs start from a snapshot instead of a new machine */
+    if (j->repeat > 1) {
+        s = snapshot_new(m);
+        if (s == NULL) {
+            printf("out of memory\n");
+            j->repeat = 1;
+        }
+    }
+
+    for (uint32_t r = 0; r < j->repeat; r++) {
+        if (r > 0) {
+            job_count(j, m);
+            snapshot_restore(m, s);
+        }
+        if (j->timeout_ms)
+            m->stop_time = get_clock() + j->timeout_ms * 1000000;
+        j->status = machine_run(m);
+        if (j->status != STOP_EXIT)
+            break;
+    }
+    j->ns = get_clock() - ns1;
+    j->pc = m->hart[0].pc;
+    snapshot_free(s);
+
+    /* write signature */
+    if (j->signature_file) {
+        FILE *sf = fopen(j->signature_file, "w");
+        uint32_t addr = m->begin_signature;
+        int size = m->end_signature - m->begin_signature;
+        if (addr - m->ram_start > m->ram_size ||
+            (uint32_t) size > m->ram_size - (addr - m->ram_start))
+            size = 0;
+        if (sf == NULL) {
+            printf("can't write signature file %s\n", j->signature_file);
+            j->status = JOB_FAILED;
+        } else {
+            for (int i = 0; i < size / 16; i++) {
+                for (int k = 0; k < 16; k++) {
+                    fprintf(sf, "%02x",
+                            m->ram[addr + 15 - k - m->ram_start]);
                 }
+                addr += 16;
+                fprintf(sf, "\n");
             }
+            fclose(sf);
         }
     }
 
-    /* set .text section as the base address */
-    scn = NULL;
-    size_t shstrndx;
-    elf_getshdrstrndx(elf, &shstrndx);
-    while ((scn = elf_nextscn(elf, scn)) != NULL) {
-        gelf_getshdr(scn, &shdr);
-        const char *name = elf_strptr(elf, shstrndx, shdr.sh_name);
+#ifdef DEBUG_EXTRA
+    dump_regs(&m->hart[0]);
+    print_stats(m->hart[0].insn_counter);
+#endif
 
-        if (shdr.sh_type == SHT_PROGBITS) {
-            if (strcmp(name, ".text") == 0) {
-                ram_start = shdr.sh_addr;
-                break;
+done:
+    job_count(j, m);
+#ifdef HAVE_JIT
+    for (uint32_t i = 0; i < m->n_harts; i++)
+        jit_free(&m->hart[i]);
+#endif
+    machine_free(m);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct batch *b = arg;
+    uint32_t i;
+
+    while ((i = __atomic_fetch_add(&b->next_job, 1, __ATOMIC_RELAXED)) <
+           b->n_jobs)
+        job_run(&b->jobs[i]);
+    return NULL;
+}
+
+/* read the jobs of a manifest, one per line: the ELF file followed by job
+ * options. Options not given default to the ones of 'defaults'. */
+static int manifest_read(struct batch *b, const char *file,
+                         const struct job *defaults)
+{
+    char line[4096];
+    uint32_t n_alloc = 0;
+
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        printf("can't open manifest %s\n", file);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *arg, *save, *copy;
+        struct job *j;
+
+        if (line[strspn(line, " \t\r\n")] == '#' ||
+            line[strspn(line, " \t\r\n")] == 0)
+            continue;
+        if (b->n_jobs == n_alloc) {
+            n_alloc = n_alloc ? n_alloc * 2 : 64;
+            b->jobs = realloc(b->jobs, n_alloc * sizeof(struct job));
+            if (b->jobs == NULL) {
+                printf("out of memory\n");
+                fclose(f);
+                return -1;
             }
         }
+        copy = strdup(line);
+        if (copy == NULL) {
+            printf("out of memory\n");
+            fclose(f);
+            return -1;
+        }
+        j = &b->jobs[b->n_jobs++];
+        *j = *defaults;
+        j->line = copy;
+        j->elf_file = NULL;
+        j->signature_file = NULL;
+        j->resume_file = NULL;
+        j->checkpoint_file = NULL;
+        for (arg = strtok_r(copy, " \t\r\n", &save); arg;
+             arg = strtok_r(NULL, " \t\r\n", &save)) {
+            if (job_option(j, arg)) {
+                fclose(f);
+                return -1;
+            }
+        }
+        if (j->elf_file == NULL && j->resume_file == NULL) {
+            printf("missing ELF file in manifest %s\n", file);
+            fclose(f);
+            return -1;
+        }
     }
+    fclose(f);
+    return 0;
+}
 
-    debug_out("begin_signature: 0x%08x\n", begin_signature);
-    debug_out("end_signature: 0x%08x\n", end_signature);
-    debug_out("ram_start: 0x%08x\n", ram_start);
-    debug_out("entry point: 0x%08x\n", start);
+static const char *job_status(const struct job *j)
+{
+    switch (j->status) {
+    case STOP_EXIT:
+        return "ok";
+    case STOP_BUDGET:
+        return "budget";
+    case STOP_TIMEOUT:
+        return "timeout";
+    case STOP_BREAK:
+        return "break";
+    }
+    return "failed";
+}
 
-    /* scan for program */
-    scn = NULL;
-    while ((scn = elf_nextscn(elf, scn)) != NULL) {
-        gelf_getshdr(scn, &shdr);
+/* run all jobs of a manifest on 'n_workers' threads and print one report,
+ * returns 0 if all jobs ended normally */
+static int batch_run(const char *manifest, uint32_t n_workers,
+                     const struct job *defaults)
+{
+    struct batch b = {NULL, 0, 0, NULL, 0};
+    pthread_t *threads;
+    /* the STOP_x reasons, then the failed jobs */
+    uint32_t n_status[STOP_BREAK + 2] = {0};
+    uint64_t insn_counter = 0;
+    uint32_t n_threads;
+
+    if (manifest_read(&b, manifest, defaults) ||
+        !(b.progs = calloc(b.n_jobs, sizeof(struct program *))))
+        return 1;
+    /* no more threads than jobs */
+    if (n_workers > b.n_jobs)
+        n_workers = b.n_jobs;
+    threads = calloc(n_workers ? n_workers : 1, sizeof(pthread_t));
+    if (threads == NULL)
+        n_workers = 0;
+
+    /* load the programs up front, libelf is not used concurrently */
+    for (uint32_t i = 0; i < b.n_jobs; i++) {
+        struct job *j = &b.jobs[i];
+        if (j->elf_file == NULL)
+            continue;
+        for (uint32_t k = 0; k < b.n_progs && !j->prog; k++) {
+            if (strcmp(b.progs[k]->elf_file, j->elf_file) == 0)
+                j->prog = b.progs[k];
+        }
+        if (j->prog == NULL && (j->prog = program_load(j->elf_file)))
+            b.progs[b.n_progs++] = j->prog;
+    }
 
-        /* filter NULL address sections and .bss */
-        if (shdr.sh_addr && shdr.sh_type != SHT_NOBITS) {
-            Elf_Data *data = elf_getdata(scn, NULL);
-            if (shdr.sh_addr >= ram_start) {
-                for (size_t i = 0; i < shdr.sh_size; i++) {
-                    ram_curr = shdr.sh_addr + i - ram_start;
-                    if (ram_curr >= RAM_SIZE) {
-                        debug_out(
-                            "memory pointer outside of range 0x%08x (section "
-                            "at address 0x%08x)\n",
-                            ram_curr, (uint32_t) shdr.sh_addr);
-                        /* break; */
-                    } else {
-                        ram[ram_curr] = ((uint8_t *) data->d_buf)[i];
-                        if (ram_curr > ram_last)
-                            ram_last = ram_curr;
-                    }
-                }
+    uint64_t ns1 = get_clock();
+    for (n_threads = 0; n_threads < n_workers; n_threads++) {
+        if (pthread_create(&threads[n_threads], NULL, worker_thread, &b))
+            break;
+    }
+    if (n_threads == 0)
+        worker_thread(&b);
+    for (uint32_t i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+    uint64_t ns2 = get_clock();
+    free(threads);
+
+    printf("\n");
+    for (uint32_t i = 0; i < b.n_jobs; i++) {
+        const struct job *j = &b.jobs[i];
+        printf(">>> %s: %s, %llu instructions in %llu ns (IPS=%llu)\n",
+               j->elf_file ? j->elf_file : j->resume_file, job_status(j),
+               (long long unsigned) j->insn_counter,
+               (long long unsigned) j->ns,
+               j->ns ? (long long unsigned) j->insn_counter * 1000000000LL /
+                           j->ns
+                     : 0);
+        n_status[j->status == JOB_FAILED ? STOP_BREAK + 1 : j->status]++;
+        insn_counter += j->insn_counter;
+    }
+    printf(">>> Batch: %u jobs, %u ok, %u budget, %u timeout, %u break, "
+           "%u failed\n",
+           b.n_jobs, n_status[STOP_EXIT], n_status[STOP_BUDGET],
+           n_status[STOP_TIMEOUT], n_status[STOP_BREAK],
+           n_status[STOP_BREAK + 1]);
+    printf(">>> Execution time: %llu ns on %u workers\n",
+           (long long unsigned) ns2 - ns1, n_threads ? n_threads : 1);
+    printf(">>> Instruction count: %llu (IPS=%llu)\n",
+           (long long unsigned) insn_counter,
+           (long long) insn_counter * 1000000000LL / (ns2 - ns1));
+    printf("\n");
+
+    for (uint32_t i = 0; i < b.n_progs; i++)
+        program_free(b.progs[i]);
+    for (uint32_t i = 0; i < b.n_jobs; i++)
+        free(b.jobs[i].line);
+    free(b.progs);
+    free(b.jobs);
+    return n_status[STOP_EXIT] != b.n_jobs;
+}
+
+int main(int argc, char **argv)
+{
+#ifdef DEBUG_OUTPUT
+    FILE *fo;
+    char *po, hex_file[100];
+#endif
+
+    /* automatic STDOUT flushing, no fflush needed */
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+#ifdef HAVE_JIT
+    exec_engine = ENGINE_JIT;
+#endif
+
+    /* parse command line */
+    struct job job = {0};
+    const char *manifest = NULL;
+    uint32_t n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    job.n_harts = 1;
+    job.ram_size = RAM_SIZE;
+    job.misa = MISA_DEFAULT;
+    job.zext = ZEXT_DEFAULT;
+    job.repeat = 1;
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (arg == strstr(arg, "+engine=")) {
+            if (strcmp(arg + 8, "switch") == 0) {
+                exec_engine = ENGINE_SWITCH;
+            } else if (strcmp(arg + 8, "block") == 0) {
+                exec_engine = ENGINE_BLOCK;
+#ifdef HAVE_THREADED_CODE
+            } else if (strcmp(arg + 8, "threaded") == 0) {
+                exec_engine = ENGINE_THREADED;
+#endif
+#ifdef HAVE_JIT
+            } else if (strcmp(arg + 8, "jit") == 0) {
+                exec_engine = ENGINE_JIT;
+#endif
             } else {
-                debug_out("ignoring section at address 0x%08x\n",
-                          (uint32_t) shdr.sh_addr);
+                printf("unknown engine %s\n", arg + 8);
+                return 1;
             }
+        } else if (arg == strstr(arg, "+batch=")) {
+            manifest = arg + 7;
+        } else if (arg == strstr(arg, "+workers=")) {
+            n_workers = strtoul(arg + 9, NULL, 0);
+        } else if (arg[0] != '-' && job_option(&job, arg)) {
+            return 1;
         }
     }
+    if (n_workers < 1)
+        n_workers = 1;
 
-    /* close ELF file */
-    elf_end(elf);
-    close(fd);
+#ifdef DEBUG_EXTRA
+    init_stats();
+#endif
+
+    elf_version(EV_CURRENT);
+    if (manifest)
+        return batch_run(manifest, n_workers, &job);
+
+    if (job.elf_file == NULL && job.resume_file == NULL) {
+        printf("missing ELF file\n");
+        return 1;
+    }
+    if (job.elf_file) {
+        job.prog = program_load(job.elf_file);
+        if (job.prog == NULL)
+            return 1;
+    }
 
 #ifdef DEBUG_OUTPUT
-    printf("codesize: 0x%08x (%i)\n", ram_last + 1, ram_last + 1);
-    strcpy(hex_file, elf_file);
+    const struct program *p = job.prog;
+    uint8_t *image = p ? program_image(p) : NULL;
+    if (image == NULL)
+        goto run;
+    printf("codesize: 0x%08x (%i)\n", p->ram_last + 1, p->ram_last + 1);
+    strcpy(hex_file, job.elf_file);
     po = strrchr(hex_file, '.');
     if (po != NULL)
         *po = 0;
     strcat(hex_file, ".mem");
     fo = fopen(hex_file, "wt");
     if (fo != NULL) {
-        for (uint32_t u = 0; u <= ram_last; u++) {
-            fprintf(fo, "%02X ", ram[u]);
+        for (uint32_t u = 0; u <= p->ram_last; u++) {
+            fprintf(fo, "%02X ", image[u]);
             if ((u & 15) == 15)
                 fprintf(fo, "\n");
         }
@@ -232,7 +929,7 @@ int main(int argc, char **argv)
     fo = fopen("rom.v", "wt");
     if (fo != NULL) {
         fprintf(fo, "module rom(addr,data);\n");
-        uint32_t romsz = (ram_start & 0xFFFF) + ram_last + 1;
+        uint32_t romsz = (p->ram_start & 0xFFFF) + p->ram_last + 1;
         printf("codesize with offset: %i\n", romsz);
         if (romsz >= 32768)
             fprintf(fo, "input [15:0] addr;\n");
@@ -254,9 +951,9 @@ int main(int argc, char **argv)
             fprintf(fo, "input [7:0] addr;\n");
         fprintf(fo,
                 "output reg [7:0] data;\nalways @(addr) begin\n case(addr)\n");
-        for (uint32_t u = 0; u <= ram_last; u++) {
-            fprintf(fo, " %i : data = 8'h%02X;\n", (ram_start & 0xFFFF) + u,
-                    ram[u]);
+        for (uint32_t u = 0; u <= p->ram_last; u++) {
+            fprintf(fo, " %i : data = 8'h%02X;\n",
+                    (p->ram_start & 0xFFFF) + u, image[u]);
         }
         fprintf(fo,
                 " default: data = 8'h01; // invalid instruction\n "
@@ -264,53 +961,48 @@ int main(int argc, char **argv)
         fclose(fo);
     }
 #endif
+    free(image);
+run:
 #endif
 
-    uint64_t ns1 = get_clock();
-
-    /* run program in emulator */
-    pc = start;
-    reg[2] = ram_start + RAM_SIZE;
-    riscv_cpu_interp_x32();
-
-    uint64_t ns2 = get_clock();
-
-    /* write signature */
-    if (signature_file) {
-        FILE *sf = fopen(signature_file, "w");
-        int size = end_signature - begin_signature;
-        for (int i = 0; i < size / 16; i++) {
-            for (int j = 0; j < 16; j++) {
-                fprintf(sf, "%02x", ram[begin_signature + 15 - j - ram_start]);
-            }
-            begin_signature += 16;
-            fprintf(sf, "\n");
-        }
-        fclose(sf);
+    job_run(&job);
+    if (job.status == JOB_FAILED) {
+        program_free(job.prog);
+        return 1;
     }
 
-#ifdef DEBUG_EXTRA
-    dump_regs();
-    print_stats(insn_counter);
-#endif
-
 #if 1
     printf("\n");
-    printf(">>> Execution time: %llu ns\n", (long long unsigned) ns2 - ns1);
+    if (job.status != STOP_EXIT) {
+        const struct symbol *s =
+            job.prog ? symtab_find(&job.prog->symtab, job.pc) : NULL;
+        printf(">>> Stopped: %s at 0x%08x",
+               job.status == STOP_BUDGET  ? "instruction budget exhausted"
+               : job.status == STOP_BREAK ? "break"
+                                          : "timeout",
+               job.pc);
+        if (s)
+            printf(" <%s+0x%x>", symtab_name(&job.prog->symtab, s),
+                   job.pc - s->addr);
+        printf("\n");
+    }
+    printf(">>> Execution time: %llu ns\n", (long long unsigned) job.ns);
     printf(">>> Instruction count: %llu (IPS=%llu)\n",
-           (long long unsigned) insn_counter,
-           (long long) insn_counter * 1000000000LL / (ns2 - ns1));
+           (long long unsigned) job.insn_counter,
+           (long long) job.insn_counter * 1000000000LL / job.ns);
     printf(">>> Jumps: %llu (%2.2lf%%) - %llu forwards, %llu backwards\n",
-           (long long unsigned) jump_counter,
-           jump_counter * 100.0 / insn_counter,
-           (long long unsigned) forward_counter,
-           (long long unsigned) backward_counter);
+           (long long unsigned) job.jump_counter,
+           job.jump_counter * 100.0 / job.insn_counter,
+           (long long unsigned) job.forward_counter,
+           (long long unsigned) job.backward_counter);
     printf(">>> Branching T=%llu (%2.2lf%%) F=%llu (%2.2lf%%)\n",
-           (long long unsigned) true_counter,
-           true_counter * 100.0 / (true_counter + false_counter),
-           (long long unsigned) false_counter,
-           false_counter * 100.0 / (true_counter + false_counter));
+           (long long unsigned) job.true_counter,
+           job.true_counter * 100.0 / (job.true_counter + job.false_counter),
+           (long long unsigned) job.false_counter,
+           job.false_counter * 100.0 / (job.true_counter + job.false_counter));
     printf("\n");
 #endif
-    return 0;
+
+    program_free(job.prog);
+    return job.status != STOP_EXIT;
 }
@@ -0,0 +1,841 @@
+/*
+ * x86-64 code generator for hot basic blocks of the RISC-V emulator.
+ *
+ * rv32emu is freely redistributable under the MIT License. See the file
+ * "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/*
+ * Blocks executed JIT_HOT_THRESHOLD times are translated into native code.
+ * The guest registers stay in reg[] (rbx points to it), loads and stores go
+ * directly to ram[] when the address is inside the RAM window and aligned
+ * (and for stores, not a translated instruction), everything else (MMIO,
+ * faults, SYSTEM instructions, atomics, clz/ctz/cpop/orc.b which would need
+ * optional host instructions) calls the handler of the
+ * decoded instruction, so the guest sees the same behavior as with the
+ * interpreter.
+ *
+ * The code embeds the addresses of the registers, counters and RAM of its
+ * hart, so every hart has its own code buffer.
+ *
+ * The generated function returns the number of instructions of the block
+ * which were not executed because a handler raised an exception.
+ */
+
+#if defined(__x86_64__) && !defined(DEBUG_EXTRA)
+
+#define HAVE_JIT
+
+#include <string.h>
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (16 << 20)
+#define JIT_HOT_THRESHOLD 16
+/* upper bound of the code generated for one guest instruction */
+#define JIT_MAX_INSN_BYTES 160
+
+/* x86 registers */
+#define X86_EAX 0
+#define X86_ECX 1
+#define X86_EDX 2
+#define X86_EBX 3
+#define X86_ESI 6
+#define X86_EDI 7
+
+/* x86 condition codes */
+#define X86_CC_B 0x2
+#define X86_CC_AE 0x3
+#define X86_CC_E 0x4
+#define X86_CC_NE 0x5
+#define X86_CC_A 0x7
+#define X86_CC_L 0xc
+#define X86_CC_GE 0xd
+#define X86_CC_G 0xf
+
+static inline void emit8(struct hart *h, uint8_t val)
+{
+    *h->jit_ptr++ = val;
+}
+
+static inline void emit32(struct hart *h, uint32_t val)
+{
+    memcpy(h->jit_ptr, &val, 4);
+    h->jit_ptr += 4;
+}
+
+static inline void emit64(struct hart *h, uint64_t val)
+{
+    memcpy(h->jit_ptr, &val, 8);
+    h->jit_ptr += 8;
+}
+
+/* mov r32, reg[n] */
+static void emit_load_reg(struct hart *h, int r, int n)
+{
+    emit8(h, 0x8b);
+    emit8(h, 0x83 | (r << 3));
+    emit32(h, n * 4);
+}
+
+/* mov reg[n], r32 */
+static void emit_store_reg(struct hart *h, int n, int r)
+{
+    emit8(h, 0x89);
+    emit8(h, 0x83 | (r << 3));
+    emit32(h, n * 4);
+}
+
+/* mov dword reg[n], imm32 */
+static void emit_store_reg_imm(struct hart *h, int n, uint32_t imm)
+{
+    emit8(h, 0xc7);
+    emit8(h, 0x83);
+    emit32(h, n * 4);
+    emit32(h, imm);
+}
+
+/* <op> eax, reg[n] with op = add 0x03, or 0x0b, and 0x23, sub 0x2b,
+ * xor 0x33, cmp 0x3b */
+static void emit_alu_reg(struct hart *h, uint8_t op, int n)
+{
+    emit8(h, op);
+    emit8(h, 0x83);
+    emit32(h, n * 4);
+}
+
+/* <op> eax, imm32 with the short eax forms, see emit_alu_reg() */
+static void emit_alu_imm(struct hart *h, uint8_t op, uint32_t imm)
+{
+    emit8(h, op + 2);
+    emit32(h, imm);
+}
+
+/* movabs r64, imm64 */
+static void emit_mov_imm64(struct hart *h, int r, uint64_t imm)
+{
+    emit8(h, 0x48);
+    emit8(h, 0xb8 + r);
+    emit64(h, imm);
+}
+
+/* inc qword [counter] */
+static void emit_inc_counter(struct hart *h, uint64_t *counter)
+{
+    emit_mov_imm64(h, X86_EAX, (uintptr_t) counter);
+    emit8(h, 0x48);
+    emit8(h, 0xff);
+    emit8(h, 0x00);
+}
+
+/* next_pc = imm32 */
+static void emit_set_next_pc(struct hart *h, uint32_t val)
+{
+    emit_mov_imm64(h, X86_ECX, (uintptr_t) &h->next_pc);
+    emit8(h, 0xc7);
+    emit8(h, 0x01);
+    emit32(h, val);
+}
+
+/* setcc al after eax was cleared */
+static void emit_setcc(struct hart *h, int cc)
+{
+    emit8(h, 0x0f);
+    emit8(h, 0x90 | cc);
+    emit8(h, 0xc0);
+}
+
+/* jcc/jmp rel32, return the displacement to be fixed by emit_patch() */
+static uint8_t *emit_jcc(struct hart *h, int cc)
+{
+    emit8(h, 0x0f);
+    emit8(h, 0x80 | cc);
+    emit32(h, 0);
+    return h->jit_ptr - 4;
+}
+
+static uint8_t *emit_jmp(struct hart *h)
+{
+    emit8(h, 0xe9);
+    emit32(h, 0);
+    return h->jit_ptr - 4;
+}
+
+/* let the jump with displacement 'rel' continue here */
+static void emit_patch(struct hart *h, uint8_t *rel)
+{
+    uint32_t val = h->jit_ptr - (rel + 4);
+    memcpy(rel, &val, 4);
+}
+
+/* return 'remaining' from the generated function */
+static void emit_return(struct hart *h, uint32_t remaining)
+{
+    if (remaining) {
+        emit8(h, 0xb8);
+        emit32(h, remaining);
+    } else {
+        emit8(h, 0x31);
+        emit8(h, 0xc0);
+    }
+    emit8(h, 0x5b); /* pop rbx */
+    emit8(h, 0xc3); /* ret */
+}
+
+/* run the interpreter handler of 'd', leave the block if it raised an
+ * exception */
+static void emit_call_handler(struct hart *h, const struct decoded_insn *d,
+                              uint32_t remaining)
+{
+    uint8_t *skip;
+
+    emit_mov_imm64(h, X86_EDI, (uintptr_t) h);
+    emit_mov_imm64(h, X86_ESI, (uintptr_t) d);
+    emit_mov_imm64(h, X86_EAX, (uintptr_t) d->handler);
+    emit8(h, 0xff); /* call rax */
+    emit8(h, 0xd0);
+    emit8(h, 0x85); /* test eax, eax */
+    emit8(h, 0xc0);
+    emit8(h, 0x74); /* jz over the return */
+    emit8(h, 0);
+    skip = h->jit_ptr;
+    emit_return(h, remaining);
+    skip[-1] = h->jit_ptr - skip;
+}
+
+static void emit_jump_counters(struct hart *h, uint32_t pc, uint32_t target)
+{
+    emit_inc_counter(h, target > pc ? &h->forward_counter
+                                    : &h->backward_counter);
+    emit_inc_counter(h, &h->jump_counter);
+}
+
+/* eax = reg[rs1] + imm - ram_start, continue at the returned displacement
+ * when the access is misaligned or outside of the RAM */
+static uint8_t *emit_ram_offset(struct hart *h, const struct decoded_insn *d,
+                                int size, uint8_t **misaligned)
+{
+    emit_load_reg(h, X86_EAX, d->rs1);
+    if (d->imm)
+        emit_alu_imm(h, 0x03, d->imm);
+    *misaligned = NULL;
+    if (size > 1) {
+        emit8(h, 0xa8); /* test al, size - 1 */
+        emit8(h, size - 1);
+        *misaligned = emit_jcc(h, X86_CC_NE);
+    }
+    emit_alu_imm(h, 0x2b, h->m->ram_start);
+    emit_alu_imm(h, 0x3b, h->m->ram_size - size);
+    return emit_jcc(h, X86_CC_A);
+}
+
+static void emit_load(struct hart *h, const struct decoded_insn *d, int size,
+                      uint32_t remaining)
+{
+    uint8_t *misaligned, *outside, *done;
+
+    outside = emit_ram_offset(h, d, size, &misaligned);
+    emit_mov_imm64(h, X86_ECX, (uintptr_t) h->m->ram);
+    /* mov/movzx/movsx edx, [rcx + rax] */
+    switch (d->op) {
+    case INSN_LW:
+        emit8(h, 0x8b);
+        break;
+    case INSN_LH:
+        emit8(h, 0x0f);
+        emit8(h, 0xbf);
+        break;
+    case INSN_LHU:
+        emit8(h, 0x0f);
+        emit8(h, 0xb7);
+        break;
+    case INSN_LB:
+        emit8(h, 0x0f);
+        emit8(h, 0xbe);
+        break;
+    case INSN_LBU:
+        emit8(h, 0x0f);
+        emit8(h, 0xb6);
+        break;
+    }
+    emit8(h, 0x14);
+    emit8(h, 0x01);
+    if (d->rd != 0)
+        emit_store_reg(h, d->rd, X86_EDX);
+    done = emit_jmp(h);
+
+    if (misaligned)
+        emit_patch(h, misaligned);
+    emit_patch(h, outside);
+    emit_call_handler(h, d, remaining);
+    emit_patch(h, done);
+}
+
+static void emit_store(struct hart *h, const struct decoded_insn *d, int size,
+                       uint32_t remaining)
+{
+    uint8_t *misaligned, *outside, *code, *done;
+
+    outside = emit_ram_offset(h, d, size, &misaligned);
+    /* stores to translated instructions go to the handler, see
+     * code_write() */
+    emit8(h, 0x89); /* mov edx, eax */
+    emit8(h, 0xc2);
+    emit8(h, 0xc1); /* shr edx, 2 */
+    emit8(h, 0xea);
+    emit8(h, 2);
+    emit_mov_imm64(h, X86_ECX, (uintptr_t) h->m->code_words);
+    emit8(h, 0x0f); /* bt [rcx], edx */
+    emit8(h, 0xa3);
+    emit8(h, 0x11);
+    code = emit_jcc(h, X86_CC_B);
+    emit_mov_imm64(h, X86_ECX, (uintptr_t) h->m->ram);
+    emit_load_reg(h, X86_EDX, d->rs2);
+    /* mov [rcx + rax], edx/dx/dl */
+    if (size == 2)
+        emit8(h, 0x66);
+    emit8(h, size == 1 ? 0x88 : 0x89);
+    emit8(h, 0x14);
+    emit8(h, 0x01);
+    /* mark the page dirty, see snapshot_restore() */
+    emit8(h, 0xc1); /* shr eax, RAM_PAGE_BITS */
+    emit8(h, 0xe8);
+    emit8(h, RAM_PAGE_BITS);
+    emit_mov_imm64(h, X86_ECX, (uintptr_t) h->m->dirty_pages);
+    emit8(h, 0xc6); /* mov byte [rcx + rax], 1 */
+    emit8(h, 0x04);
+    emit8(h, 0x01);
+    emit8(h, 0x01);
+    done = emit_jmp(h);
+
+    if (misaligned)
+        emit_patch(h, misaligned);
+    emit_patch(h, outside);
+    emit_patch(h, code);
+    emit_call_handler(h, d, remaining);
+    emit_patch(h, done);
+}
+
+static void emit_branch(struct hart *h, const struct decoded_insn *d, int cc,
+                        uint32_t remaining)
+{
+    uint32_t target = d->pc + d->imm;
+    uint8_t *taken, *done;
+
+    if (target & pc_align_mask(h)) {
+        /* let the handler raise the exception if taken */
+        emit_call_handler(h, d, remaining);
+        return;
+    }
+    emit_load_reg(h, X86_EAX, d->rs1);
+    emit_alu_reg(h, 0x3b, d->rs2);
+    taken = emit_jcc(h, cc);
+    emit_inc_counter(h, &h->false_counter);
+    done = emit_jmp(h);
+    emit_patch(h, taken);
+    emit_inc_counter(h, &h->true_counter);
+    emit_jump_counters(h, d->pc, target);
+    emit_set_next_pc(h, target);
+    emit_patch(h, done);
+}
+
+static void emit_jalr(struct hart *h, const struct decoded_insn *d,
+                      uint32_t remaining)
+{
+    uint8_t *misaligned, *done;
+
+    emit_load_reg(h, X86_EAX, d->rs1);
+    if (d->imm)
+        emit_alu_imm(h, 0x03, d->imm);
+    emit_alu_imm(h, 0x23, ~1);
+    /* with C any even target is aligned */
+    misaligned = NULL;
+    if (pc_align_mask(h) & 2) {
+        emit8(h, 0xa8); /* test al, 2 */
+        emit8(h, 2);
+        misaligned = emit_jcc(h, X86_CC_NE);
+    }
+    if (d->rd != 0)
+        emit_store_reg_imm(h, d->rd, d->pc + d->len);
+    emit_mov_imm64(h, X86_ECX, (uintptr_t) &h->next_pc);
+    emit8(h, 0x89); /* mov [rcx], eax */
+    emit8(h, 0x01);
+    /* forward_counter or backward_counter, depending on the target */
+    emit_alu_imm(h, 0x3b, d->pc);
+    emit_mov_imm64(h, X86_ECX, (uintptr_t) &h->backward_counter);
+    emit_mov_imm64(h, X86_EDX, (uintptr_t) &h->forward_counter);
+    emit8(h, 0x48); /* cmova rcx, rdx */
+    emit8(h, 0x0f);
+    emit8(h, 0x47);
+    emit8(h, 0xca);
+    emit8(h, 0x48); /* inc qword [rcx] */
+    emit8(h, 0xff);
+    emit8(h, 0x01);
+    emit_inc_counter(h, &h->jump_counter);
+    if (misaligned) {
+        done = emit_jmp(h);
+        emit_patch(h, misaligned);
+        emit_call_handler(h, d, remaining);
+        emit_patch(h, done);
+    }
+}
+
+/* division without branches like div32() and friends: esi = -1 if the
+ * divisor is 0, edi = 1 if it is -1, then both divide by 1 instead */
+static void emit_div(struct hart *h, const struct decoded_insn *d)
+{
+    int is_signed = d->op == INSN_DIV || d->op == INSN_REM;
+
+    emit_load_reg(h, X86_EAX, d->rs1);
+    emit_load_reg(h, X86_ECX, d->rs2);
+    emit8(h, 0x31); /* xor esi, esi */
+    emit8(h, 0xf6);
+    emit8(h, 0x85); /* test ecx, ecx */
+    emit8(h, 0xc9);
+    emit8(h, 0x40); /* sete sil */
+    emit8(h, 0x0f);
+    emit8(h, 0x94);
+    emit8(h, 0xc6);
+    if (is_signed) {
+        emit8(h, 0x31); /* xor edi, edi */
+        emit8(h, 0xff);
+        emit8(h, 0x83); /* cmp ecx, -1 */
+        emit8(h, 0xf9);
+        emit8(h, 0xff);
+        emit8(h, 0x40); /* sete dil */
+        emit8(h, 0x0f);
+        emit8(h, 0x94);
+        emit8(h, 0xc7);
+    }
+    emit8(h, 0x01); /* add ecx, esi */
+    emit8(h, 0xf1);
+    if (is_signed) {
+        emit8(h, 0x8d); /* lea ecx, [rcx + rdi * 2] */
+        emit8(h, 0x0c);
+        emit8(h, 0x79);
+    }
+    emit8(h, 0xf7); /* neg esi */
+    emit8(h, 0xde);
+    if (is_signed) {
+        emit8(h, 0x99); /* cdq */
+        emit8(h, 0xf7); /* idiv ecx */
+        emit8(h, 0xf9);
+    } else {
+        emit8(h, 0x31); /* xor edx, edx */
+        emit8(h, 0xd2);
+        emit8(h, 0xf7); /* div ecx */
+        emit8(h, 0xf1);
+    }
+    if (d->op == INSN_DIV || d->op == INSN_DIVU) {
+        if (is_signed) {
+            emit8(h, 0xf7); /* neg edi */
+            emit8(h, 0xdf);
+            emit8(h, 0x31); /* xor eax, edi */
+            emit8(h, 0xf8);
+            emit8(h, 0x29); /* sub eax, edi */
+            emit8(h, 0xf8);
+        }
+        emit8(h, 0x09); /* or eax, esi */
+        emit8(h, 0xf0);
+        emit_store_reg(h, d->rd, X86_EAX);
+    } else {
+        emit8(h, 0x23); /* and esi, reg[rs1] */
+        emit8(h, 0xb3);
+        emit32(h, d->rs1 * 4);
+        emit8(h, 0x09); /* or edx, esi */
+        emit8(h, 0xf2);
+        emit_store_reg(h, d->rd, X86_EDX);
+    }
+}
+
+static void emit_insn(struct hart *h, const struct decoded_insn *d,
+                      uint32_t remaining)
+{
+    switch (d->op) {
+    case INSN_NOP:
+        break;
+
+    case INSN_LUI:
+        emit_store_reg_imm(h, d->rd, d->imm);
+        break;
+    case INSN_AUIPC:
+        emit_store_reg_imm(h, d->rd, d->pc + d->imm);
+        break;
+
+    case INSN_JAL:
+        if ((d->pc + d->imm) & pc_align_mask(h)) {
+            emit_call_handler(h, d, remaining);
+            break;
+        }
+        if (d->rd != 0)
+            emit_store_reg_imm(h, d->rd, d->pc + d->len);
+        emit_jump_counters(h, d->pc, d->pc + d->imm);
+        emit_set_next_pc(h, d->pc + d->imm);
+        break;
+    case INSN_JALR:
+        emit_jalr(h, d, remaining);
+        break;
+
+    case INSN_BEQ:
+        emit_branch(h, d, X86_CC_E, remaining);
+        break;
+    case INSN_BNE:
+        emit_branch(h, d, X86_CC_NE, remaining);
+        break;
+    case INSN_BLT:
+        emit_branch(h, d, X86_CC_L, remaining);
+        break;
+    case INSN_BGE:
+        emit_branch(h, d, X86_CC_GE, remaining);
+        break;
+    case INSN_BLTU:
+        emit_branch(h, d, X86_CC_B, remaining);
+        break;
+    case INSN_BGEU:
+        emit_branch(h, d, X86_CC_AE, remaining);
+        break;
+
+    case INSN_LB:
+    case INSN_LBU:
+        emit_load(h, d, 1, remaining);
+        break;
+    case INSN_LH:
+    case INSN_LHU:
+        emit_load(h, d, 2, remaining);
+        break;
+    case INSN_LW:
+        emit_load(h, d, 4, remaining);
+        break;
+    case INSN_SB:
+        emit_store(h, d, 1, remaining);
+        break;
+    case INSN_SH:
+        emit_store(h, d, 2, remaining);
+        break;
+    case INSN_SW:
+        emit_store(h, d, 4, remaining);
+        break;
+
+    case INSN_ADDI:
+    case INSN_XORI:
+    case INSN_ORI:
+    case INSN_ANDI:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit_alu_imm(h,
+                     d->op == INSN_ADDI   ? 0x03
+                     : d->op == INSN_XORI ? 0x33
+                     : d->op == INSN_ORI  ? 0x0b
+                                          : 0x23,
+                     d->imm);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_SLTI:
+    case INSN_SLTIU:
+        emit_load_reg(h, X86_ECX, d->rs1);
+        emit8(h, 0x31); /* xor eax, eax */
+        emit8(h, 0xc0);
+        emit8(h, 0x81); /* cmp ecx, imm32 */
+        emit8(h, 0xf9);
+        emit32(h, d->imm);
+        emit_setcc(h, d->op == INSN_SLTI ? X86_CC_L : X86_CC_B);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_SLLI:
+    case INSN_SRLI:
+    case INSN_SRAI:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit8(h, 0xc1); /* shl/shr/sar eax, imm8 */
+        emit8(h, d->op == INSN_SLLI   ? 0xe0
+                 : d->op == INSN_SRLI ? 0xe8
+                                      : 0xf8);
+        emit8(h, d->imm);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+
+    case INSN_ADD:
+    case INSN_SUB:
+    case INSN_XOR:
+    case INSN_OR:
+    case INSN_AND:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit_alu_reg(h,
+                     d->op == INSN_ADD   ? 0x03
+                     : d->op == INSN_SUB ? 0x2b
+                     : d->op == INSN_XOR ? 0x33
+                     : d->op == INSN_OR  ? 0x0b
+                                         : 0x23,
+                     d->rs2);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_SLT:
+    case INSN_SLTU:
+        emit_load_reg(h, X86_ECX, d->rs1);
+        emit8(h, 0x31); /* xor eax, eax */
+        emit8(h, 0xc0);
+        emit8(h, 0x3b); /* cmp ecx, reg[rs2] */
+        emit8(h, 0x8b);
+        emit32(h, d->rs2 * 4);
+        emit_setcc(h, d->op == INSN_SLT ? X86_CC_L : X86_CC_B);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_SLL:
+    case INSN_SRL:
+    case INSN_SRA:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit_load_reg(h, X86_ECX, d->rs2);
+        emit8(h, 0xd3); /* shl/shr/sar eax, cl */
+        emit8(h, d->op == INSN_SLL   ? 0xe0
+                 : d->op == INSN_SRL ? 0xe8
+                                     : 0xf8);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+
+    case INSN_MUL:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit8(h, 0x0f); /* imul eax, reg[rs2] */
+        emit8(h, 0xaf);
+        emit8(h, 0x83);
+        emit32(h, d->rs2 * 4);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_MULH:
+    case INSN_MULHSU:
+    case INSN_MULHU:
+    case INSN_MULH_MUL:
+    case INSN_MULHSU_MUL:
+    case INSN_MULHU_MUL:
+        /* 64-bit product of the sign or zero extended operands */
+        if (d->op == INSN_MULHU || d->op == INSN_MULHU_MUL) {
+            emit_load_reg(h, X86_EAX, d->rs1);
+        } else {
+            emit8(h, 0x48); /* movsxd rax, reg[rs1] */
+            emit8(h, 0x63);
+            emit8(h, 0x83);
+            emit32(h, d->rs1 * 4);
+        }
+        if (d->op == INSN_MULH || d->op == INSN_MULH_MUL) {
+            emit8(h, 0x48); /* movsxd rcx, reg[rs2] */
+            emit8(h, 0x63);
+            emit8(h, 0x8b);
+            emit32(h, d->rs2 * 4);
+        } else {
+            emit_load_reg(h, X86_ECX, d->rs2);
+        }
+        emit8(h, 0x48); /* imul rax, rcx */
+        emit8(h, 0x0f);
+        emit8(h, 0xaf);
+        emit8(h, 0xc1);
+        if (d->op >= INSN_MULH_MUL) {
+            emit8(h, 0x48); /* mov rdx, rax */
+            emit8(h, 0x89);
+            emit8(h, 0xc2);
+        }
+        emit8(h, 0x48); /* sar/shr rax, 32 */
+        emit8(h, 0xc1);
+        emit8(h, d->op == INSN_MULHU || d->op == INSN_MULHU_MUL ? 0xe8 : 0xf8);
+        emit8(h, 32);
+        emit_store_reg(h, d->rd, X86_EAX);
+        /* the low half of a fused MUL, see mul_fuse() */
+        if (d->op >= INSN_MULH_MUL)
+            emit_store_reg(h, d[1].rd, X86_EDX);
+        break;
+    case INSN_DIV:
+    case INSN_DIVU:
+    case INSN_REM:
+    case INSN_REMU:
+        emit_div(h, d);
+        break;
+
+    case INSN_SH1ADD:
+    case INSN_SH2ADD:
+    case INSN_SH3ADD:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit_load_reg(h, X86_ECX, d->rs2);
+        emit8(h, 0x8d); /* lea eax, [rcx + rax * 2/4/8] */
+        emit8(h, 0x04);
+        emit8(h, ((d->op - INSN_SH1ADD + 1) << 6) | 0x01);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_ANDN:
+    case INSN_ORN:
+    case INSN_XNOR:
+        emit_load_reg(h, X86_EAX, d->rs2);
+        emit8(h, 0xf7); /* not eax */
+        emit8(h, 0xd0);
+        emit_alu_reg(h,
+                     d->op == INSN_ANDN  ? 0x23
+                     : d->op == INSN_ORN ? 0x0b
+                                         : 0x33,
+                     d->rs1);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_MAX:
+    case INSN_MAXU:
+    case INSN_MIN:
+    case INSN_MINU:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit_load_reg(h, X86_ECX, d->rs2);
+        emit8(h, 0x39); /* cmp eax, ecx */
+        emit8(h, 0xc8);
+        emit8(h, 0x0f); /* cmovcc eax, ecx */
+        emit8(h, 0x40 | (d->op == INSN_MAX    ? X86_CC_L
+                         : d->op == INSN_MAXU ? X86_CC_B
+                         : d->op == INSN_MIN  ? X86_CC_G
+                                              : X86_CC_A));
+        emit8(h, 0xc1);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_SEXT_B:
+    case INSN_SEXT_H:
+    case INSN_ZEXT_H:
+        emit8(h, 0x0f); /* movsx/movzx eax, byte/word reg[rs1] */
+        emit8(h, d->op == INSN_SEXT_B   ? 0xbe
+                 : d->op == INSN_SEXT_H ? 0xbf
+                                        : 0xb7);
+        emit8(h, 0x83);
+        emit32(h, d->rs1 * 4);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_ROL:
+    case INSN_ROR:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit_load_reg(h, X86_ECX, d->rs2);
+        emit8(h, 0xd3); /* rol/ror eax, cl */
+        emit8(h, d->op == INSN_ROL ? 0xc0 : 0xc8);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_RORI:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit8(h, 0xc1); /* ror eax, imm8 */
+        emit8(h, 0xc8);
+        emit8(h, d->imm);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_REV8:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit8(h, 0x0f); /* bswap eax */
+        emit8(h, 0xc8);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_BCLR:
+    case INSN_BINV:
+    case INSN_BSET:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit_load_reg(h, X86_ECX, d->rs2);
+        emit8(h, 0x0f); /* btr/btc/bts eax, ecx */
+        emit8(h, d->op == INSN_BCLR   ? 0xb3
+                 : d->op == INSN_BINV ? 0xbb
+                                      : 0xab);
+        emit8(h, 0xc8);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_BCLRI:
+    case INSN_BINVI:
+    case INSN_BSETI:
+        emit_load_reg(h, X86_EAX, d->rs1);
+        emit8(h, 0x0f); /* btr/btc/bts eax, imm8 */
+        emit8(h, 0xba);
+        emit8(h, d->op == INSN_BCLRI   ? 0xf0
+                 : d->op == INSN_BINVI ? 0xf8
+                                       : 0xe8);
+        emit8(h, d->imm);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+    case INSN_BEXT:
+    case INSN_BEXTI:
+        emit_load_reg(h, X86_ECX, d->rs1);
+        emit8(h, 0x31); /* xor eax, eax */
+        emit8(h, 0xc0);
+        if (d->op == INSN_BEXT) {
+            emit_load_reg(h, X86_EDX, d->rs2);
+            emit8(h, 0x0f); /* bt ecx, edx */
+            emit8(h, 0xa3);
+            emit8(h, 0xd1);
+        } else {
+            emit8(h, 0x0f); /* bt ecx, imm8 */
+            emit8(h, 0xba);
+            emit8(h, 0xe1);
+            emit8(h, d->imm);
+        }
+        emit_setcc(h, X86_CC_B);
+        emit_store_reg(h, d->rd, X86_EAX);
+        break;
+
+    default:
+        /* SYSTEM, MISC-MEM, atomics, clz, ctz, cpop, orc.b */
+        emit_call_handler(h, d, remaining);
+        break;
+    }
+}
+
+/* drop all generated code */
+void jit_reset(struct hart *h)
+{
+    for (uint32_t i = 0; i < h->n_blocks; i++)
+        h->block_pool[i].native = NULL;
+    h->jit_code_used = 0;
+}
+
+/* allocate the code buffer of 'h', return -1 if the host does not allow
+ * it */
+int jit_init(struct hart *h)
+{
+    void *p = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    h->jit_code = p;
+    h->jit_code_used = 0;
+    return 0;
+}
+
+/* release the code buffer, before machine_free() */
+void jit_free(struct hart *h)
+{
+    if (h->jit_code)
+        munmap(h->jit_code, JIT_CODE_SIZE);
+    h->jit_code = NULL;
+}
+
+/* generate native code for 'b' */
+void *jit_compile(struct hart *h, struct block *b)
+{
+    uint8_t *start;
+
+    /* the fast memory path does not know about devices */
+    if (h->jit_code == NULL || ram_has_devices(h->m))
+        return NULL;
+    if (h->jit_code_used + (b->n_insn + 1) * JIT_MAX_INSN_BYTES >
+        JIT_CODE_SIZE)
+        jit_reset(h);
+
+    start = h->jit_ptr = h->jit_code + h->jit_code_used;
+    emit8(h, 0x53); /* push rbx */
+    emit_mov_imm64(h, X86_EBX, (uintptr_t) h->reg);
+    for (uint32_t i = 0; i < b->n_insn; i++)
+        emit_insn(h, &b->insn[i], b->n_insn - i - 1);
+    emit_return(h, 0);
+    h->jit_code_used = h->jit_ptr - h->jit_code;
+    return start;
+}
+
+/* execute 'b' natively once it is hot, interpret it until then */
+static inline void jit_block_exec(struct hart *h, struct block *b)
+{
+    /* native code accesses RAM without Sv32 translation or PMP checks */
+    if (b->native == NULL || h->check_data) {
+        if (h->check_data || ++b->hits < JIT_HOT_THRESHOLD ||
+            !(b->native = jit_compile(h, b))) {
+#ifdef HAVE_THREADED_CODE
+            block_exec_threaded(h, b);
+#else
+            block_exec(h, b);
+#endif
+            return;
+        }
+    }
+    h->insn_counter += b->n_insn;
+    h->next_pc = b->pc_end;
+    h->insn_counter -= ((uint32_t(*)()) b->native)();
+}
+
+#endif
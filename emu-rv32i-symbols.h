@@ -0,0 +1,218 @@
+/*
+ * Symbol tables of the guest programs.
+ *
+ * rv32emu is freely redistributable under the MIT License. See the file
+ * "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/*
+ * The symbols are added once when the ELF file is loaded, then
+ * symtab_index() sorts them by address and builds an open addressing hash
+ * table of the names. Lookups by name are O(1), lookups of the symbol
+ * containing an address (to symbolize a PC) O(log n). The names are kept
+ * in one string buffer, so a table with hundreds of thousands of symbols
+ * takes a handful of allocations.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+/* named symbol of an ELF file */
+struct symbol {
+    uint32_t addr;
+    uint32_t size;
+    uint32_t name;   /* offset in names */
+    uint32_t global; /* preferred over a local symbol of the same name */
+};
+
+struct symtab {
+    struct symbol *symbols; /* sorted by address after symtab_index() */
+    uint32_t n_symbols;
+    uint32_t max_symbols;
+    char *names;
+    uint32_t names_size;
+    uint32_t max_names;
+    uint32_t *hash; /* index + 1 of a symbol, or 0 */
+    uint32_t hash_size; /* a power of 2, at least twice n_symbols */
+};
+
+static void symtab_free(struct symtab *t)
+{
+    free(t->symbols);
+    free(t->names);
+    free(t->hash);
+    memset(t, 0, sizeof(*t));
+}
+
+static inline const char *symtab_name(const struct symtab *t,
+                                      const struct symbol *s)
+{
+    return t->names + s->name;
+}
+
+/* FNV-1a */
+static uint32_t symtab_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (uint8_t) *name++) * 16777619u;
+    return h;
+}
+
+/* add a symbol, returns -1 if out of memory */
+static int symtab_add(struct symtab *t, const char *name, uint32_t addr,
+                      uint32_t size, int global)
+{
+    uint32_t len = strlen(name) + 1;
+    struct symbol *s;
+
+    if (t->n_symbols == t->max_symbols) {
+        uint32_t max = t->max_symbols ? 2 * t->max_symbols : 256;
+        s = realloc(t->symbols, max * sizeof(struct symbol));
+        if (s == NULL)
+            return -1;
+        t->symbols = s;
+        t->max_symbols = max;
+    }
+    if (t->names_size + len > t->max_names) {
+        uint32_t max = t->max_names ? 2 * t->max_names : 4096;
+        char *names;
+        while (max < t->names_size + len)
+            max *= 2;
+        names = realloc(t->names, max);
+        if (names == NULL)
+            return -1;
+        t->names = names;
+        t->max_names = max;
+    }
+    s = &t->symbols[t->n_symbols++];
+    s->addr = addr;
+    s->size = size;
+    s->name = t->names_size;
+    s->global = global != 0;
+    memcpy(t->names + t->names_size, name, len);
+    t->names_size += len;
+    return 0;
+}
+
+static inline uint32_t symbol_key(const struct symbol *s, int pass)
+{
+    if (pass == 0)
+        return !s->global;
+    return pass == 1 ? s->addr & 0xffff : s->addr >> 16;
+}
+
+/* stable sort by address with the global symbols first at each address,
+ * a radix sort since qsort() takes longer than reading the whole file on
+ * large tables. Returns -1 if out of memory. */
+static int symtab_sort(struct symtab *t)
+{
+    struct symbol *src = t->symbols, *dst, *tmp;
+    uint32_t *pos = malloc(0x10000 * sizeof(uint32_t));
+
+    dst = malloc((t->n_symbols ? t->n_symbols : 1) * sizeof(*dst));
+    if (pos == NULL || dst == NULL) {
+        free(pos);
+        free(dst);
+        return -1;
+    }
+    for (int pass = 0; pass < 3; pass++) {
+        uint32_t sum = 0;
+        memset(pos, 0, 0x10000 * sizeof(uint32_t));
+        for (uint32_t i = 0; i < t->n_symbols; i++)
+            pos[symbol_key(&src[i], pass)]++;
+        for (uint32_t k = 0; k < 0x10000; k++) {
+            uint32_t n = pos[k];
+            pos[k] = sum;
+            sum += n;
+        }
+        for (uint32_t i = 0; i < t->n_symbols; i++)
+            dst[pos[symbol_key(&src[i], pass)]++] = src[i];
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    /* an odd number of passes leaves the result in the new buffer */
+    free(dst);
+    t->symbols = src;
+    t->max_symbols = t->n_symbols;
+    free(pos);
+    return 0;
+}
+
+/* sort the symbols by address and index their names, returns -1 if out of
+ * memory. Of several symbols with the same name, the global one is found,
+ * otherwise the first of the file. */
+static int symtab_index(struct symtab *t)
+{
+    uint32_t size = 16;
+
+    if (symtab_sort(t))
+        return -1;
+    while (size < 2 * t->n_symbols)
+        size *= 2;
+    free(t->hash);
+    t->hash = calloc(size, sizeof(uint32_t));
+    if (t->hash == NULL)
+        return -1;
+    t->hash_size = size;
+    for (uint32_t i = 0; i < t->n_symbols; i++) {
+        const struct symbol *s = &t->symbols[i];
+        const char *name = symtab_name(t, s);
+        uint32_t j = symtab_hash(name) & (size - 1);
+
+        for (; t->hash[j]; j = (j + 1) & (size - 1)) {
+            const struct symbol *o = &t->symbols[t->hash[j] - 1];
+            if (strcmp(symtab_name(t, o), name) == 0)
+                break;
+        }
+        if (t->hash[j] == 0 ||
+            (s->global && !t->symbols[t->hash[j] - 1].global) ||
+            (s->global == t->symbols[t->hash[j] - 1].global &&
+             s->name < t->symbols[t->hash[j] - 1].name))
+            t->hash[j] = i + 1;
+    }
+    return 0;
+}
+
+/* the symbol called 'name', or NULL */
+static const struct symbol *symtab_lookup(const struct symtab *t,
+                                          const char *name)
+{
+    if (t->hash == NULL)
+        return NULL;
+    for (uint32_t j = symtab_hash(name) & (t->hash_size - 1); t->hash[j];
+         j = (j + 1) & (t->hash_size - 1)) {
+        const struct symbol *s = &t->symbols[t->hash[j] - 1];
+        if (strcmp(symtab_name(t, s), name) == 0)
+            return s;
+    }
+    return NULL;
+}
+
+/* the symbol 'addr' is in: the last one at or below it, unless that one has
+ * a size which ends before 'addr'. NULL if there is none. */
+static const struct symbol *symtab_find(const struct symtab *t, uint32_t addr)
+{
+    uint32_t lo = 0, hi = t->n_symbols;
+    const struct symbol *s;
+
+    /* first symbol above addr */
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (t->symbols[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    /* the first (global) one of the symbols at that address */
+    s = &t->symbols[lo - 1];
+    while (s > t->symbols && s[-1].addr == s->addr)
+        s--;
+    if (s->size && addr - s->addr >= s->size)
+        return NULL;
+    return s;
+}
@@ -7,7 +7,7 @@
 #include <stdio.h>
 
 uint16_t PROGRAM[] = {
-    0b0010010110000001, // R11=0
+    0b0100010110000001, // R11=0
     0b1001010110101010, // R11+=R10
     0b0001010101111101, // R10-=1
     0b1111110101110101, // IF R10 GOTO -2
@@ -47,42 +47,45 @@ uint16_t PROGRAM[] = {
 */
 
 int main(int argc, char** argv) {
+    struct machine *m = machine_new(1, RAM_SIZE);
+    struct hart *h = &m->hart[0];
     uint32_t start = 0;
-    ram_start = 0;
+    m->ram_start = 0;
     uint32_t end = 0xfffffffe;
 
-    for (int i = 0; i < sizeof(PROGRAM); i++) {
-        *(uint16_t*)(ram + start + i * 2) = PROGRAM[i];
+    for (int i = 0; i < sizeof(PROGRAM) / sizeof(PROGRAM[0]); i++) {
+        *(uint16_t*)(m->ram + start + i * 2) = PROGRAM[i];
     }
 
-    pc = start;
-    reg[2] = ram_start + RAM_SIZE; // sp - stack pointer
-    reg[1] = end; // ra - return adderss
+    h->pc = start;
+    h->reg[2] = m->ram_start + m->ram_size; // sp - stack pointer
+    h->reg[1] = end; // ra - return adderss
 
-    reg[10] = 10; // a0
-    reg[11] = 0; // a1
+    h->reg[10] = 10; // a0
+    h->reg[11] = 0; // a1
 
-    while (machine_running) {
-        insn = get_insn(pc);
-        printf("[%08x]=%08x pc:%8x\n", pc, insn, next_pc);
-        execute_instruction();
-        //printf("[%08x]=%08x pc:%8x (after)\n", pc, insn, next_pc);
-        if (mcause) {
-            printf("exception %d\n", mcause);
+    while (m->running) {
+        h->insn = get_insn(h, h->pc);
+        printf("[%08x]=%08x pc:%8x\n", h->pc, h->insn, h->next_pc);
+        execute_instruction(h);
+        //printf("[%08x]=%08x pc:%8x (after)\n", h->pc, h->insn, h->next_pc);
+        if (h->mcause) {
+            printf("exception %d\n", h->mcause);
             break;
         }
-        pc = next_pc;
-        if (pc == end)
+        h->pc = h->next_pc;
+        if (h->pc == end)
             break;
     }
 
     #ifdef DEBUG_EXTRA
-    dump_regs();
+    dump_regs(h);
     #else
-    printf("x10 a0: %08x\n", reg[10]);
+    printf("x10 a0: %08x\n", h->reg[10]);
     #endif
     
-    printf("x10 a0: %d\n", reg[10]);
+    printf("x10 a0: %d\n", h->reg[10]);
 
+    machine_free(m);
     return 0;
 }
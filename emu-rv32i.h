@@ -11,10 +11,16 @@
 #include <stdio.h>
 #endif
 
+#include <setjmp.h>
+#include <signal.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
-#define STRICT_RV32I
 #define FALSE (0)
 #define TRUE (-1)
 
@@ -22,11 +28,11 @@
 
 uint32_t minmemr, maxmemr, minmemw, maxmemw;
 
-#define STATS_NUM 64
+#define STATS_NUM 96
 
 unsigned int stats[STATS_NUM], top[5], itop[5];
 
-char statnames[64][16] = {
+char statnames[STATS_NUM][16] = {
     "LUI",   "AUIPC",  "JAL",    "JALR",    "BEQ",    "BNE",    "BLT",
     "BGE",   "BLTU",   "BGEU",   "LB",      "LH",     "LW",     "LBU",
     "LHU",   "SB",     "SH",     "SW",      "ADDI",   "SLTI",   "SLTIU",
@@ -36,7 +42,11 @@ char statnames[64][16] = {
     "CSRRS", "CSRRC",  "CSRRWI", "CSRRSI",  "CSRRCI", "LI*",    "MUL",
     "MULH",  "MULHSU", "MULHU",  "DIV",     "DIVU",   "REM",    "REMU",
     "LR.W",  "SC.W",   "URET",   "SRET",    "MRET",   "WFI",    "SFENCE.VMA",
-    ""};
+    "",      "SH1ADD", "SH2ADD", "SH3ADD",  "ANDN",   "ORN",    "XNOR",
+    "CLZ",   "CTZ",    "CPOP",   "MAX",     "MAXU",   "MIN",    "MINU",
+    "SEXT.B", "SEXT.H", "ZEXT.H", "ROL",    "ROR",    "RORI",   "ORC.B",
+    "REV8",  "BCLR",   "BCLRI",  "BEXT",    "BEXTI",  "BINV",   "BINVI",
+    "BSET",  "BSETI",  ""};
 
 void init_stats(void)
 {
@@ -89,7 +99,7 @@ void print_stats(uint64_t total)
             itop[4] = i;
         }
         if (stats[i]) {
-            if (i < 63)
+            if (statnames[i][0])
                 printf("%s\t= %u\n", statnames[i], stats[i]);
             else
                 printf("[%i] = %u\n", i, stats[i]);
@@ -115,35 +125,40 @@ void print_stats(uint64_t total)
 #define debug_out(...)
 #endif
 
-/* memory mapped registers */
+/* memory mapped registers of the built-in devices. Like a CLINT there is a
+ * mtimecmp register for hart i at MTIMECMP_ADDR + 8 * i and a MSIP register
+ * (software interrupt) at MSIP_ADDR + 4 * i. */
+#define CLINT_ADDR 0x40000000
+#define CLINT_SIZE 0x2000
 #define MTIME_ADDR 0x40000000
 #define MTIMECMP_ADDR 0x40000008
+#define MSIP_ADDR 0x40001000
 #define UART_TX_ADDR 0x40002000
 
-/* emulate RAM */
-#define RAM_SIZE 0x10000
-uint8_t ram[RAM_SIZE];
+/* devices on the bus of a machine, see machine_add_device() */
+#define MAX_DEVICES 16
 
-/* special memory mapped registers */
-uint64_t mtime;
-uint64_t mtimecmp;
+#define MAX_HARTS 32
 
-/* virtual start address for index 0 in the ram array */
-uint32_t ram_start;
+/* default and maximum size of the emulated RAM, see machine_new() */
+#define RAM_SIZE 0x10000
+#define RAM_SIZE_MAX 0x80000000u
 
-/* program entry point */
-//uint32_t start;
+/* granularity of the RAM size and of the dirty and code page maps */
+#define RAM_PAGE_BITS 12
+#define RAM_PAGE_SIZE (1 << RAM_PAGE_BITS)
 
-/* last byte of the memory initialized and temporary value */
-uint32_t ram_last = 0;
-uint32_t ram_curr = 0;
+/* size of the guest address space, reserved on the host in the guard page
+ * mode (see machine_map_guest()) */
+#define GUEST_SPACE 0x100000000ull
+#define GUEST_PAGES (GUEST_SPACE >> RAM_PAGE_BITS)
 
-/* used when called from the compliance tests */
-uint32_t begin_signature = 0;
-uint32_t end_signature = 0;
+/* entries of the software TLB of each hart, see mmu_translate() */
+#define TLB_SIZE 256
 
-/* is set to false to exit the emulator */
-int machine_running = TRUE;
+/* PMP entries, and pages whose PMP permissions are cached, see pmp_deny() */
+#define PMP_COUNT 16
+#define PMP_CACHE_SIZE 256
 
 /* privilege levels */
 #define PRV_U 0
@@ -151,46 +166,206 @@ int machine_running = TRUE;
 #define PRV_H 2
 #define PRV_M 3
 
-/* CPU state */
-uint32_t pc;
-uint32_t next_pc;
-uint32_t insn;
-uint32_t reg[32];
-
-uint8_t priv = PRV_M; /* see PRV_x */
-uint8_t fs;           /* MSTATUS_FS value */
-uint8_t mxl;          /* MXL field in MISA register */
-
-uint64_t jump_counter = 0, backward_counter = 0, forward_counter = 0,
-         true_counter = 0, false_counter = 0;
-
-uint64_t insn_counter = 0;
-int pending_exception; /* used during MMU exception handling */
-uint32_t pending_tval;
-
-/* CSRs */
-uint32_t mstatus;
-uint32_t mtvec;
-uint32_t mscratch;
-uint32_t mepc;
-uint32_t mcause;
-uint32_t mtval;
-uint32_t mhartid; /* ro */
-uint32_t misa;
-uint32_t mie;
-uint32_t mip;
-uint32_t medeleg;
-uint32_t mideleg;
-uint32_t mcounteren;
-
-uint32_t stvec;
-uint32_t sscratch;
-uint32_t sepc;
-uint32_t scause;
-uint32_t stval;
-uint32_t satp;
-uint32_t scounteren;
-uint32_t load_res; /* for atomic LR/SC */
+struct machine;
+struct snapshot;
+struct block;
+struct decoded_insn;
+
+/* Sv32 translation of a virtual page, cached in the TLB */
+struct tlb_entry {
+    uint32_t vpage; /* virtual address >> RAM_PAGE_BITS */
+    uint32_t paddr; /* physical address of the page */
+    uint32_t perm;  /* ACCESS_x allowed in S-mode, and shifted by
+                       TLB_USER_SHIFT in U-mode. 0 if the entry is empty. */
+};
+
+/* PMP permissions of a physical page, cached by pmp_deny() */
+struct pmp_page {
+    uint32_t page; /* physical address >> RAM_PAGE_BITS */
+    uint32_t perm; /* see pmp_perm(), 0 if the entry is empty */
+};
+
+/* CPU state of one hardware thread */
+struct hart {
+    struct machine *m;
+
+    uint32_t pc;
+    uint32_t next_pc;
+    uint32_t insn;
+    uint32_t reg[32];
+
+    uint8_t priv; /* see PRV_x */
+    uint8_t fs;   /* MSTATUS_FS value */
+    uint8_t mxl;  /* MXL field in MISA register */
+
+    uint64_t jump_counter, backward_counter, forward_counter, true_counter,
+        false_counter;
+
+    uint64_t insn_counter;
+    int pending_exception; /* used during MMU exception handling */
+    uint32_t pending_tval;
+
+    /* CSRs */
+    uint32_t mstatus;
+    uint32_t mtvec;
+    uint32_t mscratch;
+    uint32_t mepc;
+    uint32_t mcause;
+    uint32_t mtval;
+    uint32_t mhartid; /* ro */
+    uint32_t misa;
+    uint32_t zext; /* Z extensions, not in misa, see ZEXT_x */
+    uint32_t mie;
+    uint32_t mip; /* also written by other harts, see mip_set() */
+    uint32_t medeleg;
+    uint32_t mideleg;
+    uint32_t mcounteren;
+
+    uint32_t stvec;
+    uint32_t sscratch;
+    uint32_t sepc;
+    uint32_t scause;
+    uint32_t stval;
+    uint32_t satp;
+    uint32_t scounteren;
+    uint32_t load_res; /* for atomic LR/SC */
+    uint32_t load_val; /* value seen by LR, the SC is a compare-and-swap */
+
+    uint64_t mtimecmp;
+
+    /* set when an interrupt may be pending, see irq_update() */
+    int irq_pending;
+
+    /* insn_counter value of the next timer check, see timer_update() */
+    uint64_t timer_deadline;
+
+    /* Sv32 address translation, see mmu_update(). The privilege level
+     * checked by fetches and by loads and stores, PRV_M if they are not
+     * translated. */
+    uint8_t fetch_priv;
+    uint8_t data_priv;
+    struct tlb_entry tlb[TLB_SIZE];
+
+    /* physical memory protection, see pmp_update() */
+    uint8_t pmpcfg[PMP_COUNT];
+    uint32_t pmpaddr[PMP_COUNT];
+    int pmp_active; /* an entry is enabled */
+    int pmp_locked; /* an enabled entry also applies to M-mode */
+    struct pmp_page pmp_cache[PMP_CACHE_SIZE];
+
+    /* loads and stores are translated or checked by the PMP, so they can't
+     * access RAM directly */
+    int check_data;
+
+    /* translation cache, see block_find() */
+    struct block *block_pool;
+    struct decoded_insn *insn_pool;
+    uint32_t n_blocks;
+    uint32_t n_pool_insns;
+    struct block **block_map;
+    uint32_t code_gen; /* machine code_gen when it was last flushed */
+
+    /* native code buffer, see emu-rv32i-jit.h */
+    uint8_t *jit_code;
+    uint32_t jit_code_used;
+    uint8_t *jit_ptr;
+
+    /* guard page mode, see machine_map_guest() */
+    uint8_t *guest_base;
+    const struct decoded_insn *mem_insn; /* last load or direct access */
+    struct block *block;                 /* block being executed */
+    sigjmp_buf fault_env;
+};
+
+/* a peripheral owning the guest addresses [base, base + size). The
+ * callbacks get the offset from base and an access size of 1, 2 or 4 bytes,
+ * and return non-zero for an access fault. */
+struct device {
+    const char *name;
+    uint32_t base;
+    uint32_t size;
+    int (*read)(struct hart *h, struct device *dev, uint32_t offset, int size,
+                uint32_t *pval);
+    int (*write)(struct hart *h, struct device *dev, uint32_t offset,
+                 int size, uint32_t val);
+    void *opaque;
+};
+
+/* a complete emulated system. Every instance is independent, so several
+ * guests can run in the same process. */
+struct machine {
+    /* anonymous mapping, pages are only allocated once written */
+    uint8_t *ram;
+    uint32_t ram_size;
+    uint32_t ram_pages;
+
+    /* reservation of the guest address space holding ram at ram_start, or
+     * NULL, see machine_map_guest() */
+    uint8_t *guest_base;
+
+    /* virtual start address for index 0 in the ram array */
+    uint32_t ram_start;
+
+    /* last byte of the memory initialized */
+    uint32_t ram_last;
+
+    /* pages written since the last snapshot, see snapshot_restore() */
+    uint8_t *dirty_pages;
+    const struct snapshot *snapshot;
+
+    /* pages which may not be zero, dirty_pages are added to it when a
+     * snapshot is taken or restored. The others were never touched. */
+    uint8_t *used_pages;
+
+    /* pages holding translated code, and one bit per word of RAM holding
+     * a translated instruction. Stores to such words increment code_gen,
+     * see code_write(). */
+    uint8_t *code_pages;
+    uint8_t *code_words;
+    uint32_t code_gen;
+
+    /* device bus. io_pages holds the index + 1 of the device owning each
+     * page of the guest address space, or 0. Devices come before RAM. */
+    struct device devices[MAX_DEVICES];
+    uint32_t n_devices;
+    uint8_t *io_pages;
+
+    /* mtime derived from insn_counter (10 ticks per instruction) instead of
+     * the host clock, for reproducible runs */
+    int timer_deterministic;
+
+    /* used when called from the compliance tests */
+    uint32_t begin_signature;
+    uint32_t end_signature;
+
+    /* is set to false to exit the emulator, on all harts */
+    int running;
+    int stop_reason; /* see STOP_x */
+    int engine;      /* see ENGINE_x, exec_engine when created */
+
+    /* limits of a run, 0 for none. The budget is counted per hart and both
+     * are checked at least every TIMER_SYNC_INSNS instructions. */
+    uint64_t insn_budget;
+    uint64_t stop_time; /* host clock in ns, see get_clock() */
+
+    /* stop with STOP_BREAK after break_insns instructions (0 for never) or
+     * before executing break_pc (BREAK_NONE for never) */
+    uint64_t break_insns;
+    uint32_t break_pc;
+
+    /* each hart runs on its own host thread when n_harts > 1 */
+    uint32_t n_harts;
+    struct hart hart[MAX_HARTS];
+};
+
+/* why a machine stopped running */
+#define STOP_EXIT 0    /* the guest program ended */
+#define STOP_BUDGET 1  /* insn_budget exhausted */
+#define STOP_TIMEOUT 2 /* stop_time reached */
+#define STOP_BREAK 3   /* break_insns or break_pc reached */
+
+/* no instruction can start at an odd address */
+#define BREAK_NONE 1
 
 /* exception causes */
 #define CAUSE_MISALIGNED_FETCH 0x0
@@ -221,6 +396,16 @@ uint32_t load_res; /* for atomic LR/SC */
 #define MCPUID_Q (1 << ('Q' - 'A'))
 #define MCPUID_C (1 << ('C' - 'A'))
 
+/* all extensions of the emulator, rv32imac_zba_zbb_zbs */
+#define MISA_DEFAULT                                                         \
+    (MCPUID_I | MCPUID_M | MCPUID_A | MCPUID_C | MCPUID_SUPER | MCPUID_USER)
+
+/* bit manipulation extensions */
+#define ZEXT_ZBA (1 << 0)
+#define ZEXT_ZBB (1 << 1)
+#define ZEXT_ZBS (1 << 2)
+#define ZEXT_DEFAULT (ZEXT_ZBA | ZEXT_ZBB | ZEXT_ZBS)
+
 #define MIP_USIP (1 << 0)
 #define MIP_SSIP (1 << 1)
 #define MIP_HSIP (1 << 2)
@@ -262,6 +447,344 @@ uint32_t load_res; /* for atomic LR/SC */
 #define MSTATUS_UXL_MASK ((uint64_t) 3 << MSTATUS_UXL_SHIFT)
 #define MSTATUS_SXL_MASK ((uint64_t) 3 << MSTATUS_SXL_SHIFT)
 
+/* satp CSR and Sv32 page table entries */
+#define SATP_MODE ((uint32_t) 1 << 31)
+#define SATP_PPN_MASK (((uint32_t) 1 << 22) - 1)
+
+#define PTE_V (1 << 0)
+#define PTE_R (1 << 1)
+#define PTE_W (1 << 2)
+#define PTE_X (1 << 3)
+#define PTE_U (1 << 4)
+#define PTE_G (1 << 5)
+#define PTE_A (1 << 6)
+#define PTE_D (1 << 7)
+#define PTE_PPN_SHIFT 10
+
+/* pmpcfg fields of an entry */
+#define PMP_R (1 << 0)
+#define PMP_W (1 << 1)
+#define PMP_X (1 << 2)
+#define PMP_A (3 << 3)
+#define PMP_TOR (1 << 3)
+#define PMP_NA4 (2 << 3)
+#define PMP_NAPOT (3 << 3)
+#define PMP_L (1 << 7)
+
+/* memory access types, also the permission bits of a TLB entry and of the
+ * PMP */
+#define ACCESS_READ 1
+#define ACCESS_WRITE 2
+#define ACCESS_CODE 4
+#define TLB_USER_SHIFT 3
+
+uint32_t get_pending_irq_mask(struct hart *h)
+{
+    uint32_t pending_ints, enabled_ints;
+
+    pending_ints = __atomic_load_n(&h->mip, __ATOMIC_SEQ_CST) & h->mie;
+    if (pending_ints == 0)
+        return 0;
+
+    enabled_ints = 0;
+    switch (h->priv) {
+    case PRV_M:
+        if (h->mstatus & MSTATUS_MIE)
+            enabled_ints = ~h->mideleg;
+        break;
+    case PRV_S:
+        enabled_ints = ~h->mideleg;
+        if (h->mstatus & MSTATUS_SIE)
+            enabled_ints |= h->mideleg;
+        break;
+    default:
+    case PRV_U:
+        enabled_ints = -1;
+        break;
+    }
+    return pending_ints & enabled_ints;
+}
+
+/* irq_pending is recomputed whenever mip, mie, mideleg, mstatus or priv
+ * change, so the execution loop only tests this flag between basic blocks.
+ * Other harts may set it concurrently (see mip_set()), so it is cleared
+ * before mip is read. */
+static inline void irq_update(struct hart *h)
+{
+    __atomic_store_n(&h->irq_pending, FALSE, __ATOMIC_SEQ_CST);
+    if (get_pending_irq_mask(h) != 0)
+        __atomic_store_n(&h->irq_pending, TRUE, __ATOMIC_SEQ_CST);
+}
+
+/* mip bits of a hart can be changed by other harts through the CLINT, so
+ * mip is only modified atomically. Setting a bit only flags a possible
+ * interrupt, the hart itself checks whether it is enabled. */
+static inline void mip_set(struct hart *h, uint32_t mask)
+{
+    __atomic_or_fetch(&h->mip, mask, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&h->irq_pending, TRUE, __ATOMIC_SEQ_CST);
+}
+
+static inline void mip_clear(struct hart *h, uint32_t mask)
+{
+    __atomic_and_fetch(&h->mip, ~mask, __ATOMIC_SEQ_CST);
+}
+
+/* returns realtime in nanoseconds */
+int64_t get_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* mtime counts at 10 MHz (100 ns period). It is computed on demand and the
+ * comparison with mtimecmp is only done once insn_counter reaches
+ * timer_deadline, so the host clock is not read for every instruction. */
+#define TIMER_SYNC_INSNS 4096
+
+uint64_t insn_retired(struct hart *h);
+
+static inline uint64_t timer_read(struct hart *h)
+{
+    if (h->m->timer_deterministic)
+        return insn_retired(h) * 10;
+    return get_clock() / 100ll;
+}
+
+/* stop all harts of the machine */
+static inline void machine_stop(struct machine *m, int reason)
+{
+    m->stop_reason = reason;
+    __atomic_store_n(&m->running, FALSE, __ATOMIC_RELAXED);
+}
+
+/* stop the machine once a limit of the run is reached, returns the
+ * instruction count of the next check */
+static uint64_t limits_check(struct hart *h)
+{
+    struct machine *m = h->m;
+    uint64_t next = h->insn_counter + TIMER_SYNC_INSNS;
+
+    if (m->insn_budget && h->insn_counter >= m->insn_budget) {
+        machine_stop(m, STOP_BUDGET);
+    } else if (m->break_insns && h->insn_counter >= m->break_insns) {
+        machine_stop(m, STOP_BREAK);
+    } else if (m->stop_time && (uint64_t) get_clock() >= m->stop_time) {
+        machine_stop(m, STOP_TIMEOUT);
+    } else {
+        if (m->insn_budget && next > m->insn_budget)
+            next = m->insn_budget;
+        if (m->break_insns && next > m->break_insns)
+            next = m->break_insns;
+    }
+    return next;
+}
+
+/* compare mtime with mtimecmp, update MTIP and schedule the next check */
+void timer_update(struct hart *h)
+{
+    uint64_t cmp = __atomic_load_n(&h->mtimecmp, __ATOMIC_SEQ_CST);
+    uint64_t deadline;
+
+    if (cmp <= timer_read(h)) {
+        /* MTIP stays set until mtimecmp is written */
+        mip_set(h, MIP_MTIP);
+        deadline = UINT64_MAX;
+    } else {
+        mip_clear(h, MIP_MTIP);
+        if (h->m->timer_deterministic)
+            deadline = cmp / 10 + (cmp % 10 != 0);
+        else
+            deadline = h->insn_counter + TIMER_SYNC_INSNS;
+    }
+    if (h->m->insn_budget || h->m->stop_time || h->m->break_insns) {
+        uint64_t next = limits_check(h);
+        if (next < deadline)
+            deadline = next;
+    }
+    __atomic_store_n(&h->timer_deadline, deadline, __ATOMIC_SEQ_CST);
+    /* mtimecmp was written by another hart in the meantime */
+    if (__atomic_load_n(&h->mtimecmp, __ATOMIC_SEQ_CST) != cmp)
+        __atomic_store_n(&h->timer_deadline, 0, __ATOMIC_SEQ_CST);
+}
+
+/* called from the fast path at instruction or block boundaries */
+static inline void timer_check(struct hart *h)
+{
+    if (h->insn_counter >= __atomic_load_n(&h->timer_deadline,
+                                           __ATOMIC_RELAXED))
+        timer_update(h);
+}
+
+/* write half of the mtimecmp register of 't', possibly from another hart */
+void timer_set_cmp(struct hart *t, uint32_t val, int high)
+{
+    uint64_t cmp = __atomic_load_n(&t->mtimecmp, __ATOMIC_SEQ_CST);
+    if (high)
+        cmp = (cmp & 0xffffffffll) | (((uint64_t) val) << 32);
+    else
+        cmp = (cmp & 0xffffffff00000000ll) | val;
+    __atomic_store_n(&t->mtimecmp, cmp, __ATOMIC_SEQ_CST);
+    mip_clear(t, MIP_MTIP);
+    __atomic_store_n(&t->timer_deadline, 0, __ATOMIC_SEQ_CST);
+}
+
+/* hart owning the CLINT register at 'addr' in a per-hart array at 'base' */
+static inline struct hart *clint_hart(struct hart *h, uint32_t addr,
+                                      uint32_t base, uint32_t stride)
+{
+    uint32_t i = (addr - base) / stride;
+    if (addr < base || i >= h->m->n_harts)
+        return NULL;
+    return &h->m->hart[i];
+}
+
+/* 32-bit CLINT register at 'addr', returns -1 if there is none */
+static int clint_reg_read(struct hart *h, uint32_t addr, uint32_t *pval)
+{
+    struct hart *t;
+
+    if (addr == MTIME_ADDR) {
+        *pval = (uint32_t) timer_read(h);
+    } else if (addr == MTIME_ADDR + 4) {
+        *pval = (uint32_t)(timer_read(h) >> 32);
+    } else if ((t = clint_hart(h, addr, MTIMECMP_ADDR, 8))) {
+        uint64_t cmp = __atomic_load_n(&t->mtimecmp, __ATOMIC_SEQ_CST);
+        *pval = (uint32_t)((addr & 4) ? cmp >> 32 : cmp);
+    } else if ((t = clint_hart(h, addr, MSIP_ADDR, 4))) {
+        *pval = (__atomic_load_n(&t->mip, __ATOMIC_SEQ_CST) & MIP_MSIP) != 0;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int clint_reg_write(struct hart *h, uint32_t addr, uint32_t val)
+{
+    struct hart *t;
+
+    if ((t = clint_hart(h, addr, MTIMECMP_ADDR, 8))) {
+        timer_set_cmp(t, val, addr & 4);
+    } else if ((t = clint_hart(h, addr, MSIP_ADDR, 4))) {
+        /* inter-processor interrupt */
+        if (val & 1)
+            mip_set(t, MIP_MSIP);
+        else
+            mip_clear(t, MIP_MSIP);
+    } else {
+        return -1;
+    }
+    if (t == h)
+        irq_update(h);
+    return 0;
+}
+
+/* byte and halfword accesses read or modify part of a register */
+static int clint_read(struct hart *h, struct device *dev, uint32_t offset,
+                      int size, uint32_t *pval)
+{
+    uint32_t addr = dev->base + offset;
+
+    (void) size;
+    if (clint_reg_read(h, addr & ~3, pval))
+        return -1;
+    *pval >>= (addr & 3) * 8;
+    return 0;
+}
+
+static int clint_write(struct hart *h, struct device *dev, uint32_t offset,
+                       int size, uint32_t val)
+{
+    uint32_t addr = dev->base + offset;
+    uint32_t word, shift, mask;
+
+    if (size < 4) {
+        if (clint_reg_read(h, addr & ~3, &word))
+            return -1;
+        shift = (addr & 3) * 8;
+        mask = (size == 1 ? 0xff : 0xffff) << shift;
+        val = (word & ~mask) | ((val << shift) & mask);
+    }
+    return clint_reg_write(h, addr & ~3, val);
+}
+
+/* test for UART output, compatible with QEMU */
+static int uart_read(struct hart *h, struct device *dev, uint32_t offset,
+                     int size, uint32_t *pval)
+{
+    (void) h, (void) dev, (void) offset, (void) size;
+    *pval = 0;
+    return 0;
+}
+
+static int uart_write(struct hart *h, struct device *dev, uint32_t offset,
+                      int size, uint32_t val)
+{
+    (void) h, (void) dev, (void) size, (void) val;
+    if (offset == 0) {
+        debug_out("%c", (uint8_t) val);
+    }
+    return 0;
+}
+
+static const struct device clint_device = {"clint", CLINT_ADDR, CLINT_SIZE,
+                                           clint_read, clint_write, NULL};
+static const struct device uart_device = {"uart", UART_TX_ADDR, 4, uart_read,
+                                          uart_write, NULL};
+
+/* access of 'size' bytes at 'addr' by the device owning its page, returns
+ * non-zero with pending_exception set if it faults */
+static int device_read(struct hart *h, uint32_t addr, int size,
+                       uint32_t *pval)
+{
+    struct machine *m = h->m;
+    struct device *dev = &m->devices[m->io_pages[addr >> RAM_PAGE_BITS] - 1];
+    uint32_t offset = addr - dev->base;
+
+    *pval = 0;
+    if (offset >= dev->size || (uint32_t) size > dev->size - offset ||
+        dev->read == NULL || dev->read(h, dev, offset, size, pval)) {
+        debug_out("illegal read %d, PC: 0x%08x, address: 0x%08x\n", size * 8,
+                  h->pc, addr);
+        h->pending_exception = CAUSE_FAULT_LOAD;
+        h->pending_tval = addr;
+        return 1;
+    }
+    return 0;
+}
+
+static int device_write(struct hart *h, uint32_t addr, int size, uint32_t val)
+{
+    struct machine *m = h->m;
+    struct device *dev = &m->devices[m->io_pages[addr >> RAM_PAGE_BITS] - 1];
+    uint32_t offset = addr - dev->base;
+
+    if (offset >= dev->size || (uint32_t) size > dev->size - offset ||
+        dev->write == NULL || dev->write(h, dev, offset, size, val)) {
+        debug_out("illegal write %d, PC: 0x%08x, address: 0x%08x\n",
+                  size * 8, h->pc, addr);
+        h->pending_exception = CAUSE_FAULT_STORE;
+        h->pending_tval = addr;
+        return 1;
+    }
+    return 0;
+}
+
+/* TRUE if a device shares a page with the RAM of 'm' */
+static int ram_has_devices(const struct machine *m)
+{
+    uint64_t start = m->ram_start & ~(uint64_t)(RAM_PAGE_SIZE - 1);
+    uint64_t end = (uint64_t) m->ram_start + m->ram_size;
+
+    for (uint32_t i = 0; i < m->n_devices; i++) {
+        const struct device *dev = &m->devices[i];
+        if (dev->base < end && (uint64_t) dev->base + dev->size > start)
+            return TRUE;
+    }
+    return FALSE;
+}
+
 static inline int ctz32(uint32_t val)
 {
 #if defined(__GNUC__) && __GNUC__ >= 4
@@ -297,6 +820,42 @@ static inline int ctz32(uint32_t val)
 #endif
 }
 
+static inline int clz32(uint32_t val)
+{
+#if defined(__GNUC__) && __GNUC__ >= 4
+    return val ? __builtin_clz(val) : 32;
+#else
+    int cnt = 0;
+    while (cnt < 32 && !(val & 0x80000000UL)) {
+        cnt++;
+        val <<= 1;
+    }
+    return cnt;
+#endif
+}
+
+static inline int popcount32(uint32_t val)
+{
+#if defined(__GNUC__) && __GNUC__ >= 4
+    return __builtin_popcount(val);
+#else
+    val = val - ((val >> 1) & 0x55555555UL);
+    val = (val & 0x33333333UL) + ((val >> 2) & 0x33333333UL);
+    val = (val + (val >> 4)) & 0x0F0F0F0FUL;
+    return (val * 0x01010101UL) >> 24;
+#endif
+}
+
+static inline uint32_t bswap32(uint32_t val)
+{
+#if defined(__GNUC__) && __GNUC__ >= 4
+    return __builtin_bswap32(val);
+#else
+    return (val >> 24) | ((val >> 8) & 0xff00) | ((val << 8) & 0xff0000) |
+           (val << 24);
+#endif
+}
+
 #define SSTATUS_MASK0                                                        \
     (MSTATUS_UIE | MSTATUS_SIE | MSTATUS_UPIE | MSTATUS_SPIE | MSTATUS_SPP | \
      MSTATUS_FS | MSTATUS_XS | MSTATUS_SUM | MSTATUS_MXR)
@@ -311,12 +870,169 @@ static inline int ctz32(uint32_t val)
 /* cycle and insn counters */
 #define COUNTEREN_MASK ((1 << 0) | (1 << 2))
 
+void tlb_flush(struct hart *h)
+{
+    memset(h->tlb, 0, sizeof(h->tlb));
+}
+
+/* privilege level of loads and stores, which differs from priv with
+ * MPRV */
+static inline int data_priv_level(const struct hart *h)
+{
+    if (h->priv == PRV_M && (h->mstatus & MSTATUS_MPRV))
+        return (h->mstatus >> MSTATUS_MPP_SHIFT) & 3;
+    return h->priv;
+}
+
+/* recompute the translation state of 'h' after priv, mstatus, satp or the
+ * PMP changed. TLB entries hold the permissions of both S and U-mode, so
+ * only satp, SUM and MXR changes need a flush. */
+void mmu_update(struct hart *h)
+{
+    int data_priv = data_priv_level(h);
+
+    if (h->satp & SATP_MODE) {
+        h->fetch_priv = h->priv;
+        h->data_priv = data_priv;
+    } else {
+        h->fetch_priv = h->data_priv = PRV_M;
+    }
+    h->check_data = h->data_priv != PRV_M ||
+                    (h->pmp_active && (data_priv != PRV_M || h->pmp_locked));
+    /* the direct accesses of the guard page mode are not checked */
+    h->guest_base = h->check_data ? NULL : h->m->guest_base;
+}
+
+/* physical address range [*plo, *phi) of the PMP entry 'i', returns FALSE
+ * if it is off */
+static int pmp_range(const struct hart *h, int i, uint64_t *plo,
+                     uint64_t *phi)
+{
+    uint64_t addr = (uint64_t) h->pmpaddr[i] << 2, mask;
+
+    switch (h->pmpcfg[i] & PMP_A) {
+    case PMP_TOR:
+        *plo = i ? (uint64_t) h->pmpaddr[i - 1] << 2 : 0;
+        *phi = addr;
+        break;
+    case PMP_NA4:
+        *plo = addr;
+        *phi = addr + 4;
+        break;
+    case PMP_NAPOT:
+        /* the trailing ones of pmpaddr give the size */
+        addr |= 3;
+        mask = addr ^ (addr + 1);
+        *plo = addr & ~mask;
+        *phi = *plo + mask + 1;
+        break;
+    default:
+        return FALSE;
+    }
+    return *plo < *phi;
+}
+
+/* ACCESS_x allowed by the PMP for all of [start, end) in S and U-mode, and
+ * shifted by PMP_M_SHIFT in M-mode. PMP_MIXED if an entry only matches a
+ * part of it. */
+#define PMP_M_SHIFT 3
+#define PMP_MIXED (1 << 6)
+#define PMP_VALID (1 << 7)
+
+static uint32_t pmp_perm(const struct hart *h, uint64_t start, uint64_t end)
+{
+    uint64_t lo, hi;
+    uint32_t perm;
+
+    /* the lowest numbered matching entry applies */
+    for (int i = 0; i < PMP_COUNT; i++) {
+        if (!pmp_range(h, i, &lo, &hi) || hi <= start || lo >= end)
+            continue;
+        if (lo > start || hi < end)
+            return PMP_MIXED;
+        perm = h->pmpcfg[i] & (PMP_R | PMP_W | PMP_X);
+        /* M-mode is only restricted by locked entries */
+        return perm | ((h->pmpcfg[i] & PMP_L ? perm : 7) << PMP_M_SHIFT);
+    }
+    /* no match: M-mode has full access, S and U-mode none */
+    return 7 << PMP_M_SHIFT;
+}
+
+/* TRUE if the PMP denies an 'access' at the physical address 'addr' from
+ * the privilege level 'priv'. The permissions are cached per page; a page
+ * split by an entry boundary is checked on every (aligned) access. */
+static inline int pmp_deny(struct hart *h, uint32_t addr, int access,
+                           int priv)
+{
+    struct pmp_page *c =
+        &h->pmp_cache[(addr >> RAM_PAGE_BITS) & (PMP_CACHE_SIZE - 1)];
+    uint32_t perm;
+
+    if (c->page != addr >> RAM_PAGE_BITS || !c->perm) {
+        uint64_t start = addr & ~(RAM_PAGE_SIZE - 1);
+        c->page = addr >> RAM_PAGE_BITS;
+        c->perm = pmp_perm(h, start, start + RAM_PAGE_SIZE) | PMP_VALID;
+    }
+    perm = c->perm;
+    if (perm & PMP_MIXED)
+        perm = pmp_perm(h, addr & ~3, (uint64_t)(addr & ~3) + 4);
+    return !((perm >> (priv == PRV_M ? PMP_M_SHIFT : 0)) & access);
+}
+
+void block_cache_flush(struct hart *h);
+
+/* recompute the PMP state of 'h' after a pmpcfg or pmpaddr write. The
+ * cached permissions, the TLB (page table accesses are checked too) and
+ * the decoded blocks (fetches are checked when decoding) are flushed. */
+void pmp_update(struct hart *h)
+{
+    h->pmp_active = h->pmp_locked = FALSE;
+    for (int i = 0; i < PMP_COUNT; i++) {
+        if (h->pmpcfg[i] & PMP_A) {
+            h->pmp_active = TRUE;
+            if (h->pmpcfg[i] & PMP_L)
+                h->pmp_locked = TRUE;
+        }
+    }
+    memset(h->pmp_cache, 0, sizeof(h->pmp_cache));
+    tlb_flush(h);
+    block_cache_flush(h);
+    mmu_update(h);
+}
+
+/* pmpcfg 'n' holds the configuration of the entries 4 * n to 4 * n + 3,
+ * locked entries are not changed */
+static void pmp_write_cfg(struct hart *h, int n, uint32_t val)
+{
+    for (int i = 0; i < 4; i++) {
+        uint8_t cfg = (val >> (8 * i)) & (PMP_L | PMP_A | PMP_X | PMP_W |
+                                          PMP_R);
+        /* W without R is reserved */
+        if (!(cfg & PMP_R))
+            cfg &= ~PMP_W;
+        if (!(h->pmpcfg[4 * n + i] & PMP_L))
+            h->pmpcfg[4 * n + i] = cfg;
+    }
+    pmp_update(h);
+}
+
+static void pmp_write_addr(struct hart *h, int i, uint32_t val)
+{
+    /* the address of a locked entry, or the base of a locked TOR entry */
+    if ((h->pmpcfg[i] & PMP_L) ||
+        (i + 1 < PMP_COUNT &&
+         (h->pmpcfg[i + 1] & (PMP_L | PMP_A)) == (PMP_L | PMP_TOR)))
+        return;
+    h->pmpaddr[i] = val;
+    pmp_update(h);
+}
+
 /* return the complete mstatus with the SD bit */
-uint32_t get_mstatus(uint32_t mask)
+uint32_t get_mstatus(struct hart *h, uint32_t mask)
 {
     uint32_t val;
     int sd;
-    val = mstatus | (fs << MSTATUS_FS_SHIFT);
+    val = h->mstatus | (h->fs << MSTATUS_FS_SHIFT);
     val &= mask;
     sd =
         ((val & MSTATUS_FS) == MSTATUS_FS) | ((val & MSTATUS_XS) == MSTATUS_XS);
@@ -325,12 +1041,15 @@ uint32_t get_mstatus(uint32_t mask)
     return val;
 }
 
-void set_mstatus(uint32_t val)
+void set_mstatus(struct hart *h, uint32_t val)
 {
-    fs = (val >> MSTATUS_FS_SHIFT) & 3;
+    h->fs = (val >> MSTATUS_FS_SHIFT) & 3;
 
     uint32_t mask = MSTATUS_MASK & ~MSTATUS_FS;
-    mstatus = (mstatus & ~mask) | (val & mask);
+    if ((h->mstatus ^ val) & mask & (MSTATUS_SUM | MSTATUS_MXR))
+        tlb_flush(h);
+    h->mstatus = (h->mstatus & ~mask) | (val & mask);
+    mmu_update(h);
 }
 
 void invalid_csr(uint32_t *pval, uint32_t csr)
@@ -344,7 +1063,7 @@ void invalid_csr(uint32_t *pval, uint32_t csr)
 
 /* return -1 if invalid CSR. 0 if OK. 'will_write' indicate that the
    csr will be written after (used for CSR access check) */
-int csr_read(uint32_t *pval, uint32_t csr, int will_write)
+int csr_read(struct hart *h, uint32_t *pval, uint32_t csr, int will_write)
 {
     uint32_t val;
 
@@ -354,7 +1073,7 @@ int csr_read(uint32_t *pval, uint32_t csr, int will_write)
 
     if (((csr & 0xc00) == 0xc00) && will_write)
         return -1; /* read-only CSR */
-    if (priv < ((csr >> 8) & 3))
+    if (h->priv < ((csr >> 8) & 3))
         return -1; /* not enough priviledge */
 
     switch (csr) {
@@ -362,116 +1081,126 @@ int csr_read(uint32_t *pval, uint32_t csr, int will_write)
     case 0xc02: /* instret */
     {
         uint32_t counteren;
-        if (priv < PRV_M) {
-            if (priv < PRV_S)
-                counteren = scounteren;
+        if (h->priv < PRV_M) {
+            if (h->priv < PRV_S)
+                counteren = h->scounteren;
             else
-                counteren = mcounteren;
+                counteren = h->mcounteren;
             if (((counteren >> (csr & 0x1f)) & 1) == 0) {
                 invalid_csr(pval, csr);
                 return -1;
             }
         }
     }
-        val = (int64_t) insn_counter;
+        val = (int64_t) h->insn_counter;
         break;
     case 0xc80: /* cycleh */
     case 0xc82: /* instreth */
     {
         uint32_t counteren;
-        if (priv < PRV_M) {
-            if (priv < PRV_S)
-                counteren = scounteren;
+        if (h->priv < PRV_M) {
+            if (h->priv < PRV_S)
+                counteren = h->scounteren;
             else
-                counteren = mcounteren;
+                counteren = h->mcounteren;
             if (((counteren >> (csr & 0x1f)) & 1) == 0) {
                 invalid_csr(pval, csr);
                 return -1;
             }
         }
     }
-        val = insn_counter >> 32;
+        val = h->insn_counter >> 32;
         break;
 
     case 0x100:
-        val = get_mstatus(SSTATUS_MASK);
+        val = get_mstatus(h, SSTATUS_MASK);
         break;
     case 0x104: /* sie */
-        val = mie & mideleg;
+        val = h->mie & h->mideleg;
         break;
     case 0x105:
-        val = stvec;
+        val = h->stvec;
         break;
     case 0x106:
-        val = scounteren;
+        val = h->scounteren;
         break;
     case 0x140:
-        val = sscratch;
+        val = h->sscratch;
         break;
     case 0x141:
-        val = sepc;
+        val = h->sepc;
         break;
     case 0x142:
-        val = scause;
+        val = h->scause;
         break;
     case 0x143:
-        val = stval;
+        val = h->stval;
         break;
     case 0x144: /* sip */
-        val = mip & mideleg;
+        val = h->mip & h->mideleg;
         break;
     case 0x180:
-        val = satp;
+        val = h->satp;
         break;
     case 0x300:
-        val = get_mstatus((uint32_t) -1);
+        val = get_mstatus(h, (uint32_t) -1);
         break;
     case 0x301:
-        val = misa;
-        val |= (uint32_t) mxl << (XLEN - 2);
+        val = h->misa;
+        val |= (uint32_t) h->mxl << (XLEN - 2);
         break;
     case 0x302:
-        val = medeleg;
+        val = h->medeleg;
         break;
     case 0x303:
-        val = mideleg;
+        val = h->mideleg;
         break;
     case 0x304:
-        val = mie;
+        val = h->mie;
         break;
     case 0x305:
-        val = mtvec;
+        val = h->mtvec;
         break;
     case 0x306:
-        val = mcounteren;
+        val = h->mcounteren;
         break;
     case 0x340:
-        val = mscratch;
+        val = h->mscratch;
         break;
     case 0x341:
-        val = mepc;
+        val = h->mepc;
         break;
     case 0x342:
-        val = mcause;
+        val = h->mcause;
         break;
     case 0x343:
-        val = mtval;
+        val = h->mtval;
         break;
     case 0x344:
-        val = mip;
+        val = h->mip;
         break;
     case 0xb00: /* mcycle */
     case 0xb02: /* minstret */
-        val = (int64_t) insn_counter;
+        val = (int64_t) h->insn_counter;
         break;
     case 0xb80: /* mcycleh */
     case 0xb82: /* minstreth */
-        val = insn_counter >> 32;
+        val = h->insn_counter >> 32;
         break;
     case 0xf14:
-        val = mhartid;
+        val = h->mhartid;
         break;
     default:
+        if (csr >= 0x3a0 && csr <= 0x3a3) { /* pmpcfg0-3 */
+            val = 0;
+            for (int i = 3; i >= 0; i--)
+                val = (val << 8) | h->pmpcfg[4 * (csr & 3) + i];
+            break;
+        }
+        if (csr >= 0x3b0 && csr <= 0x3bf) { /* pmpaddr0-15 */
+            val = h->pmpaddr[csr & 15];
+            break;
+        }
         invalid_csr(pval, csr);
         /* return -1; */
         return 0;
@@ -487,7 +1216,7 @@ int csr_read(uint32_t *pval, uint32_t csr, int will_write)
 
 /* return -1 if invalid CSR, 0 if OK, 1 if the interpreter loop must be
    exited (e.g. XLEN was modified), 2 if TLBs have been flushed. */
-int csr_write(uint32_t csr, uint32_t val)
+int csr_write(struct hart *h, uint32_t csr, uint32_t val)
 {
     uint32_t mask;
 #ifdef DEBUG_EXTRA
@@ -495,119 +1224,135 @@ int csr_write(uint32_t csr, uint32_t val)
 #endif
     switch (csr) {
     case 0x100: /* sstatus */
-        set_mstatus((mstatus & ~SSTATUS_MASK) | (val & SSTATUS_MASK));
+        set_mstatus(h, (h->mstatus & ~SSTATUS_MASK) | (val & SSTATUS_MASK));
         break;
     case 0x104: /* sie */
-        mask = mideleg;
-        mie = (mie & ~mask) | (val & mask);
+        mask = h->mideleg;
+        h->mie = (h->mie & ~mask) | (val & mask);
         break;
     case 0x105:
-        stvec = val & ~3;
+        h->stvec = val & ~3;
         break;
     case 0x106:
-        scounteren = val & COUNTEREN_MASK;
+        h->scounteren = val & COUNTEREN_MASK;
         break;
     case 0x140:
-        sscratch = val;
+        h->sscratch = val;
         break;
     case 0x141:
-        sepc = val & ~1;
+        h->sepc = val & ~1;
         break;
     case 0x142:
-        scause = val;
+        h->scause = val;
         break;
     case 0x143:
-        stval = val;
+        h->stval = val;
         break;
     case 0x144: /* sip */
-        mask = mideleg;
-        mip = (mip & ~mask) | (val & mask);
+        mask = h->mideleg;
+        mip_clear(h, mask & ~val);
+        mip_set(h, mask & val);
         break;
     case 0x180: /* no ASID implemented */
-    {
-        int new_mode;
-        new_mode = (val >> 31) & 1;
-        satp = (val & (((uint32_t) 1 << 22) - 1)) | (new_mode << 31);
-    }
+        h->satp = val & (SATP_MODE | SATP_PPN_MASK);
+        /* blocks are decoded from virtual addresses */
+        tlb_flush(h);
+        block_cache_flush(h);
+        mmu_update(h);
         return 2;
 
     case 0x300:
-        set_mstatus(val);
+        set_mstatus(h, val);
         break;
     case 0x301: /* misa */
         break;
     case 0x302:
         mask = (1 << (CAUSE_STORE_PAGE_FAULT + 1)) - 1;
-        medeleg = (medeleg & ~mask) | (val & mask);
+        h->medeleg = (h->medeleg & ~mask) | (val & mask);
         break;
     case 0x303:
         mask = MIP_SSIP | MIP_STIP | MIP_SEIP;
-        mideleg = (mideleg & ~mask) | (val & mask);
+        h->mideleg = (h->mideleg & ~mask) | (val & mask);
         break;
     case 0x304:
         mask = MIP_MSIP | MIP_MTIP | MIP_SSIP | MIP_STIP | MIP_SEIP;
-        mie = (mie & ~mask) | (val & mask);
+        h->mie = (h->mie & ~mask) | (val & mask);
         break;
     case 0x305:
-        mtvec = val & ~3;
+        h->mtvec = val & ~3;
         break;
     case 0x306:
-        mcounteren = val & COUNTEREN_MASK;
+        h->mcounteren = val & COUNTEREN_MASK;
         break;
     case 0x340:
-        mscratch = val;
+        h->mscratch = val;
         break;
     case 0x341:
-        mepc = val & ~1;
+        h->mepc = val & ~1;
         break;
     case 0x342:
-        mcause = val;
+        h->mcause = val;
         break;
     case 0x343:
-        mtval = val;
+        h->mtval = val;
         break;
     case 0x344:
         mask = MIP_SSIP | MIP_STIP;
-        mip = (mip & ~mask) | (val & mask);
+        mip_clear(h, mask & ~val);
+        mip_set(h, mask & val);
         break;
     default:
+        if (csr >= 0x3a0 && csr <= 0x3a3) {
+            pmp_write_cfg(h, csr & 3, val);
+            return 2;
+        }
+        if (csr >= 0x3b0 && csr <= 0x3bf) {
+            pmp_write_addr(h, csr & 15, val);
+            return 2;
+        }
         return 0;
         /* return -1; */
     }
+    /* sie, sip, mie, mip, mideleg or mstatus may have changed */
+    irq_update(h);
     return 0;
 }
 
-void handle_sret()
+void handle_sret(struct hart *h)
 {
     int spp, spie;
-    spp = (mstatus >> MSTATUS_SPP_SHIFT) & 1;
+    spp = (h->mstatus >> MSTATUS_SPP_SHIFT) & 1;
     /* set the IE state to previous IE state */
-    spie = (mstatus >> MSTATUS_SPIE_SHIFT) & 1;
-    mstatus = (mstatus & ~(1 << spp)) | (spie << spp);
+    spie = (h->mstatus >> MSTATUS_SPIE_SHIFT) & 1;
+    h->mstatus = (h->mstatus & ~(1 << spp)) | (spie << spp);
     /* set SPIE to 1 */
-    mstatus |= MSTATUS_SPIE;
+    h->mstatus |= MSTATUS_SPIE;
     /* set SPP to U */
-    mstatus &= ~MSTATUS_SPP;
-    priv = spp;
-    next_pc = sepc;
+    h->mstatus &= ~MSTATUS_SPP;
+    h->priv = spp;
+    h->next_pc = h->sepc;
+    mmu_update(h);
+    irq_update(h);
 }
 
-void handle_mret()
+void handle_mret(struct hart *h)
 {
     int mpp, mpie;
-    mpp = (mstatus >> MSTATUS_MPP_SHIFT) & 3;
+    mpp = (h->mstatus >> MSTATUS_MPP_SHIFT) & 3;
     /* set the IE state to previous IE state */
-    mpie = (mstatus >> MSTATUS_MPIE_SHIFT) & 1;
-    mstatus = (mstatus & ~(1 << mpp)) | (mpie << mpp);
+    mpie = (h->mstatus >> MSTATUS_MPIE_SHIFT) & 1;
+    h->mstatus = (h->mstatus & ~(1 << mpp)) | (mpie << mpp);
     /* set MPIE to 1 */
-    mstatus |= MSTATUS_MPIE;
+    h->mstatus |= MSTATUS_MPIE;
     /* set MPP to U */
-    mstatus &= ~MSTATUS_MPP;
-    priv = mpp;
-    next_pc = mepc;
+    h->mstatus &= ~MSTATUS_MPP;
+    h->priv = mpp;
+    h->next_pc = h->mepc;
+    mmu_update(h);
+    irq_update(h);
 }
 
-void raise_exception(uint32_t cause, uint32_t tval)
+void raise_exception(struct hart *h, uint32_t cause, uint32_t tval)
 {
     int deleg;
 
@@ -615,336 +1360,472 @@ void raise_exception(uint32_t cause, uint32_t tval)
     if (cause == CAUSE_ILLEGAL_INSTRUCTION) {
         debug_out("raise_exception: illegal instruction 0x%x 0x%x\n", cause,
                   tval);
-        machine_running = FALSE;
+        machine_stop(h->m, STOP_EXIT);
         return;
     }
 
-    if (priv <= PRV_S) {
+    if (h->priv <= PRV_S) {
         /* delegate the exception to the supervisor priviledge */
         if (cause & CAUSE_INTERRUPT)
-            deleg = (mideleg >> (cause & (XLEN - 1))) & 1;
+            deleg = (h->mideleg >> (cause & (XLEN - 1))) & 1;
         else
-            deleg = (medeleg >> cause) & 1;
+            deleg = (h->medeleg >> cause) & 1;
     } else {
         deleg = 0;
     }
 
     if (deleg) {
-        scause = cause;
-        sepc = pc;
-        stval = tval;
-        mstatus = (mstatus & ~MSTATUS_SPIE) |
-                  (((mstatus >> priv) & 1) << MSTATUS_SPIE_SHIFT);
-        mstatus = (mstatus & ~MSTATUS_SPP) | (priv << MSTATUS_SPP_SHIFT);
-        mstatus &= ~MSTATUS_SIE;
-        priv = PRV_S;
-        next_pc = stvec;
+        h->scause = cause;
+        h->sepc = h->pc;
+        h->stval = tval;
+        h->mstatus = (h->mstatus & ~MSTATUS_SPIE) |
+                     (((h->mstatus >> h->priv) & 1) << MSTATUS_SPIE_SHIFT);
+        h->mstatus =
+            (h->mstatus & ~MSTATUS_SPP) | (h->priv << MSTATUS_SPP_SHIFT);
+        h->mstatus &= ~MSTATUS_SIE;
+        h->priv = PRV_S;
+        h->next_pc = h->stvec;
     } else {
-        mcause = cause;
-        mepc = pc;
-        mtval = tval;
-        mstatus = (mstatus & ~MSTATUS_MPIE) |
-                  (((mstatus >> priv) & 1) << MSTATUS_MPIE_SHIFT);
-        mstatus = (mstatus & ~MSTATUS_MPP) | (priv << MSTATUS_MPP_SHIFT);
-        mstatus &= ~MSTATUS_MIE;
-        priv = PRV_M;
-        next_pc = mtvec;
+        h->mcause = cause;
+        h->mepc = h->pc;
+        h->mtval = tval;
+        h->mstatus = (h->mstatus & ~MSTATUS_MPIE) |
+                     (((h->mstatus >> h->priv) & 1) << MSTATUS_MPIE_SHIFT);
+        h->mstatus =
+            (h->mstatus & ~MSTATUS_MPP) | (h->priv << MSTATUS_MPP_SHIFT);
+        h->mstatus &= ~MSTATUS_MIE;
+        h->priv = PRV_M;
+        h->next_pc = h->mtvec;
     }
+    mmu_update(h);
+    irq_update(h);
 }
 
-uint32_t get_pending_irq_mask()
+int raise_interrupt(struct hart *h)
 {
-    uint32_t pending_ints, enabled_ints;
+    uint32_t mask;
+    int irq_num;
 
-    pending_ints = mip & mie;
-    if (pending_ints == 0)
+    mask = get_pending_irq_mask(h);
+    if (mask == 0) {
+        /* irq_pending was set by another hart for a disabled interrupt */
+        irq_update(h);
         return 0;
-
-    enabled_ints = 0;
-    switch (priv) {
-    case PRV_M:
-        if (mstatus & MSTATUS_MIE)
-            enabled_ints = ~mideleg;
-        break;
-    case PRV_S:
-        enabled_ints = ~mideleg;
-        if (mstatus & MSTATUS_SIE)
-            enabled_ints |= mideleg;
-        break;
-    default:
-    case PRV_U:
-        enabled_ints = -1;
-        break;
     }
-    return pending_ints & enabled_ints;
+    irq_num = ctz32(mask);
+    raise_exception(h, irq_num | CAUSE_INTERRUPT, 0);
+    return -1;
 }
 
-int raise_interrupt()
+/* Guest memory is little-endian. Words are accessed with memcpy(), which
+ * compiles to a single load or store of any alignment without breaking the
+ * aliasing rules; big-endian hosts swap the bytes. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define le16_to_host(x) __builtin_bswap16(x)
+#define le32_to_host(x) __builtin_bswap32(x)
+#else
+#define le16_to_host(x) (x)
+#define le32_to_host(x) (x)
+#endif
+
+static inline uint16_t ram_read_u16(const uint8_t *p)
 {
-    uint32_t mask;
-    int irq_num;
+    uint16_t val;
+    memcpy(&val, p, 2);
+    return le16_to_host(val);
+}
 
-    mask = get_pending_irq_mask();
-    if (mask == 0)
-        return 0;
-    irq_num = ctz32(mask);
-    raise_exception(irq_num | CAUSE_INTERRUPT, 0);
-    return -1;
+static inline uint32_t ram_read_u32(const uint8_t *p)
+{
+    uint32_t val;
+    memcpy(&val, p, 4);
+    return le32_to_host(val);
 }
 
-/* read 32-bit instruction from memory by PC */
+static inline void ram_write_u16(uint8_t *p, uint16_t val)
+{
+    val = le16_to_host(val);
+    memcpy(p, &val, 2);
+}
 
-uint32_t get_insn32(uint32_t pc)
+static inline void ram_write_u32(uint8_t *p, uint32_t val)
 {
-#ifdef DEBUG_EXTRA
-    if (pc && pc < minmemr)
-        minmemr = pc;
-    if (pc + 3 > maxmemr)
-        maxmemr = pc + 3;
-#endif
-    uint32_t ptr = pc - ram_start;
-    if (ptr > RAM_SIZE)
-        return 1;
-    uint8_t *p = ram + ptr;
-    return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+    val = le32_to_host(val);
+    memcpy(p, &val, 4);
 }
 
-/* read 32-bit or 16-bit instruction from memory by PC and set next_pc */
+/* walk the Sv32 page table for an access at 'vaddr' checked with the
+ * permissions of 'priv' and fill the TLB entry 'e'. The A and D bits are
+ * set in the PTE. Returns non-zero with pending_exception set for a page
+ * fault, or an access fault if the page table is not in RAM or the PMP
+ * denies S-mode access to it. */
+static int mmu_walk(struct hart *h, struct tlb_entry *e, uint32_t vaddr,
+                    int access, int priv)
+{
+    static const uint8_t page_fault[ACCESS_CODE + 1] = {
+        [ACCESS_READ] = CAUSE_LOAD_PAGE_FAULT,
+        [ACCESS_WRITE] = CAUSE_STORE_PAGE_FAULT,
+        [ACCESS_CODE] = CAUSE_FETCH_PAGE_FAULT};
+    static const uint8_t access_fault[ACCESS_CODE + 1] = {
+        [ACCESS_READ] = CAUSE_FAULT_LOAD,
+        [ACCESS_WRITE] = CAUSE_FAULT_STORE,
+        [ACCESS_CODE] = CAUSE_FAULT_FETCH};
+    struct machine *m = h->m;
+    uint64_t table = (uint64_t)(h->satp & SATP_PPN_MASK) << RAM_PAGE_BITS;
+    uint64_t paddr;
+    uint32_t pte = 0, perm, bits, offset = 0;
+    int level;
+
+    h->pending_tval = vaddr;
+    for (level = 1; level >= 0; level--) {
+        paddr = table + ((vaddr >> (RAM_PAGE_BITS + 10 * level)) & 0x3ff) * 4;
+        offset = (uint32_t) paddr - m->ram_start;
+        if (paddr >= GUEST_SPACE || offset > m->ram_size - 4 ||
+            m->io_pages[paddr >> RAM_PAGE_BITS] ||
+            (h->pmp_active && pmp_deny(h, paddr, ACCESS_READ, PRV_S))) {
+            h->pending_exception = access_fault[access];
+            return 1;
+        }
+        pte = ram_read_u32(m->ram + offset);
+        if (!(pte & PTE_V) || (pte & (PTE_R | PTE_W)) == PTE_W)
+            goto page_fault;
+        if (pte & (PTE_R | PTE_W | PTE_X))
+            break;
+        table = (uint64_t)(pte >> PTE_PPN_SHIFT) << RAM_PAGE_BITS;
+    }
+    /* no leaf, or a misaligned superpage */
+    if (level < 0 || (level == 1 && ((pte >> PTE_PPN_SHIFT) & 0x3ff)))
+        goto page_fault;
+
+    perm = 0;
+    if ((pte & PTE_R) || ((pte & PTE_X) && (h->mstatus & MSTATUS_MXR)))
+        perm |= ACCESS_READ;
+    if (pte & PTE_W)
+        perm |= ACCESS_WRITE;
+    if (pte & PTE_X)
+        perm |= ACCESS_CODE;
+    if (pte & PTE_U) {
+        /* S-mode never executes user pages */
+        perm = (perm << TLB_USER_SHIFT) |
+               ((h->mstatus & MSTATUS_SUM) ? perm & ~ACCESS_CODE : 0);
+    }
+    if (!((perm >> (priv == PRV_U ? TLB_USER_SHIFT : 0)) & access))
+        goto page_fault;
 
-void put_bin(uint n) {
-    for (int i = 0; i < 32; i++) {
-        printf("%d", (n >> (31 - i)) & 1);
+    bits = PTE_A | (access == ACCESS_WRITE ? PTE_D : 0);
+    if ((pte & bits) != bits) {
+        if (h->pmp_active && pmp_deny(h, paddr, ACCESS_WRITE, PRV_S)) {
+            h->pending_exception = access_fault[access];
+            return 1;
+        }
+        /* other harts may update the same PTE */
+        pte = le32_to_host(__atomic_or_fetch((uint32_t *) (m->ram + offset),
+                                             le32_to_host(bits),
+                                             __ATOMIC_RELAXED));
+        m->dirty_pages[offset >> RAM_PAGE_BITS] = 1;
+    }
+    /* the first write to a clean page comes back here to set D */
+    if (!(pte & PTE_D))
+        perm &= ~(ACCESS_WRITE | (ACCESS_WRITE << TLB_USER_SHIFT));
+
+    paddr = (uint64_t)(pte >> PTE_PPN_SHIFT) << RAM_PAGE_BITS;
+    if (level == 1)
+        paddr |= vaddr & (0x3ff << RAM_PAGE_BITS);
+    if (paddr >= GUEST_SPACE) {
+        h->pending_exception = access_fault[access];
+        return 1;
     }
-    printf(" - put_bin\n");
+    e->vpage = vaddr >> RAM_PAGE_BITS;
+    e->paddr = paddr;
+    e->perm = perm;
+    return 0;
+
+page_fault:
+    h->pending_exception = page_fault[access];
+    return 1;
 }
 
-uint32_t convert_insn_from_c(uint16_t ic) {
-    uint32_t insn = 0;
-    uint opcode = ic & 0x3;
-    if (opcode == 0b01) {
-        uint func3 = (ic >> 13) & 0x7;
-        switch (func3) {
-            case 0b001: {
-                uint imm = (ic >> 2) & 0x1f;
-                if ((ic >> 12) & 1) {
-                    imm |= 0xffffffe0;
-                }
-                uint rd = (ic >> 7) & 0x1f;
-                insn = ((imm & 0xfff) << 20) | (rd << 7) | 0b0010011; // addi
-                printf("c.li rd:%d, imm:%d\n", rd, imm);
-                break;
-            }
-            case 0b011: {
-                uint rd = (ic >> 7) & 0x1f;
-                if (rd != 2) {
-                    uint imm = (ic >> 2) & 0x1f;
-                    if ((ic >> 12) & 1) {
-                        imm |= 0xfffe0000;
-                    }
-                    if (imm != 0) {
-                        insn = ((imm & 0xfffff) << 12) | (rd << 7) | 0b0010011; // lui
-                        printf("c.lui rd:%d, imm:%d\n", rd, imm);
-                    }
-                } else {
-                    uint imm = ((ic << 4) & 0b110000000) | ((ic << 1) & 0b1000000) | ((ic << 3) & 0b100000) | ((ic >> 2) & 0b10000);
-                    if ((ic >> 12) & 1) {
-                        imm |= 0xfffffe00;
-                    }
-                    if (imm != 0) {
-                        printf("c.addi16sp %d\n", imm);
-                        insn = ((imm & 0xfff) << 20) | (2 << 15) | (2 << 7) | 0b0010011; // addi
-                    }
-                }
-                break;
-            }
-            case 0b000: {
-                uint imm = (ic >> 2) & 0x1f;
-                if ((ic >> 12) & 1) {
-                    imm |= 0xffffffe0;
-                }
-                uint rd = (ic >> 7) & 0x1f;
-                if (rd != 0) {
-                    insn = ((imm & 0xfff) << 20) | (rd << 15) | (rd << 7) | 0b0010011; // addi
-                    printf("c.addi imm: %d, rd: %d\n", imm, rd);
-                } else {
-                    if (imm == 0) { // nop
-                        insn = 0b0110011; // add x0,x0,x0 ??
-                    }
-                }
-                break;
-            }
-            case 0b101: {
-                uint imm = ((ic >> 1) & (1 << 11)) | ((ic >> 2) & (1 << 10)) | ((ic >> 1) & (3 << 8)) | ((ic << 1) & (1 << 7)) | ((ic >> 1) & (1 << 6)) | ((ic << 3) & (1 << 5)) | ((ic >> 7) & (1 << 4)) | ((ic >> 2) & (7 << 1));
-                if ((ic >> 1) & (1 << 11)) {
-                    imm |= 0xfffff000;
-                }
-                printf("c.j %x(%d)\n", imm, imm);
-                //imm = ~0;
-                insn = ((imm & (1 << 20)) << 11) | ((imm & 0b11111111110) << 20) | ((imm & (1 << 11)) << 9) | (imm & (0xff << 12)) | (0 << 7) | 0b1101111;
-                //printf("%x %x\n", insn, imm);
-                //return 0;
-                break;
-            }
-            case 0b100: {
-                uint func2 = (ic >> 10) & 3;
-                uint rd = ((ic >> 7) & 7) + 8;
-                if (func2 == 0b11) {
-                    uint rm = ((ic >> 2) & 7) + 8;
-                    uint func22 = (ic >> 5) & 3;
-                    switch (func22) {
-                        case 0b00: {
-                            printf("c.sub %d, %d\n", rd, rm);
-                            insn = (0b0100000 << 25) | (rm << 20) | (rd << 15) | (0b000 << 12) | (rd << 7) | 0b0110011;
-                            break;
-                        }
-                        case 0b11: {
-                            printf("c.and %d, %d\n", rd, rm);
-                            insn = (rm << 20) | (rd << 15) | (0b111 << 12) | (rd << 7) | 0b0110011;
-                            break;
-                        }
-                        case 0b10: {
-                            printf("c.or %d, %d\n", rd, rm);
-                            insn = (rm << 20) | (rd << 15) | (0b110 << 12) | (rd << 7) | 0b0110011;
-                            break;
-                        }
-                        case 0b01: {
-                            printf("c.xor %d, %d\n", rd, rm);
-                            insn = (rm << 20) | (rd << 15) | (0b100 << 12) | (rd << 7) | 0b0110011;
-                            break;
-                        }
-                    }
-                } else {
-                    uint imm = ((ic >> 7) & (1 << 5)) | ((ic >> 2) & 0x1f);
-                    switch (func2) {
-                        case 0b00: {
-                            printf("c.srli %d, %d\n", rd, imm);
-                            insn = (imm << 20) | (rd << 15) | (0b101 << 12) | (rd << 7) | 0b0010011;
-                            break;
-                        }
-                        case 0b01: {
-                            printf("c.srai %d, %d\n", rd, imm);
-                            insn = (0b010000 << 26) | (imm << 20) | (rd << 15) | (0b101 << 12) | (rd << 7) | 0b0010011;
-                            break;
-                        }
-                        case 0b10: {
-                            if (imm & (1 << 5)) {
-                                imm |= 0xffffffc0;
-                            }
-                            printf("c.andi %d, %d\n", rd, imm);
-                            insn = ((imm & 0xfff) << 20) | (rd << 15) | (0b111 << 12) | (rd << 7) | 0b0010011; // andi
-                            break;
-                        }
-                    }
-                }
-                break;
-            }
-            case 0b110:
-            case 0b111: {
-                uint zflg = (ic >> 13) & 1;
-                uint rs1 = ((ic >> 7) & 7) + 8;
-                uint imm = ((ic << 1) & 0b11000000) | ((ic << 3) & 0b100000) | ((ic >> 7) & 0b11000) | ((ic >> 2) & 0b110);
-                if ((ic >> 12) & 1) {
-                    imm |= 0xffffff00;
-                }
-                if (!zflg) {
-                    printf("c.beqz rs:%d, %d\n", rs1, imm);
-                    uint rs2 = 0;
-                    insn = ((imm & (1 << 12)) << 19) | ((imm & 0b11111100000) << 20) | (rs2 << 20) | (rs1 << 15) | (0b000 << 12) | ((imm & 0b11110) << 7) | ((imm & (1 << 11)) >> 4) | 0b1100011; // beq
-                } else {
-                    printf("c.bnez rs:%d, %d\n", rs1, imm);
-                    uint rs2 = 0;
-                    insn = ((imm & (1 << 12)) << 19) | ((imm & 0b11111100000) << 20) | (rs2 << 20) | (rs1 << 15) | (0b001 << 12) | ((imm & 0b11110) << 7) | ((imm & (1 << 11)) >> 4) | 0b1100011; // bne
-                    printf("bne %x %x\n", insn, imm);
-                }
-                break;
-            }
+/* translate the virtual address '*paddr' of an access checked with the
+ * permissions of 'priv' through the TLB. Returns non-zero with
+ * pending_exception set if it faults. */
+static inline int mmu_translate(struct hart *h, uint32_t *paddr, int access,
+                                int priv)
+{
+    uint32_t vaddr = *paddr;
+    struct tlb_entry *e = &h->tlb[(vaddr >> RAM_PAGE_BITS) & (TLB_SIZE - 1)];
+
+    if ((e->vpage != vaddr >> RAM_PAGE_BITS ||
+         !((e->perm >> (priv == PRV_U ? TLB_USER_SHIFT : 0)) & access)) &&
+        mmu_walk(h, e, vaddr, access, priv))
+        return 1;
+    *paddr = e->paddr | (vaddr & (RAM_PAGE_SIZE - 1));
+    return 0;
+}
+
+/* physical address of a load or store, see mmu_translate() and
+ * pmp_deny() */
+static inline int data_translate(struct hart *h, uint32_t *paddr, int access)
+{
+    uint32_t vaddr = *paddr;
+
+    if (!h->check_data)
+        return 0;
+    if (h->data_priv != PRV_M && mmu_translate(h, paddr, access, h->data_priv))
+        return 1;
+    if (h->pmp_active && pmp_deny(h, *paddr, access, data_priv_level(h))) {
+        h->pending_exception =
+            access == ACCESS_WRITE ? CAUSE_FAULT_STORE : CAUSE_FAULT_LOAD;
+        h->pending_tval = vaddr;
+        return 1;
+    }
+    return 0;
+}
+
+/* physical address of a fetch, see mmu_translate() and pmp_deny() */
+static inline int fetch_translate(struct hart *h, uint32_t *paddr)
+{
+    uint32_t vaddr = *paddr;
+
+    if (h->fetch_priv != PRV_M &&
+        mmu_translate(h, paddr, ACCESS_CODE, h->fetch_priv))
+        return 1;
+    if (h->pmp_active && pmp_deny(h, *paddr, ACCESS_CODE, h->priv)) {
+        h->pending_exception = CAUSE_FAULT_FETCH;
+        h->pending_tval = vaddr;
+        return 1;
+    }
+    return 0;
+}
+
+/* a store hit the word at the RAM offset 'offset' of a page holding
+ * translated code. If the word was translated, all harts drop their blocks
+ * at their next block_find(), so code copied over code that already ran is
+ * picked up even without fence.i. The rest of the current block still runs
+ * the old instructions. */
+static void code_write(struct hart *h, uint32_t offset)
+{
+    struct machine *m = h->m;
+    uint8_t bit = 1 << ((offset >> 2) & 7);
+
+    if (m->code_words[offset >> 5] & bit) {
+        __atomic_and_fetch(&m->code_words[offset >> 5], ~bit,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&m->code_gen, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* mark the page of a store to the RAM offset 'offset' dirty and check it
+ * against the translated code */
+static inline void ram_written(struct hart *h, uint32_t offset)
+{
+    h->m->dirty_pages[offset >> RAM_PAGE_BITS] = 1;
+    if (h->m->code_pages[offset >> RAM_PAGE_BITS])
+        code_write(h, offset);
+}
+
+/* read 32-bit instruction from memory by PC */
+
+uint32_t get_insn32(struct hart *h, uint32_t pc)
+{
+#ifdef DEBUG_EXTRA
+    if (pc && pc < minmemr)
+        minmemr = pc;
+    if (pc + 3 > maxmemr)
+        maxmemr = pc + 3;
+#endif
+    uint32_t ptr = pc - h->m->ram_start;
+    if (ptr > h->m->ram_size - 4)
+        return 1;
+    return ram_read_u32(h->m->ram + ptr);
+}
+
+/* RV32C: each 16-bit instruction is expanded to the 32-bit instruction it
+ * stands for, once for all 65536 encodings, so the decoders only handle
+ * 32-bit instructions */
+
+/* sign extend the low 'bits' bits of 'val' */
+static inline int32_t rvc_sext(uint32_t val, int bits)
+{
+    return (int32_t)(val << (32 - bits)) >> (32 - bits);
+}
+
+/* x8-x15, the registers of the 3-bit fields */
+static inline uint32_t rvc_reg(uint32_t c, int pos)
+{
+    return 8 + ((c >> pos) & 7);
+}
+
+static inline uint32_t rvc_r(uint32_t funct7, uint32_t rs2, uint32_t rs1,
+                             uint32_t funct3, uint32_t rd)
+{
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+           (rd << 7) | 0x33;
+}
+
+static inline uint32_t rvc_i(int32_t imm, uint32_t rs1, uint32_t funct3,
+                             uint32_t rd, uint32_t opcode)
+{
+    return ((uint32_t) imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) |
+           opcode;
+}
+
+static inline uint32_t rvc_sw(uint32_t imm, uint32_t rs2, uint32_t rs1)
+{
+    return ((imm >> 5) << 25) | (rs2 << 20) | (rs1 << 15) | (2 << 12) |
+           ((imm & 0x1f) << 7) | 0x23;
+}
+
+static inline uint32_t rvc_b(int32_t imm, uint32_t rs1, uint32_t funct3)
+{
+    uint32_t u = imm;
+    return (((u >> 12) & 1) << 31) | (((u >> 5) & 0x3f) << 25) | (rs1 << 15) |
+           (funct3 << 12) | (((u >> 1) & 0xf) << 8) | (((u >> 11) & 1) << 7) |
+           0x63;
+}
+
+static inline uint32_t rvc_jal(int32_t imm, uint32_t rd)
+{
+    uint32_t u = imm;
+    return (((u >> 20) & 1) << 31) | (((u >> 1) & 0x3ff) << 21) |
+           (((u >> 11) & 1) << 20) | (((u >> 12) & 0xff) << 12) | (rd << 7) |
+           0x6f;
+}
+
+/* CI-format immediate: imm[5] from bit 12, imm[4:0] from bits 6:2 */
+static inline uint32_t rvc_imm6(uint32_t c)
+{
+    return ((c >> 7) & 0x20) | ((c >> 2) & 0x1f);
+}
+
+/* c.j and c.jal offset */
+static inline int32_t rvc_j_imm(uint32_t c)
+{
+    return rvc_sext(((c >> 1) & 0x800) | ((c << 2) & 0x400) |
+                        ((c >> 1) & 0x300) | ((c << 1) & 0x80) |
+                        ((c >> 1) & 0x40) | ((c << 3) & 0x20) |
+                        ((c >> 7) & 0x10) | ((c >> 2) & 0xe),
+                    12);
+}
+
+/* the 32-bit instruction of the compressed instruction 'c', 0 (an illegal
+ * instruction) for the reserved encodings and those of other extensions
+ * (F, D, RV64/128) */
+static uint32_t rvc_expand(uint32_t c)
+{
+    uint32_t rd = (c >> 7) & 0x1f, rs2 = (c >> 2) & 0x1f;
+    uint32_t imm;
+
+    switch (((c >> 11) & 0x1c) | (c & 3)) { /* funct3, quadrant */
+    case 0x00: /* c.addi4spn */
+        imm = ((c >> 1) & 0x3c0) | ((c >> 7) & 0x30) | ((c >> 2) & 8) |
+              ((c >> 4) & 4);
+        if (imm == 0)
+            return 0;
+        return rvc_i(imm, 2, 0, rvc_reg(c, 2), 0x13);
+    case 0x08: /* c.lw */
+        imm = ((c >> 7) & 0x38) | ((c >> 4) & 4) | ((c << 1) & 0x40);
+        return rvc_i(imm, rvc_reg(c, 7), 2, rvc_reg(c, 2), 0x03);
+    case 0x18: /* c.sw */
+        imm = ((c >> 7) & 0x38) | ((c >> 4) & 4) | ((c << 1) & 0x40);
+        return rvc_sw(imm, rvc_reg(c, 2), rvc_reg(c, 7));
+
+    case 0x01: /* c.addi, c.nop */
+        return rvc_i(rvc_sext(rvc_imm6(c), 6), rd, 0, rd, 0x13);
+    case 0x05: /* c.jal */
+        return rvc_jal(rvc_j_imm(c), 1);
+    case 0x09: /* c.li */
+        return rvc_i(rvc_sext(rvc_imm6(c), 6), 0, 0, rd, 0x13);
+    case 0x0d:
+        if (rd == 2) { /* c.addi16sp */
+            imm = ((c >> 3) & 0x200) | ((c >> 2) & 0x10) | ((c << 1) & 0x40) |
+                  ((c << 4) & 0x180) | ((c << 3) & 0x20);
+            if (imm == 0)
+                return 0;
+            return rvc_i(rvc_sext(imm, 10), 2, 0, 2, 0x13);
         }
-    } else if (opcode == 0b10) {
-        uint func4 = (ic >> 12) & 0xf;
-        switch (func4) {
-            case 0b1000: {
-                uint rd = (ic >> 7) & 0x1f;
-                uint rm = (ic >> 2) & 0x1f;
-                if (rm != 0) { // c.mv rd = rm -> add rd, x0, rs
-                    insn = (rm << 20) | (rd << 7) | 0b0110011;
-                    printf("c.mv %d, %d\n", rd, rm);
-                } else { // c.jr rd
-                    insn = (rd << 15) | 0b1100111;
-                    printf("c.jr %d\n", rd);
-                }
-                break;
-            }
-            case 0b1001: {
-                uint rd = (ic >> 7) & 0x1f;
-                uint rm = (ic >> 2) & 0x1f;
-                if (rm != 0) { // c.add rd,rm -> add rd, rd, rm
-                    insn = (rm << 20) | (rd << 15) | 0 | (rd << 7) | 0b0110011;
-                    printf("c.add %d, %d\n", rd, rm);
-                } else if (rd != 0) { // c.jalr rd
-                    insn = (rd << 15) | (1 << 7) | 0b1100111;
-                    printf("c.jalr %d\n", rd);
-                } else { // c.ebreak
-                    insn = (1 << 20) | 0b1110011;
-                    printf("c.ebreak\n");
-                }
-                break;
-            }
-            case 0b0000:
-            case 0b0001: {
-                uint imm = ((ic >> 7) & (1 << 5)) | ((ic >> 2) & 0x1f);
-                uint rd = (ic >> 7) & 0x1f;
-                printf("c.slli %d, %d\n", rd, imm);
-                insn = (imm << 20) | (rd << 15) | (0b001 << 12) | (rd << 7) | 0b0010011;
-                break;
-            }
-            case 0b1100:
-            case 0b1101: {
-                uint imm = ((ic >> 1) & 0b11000000) | ((ic >> 7) & 0b111100);
-                uint rs2 = (ic >> 2) & 0x1f;
-                uint rs1 = 2;
-                printf("c.swsp %d, %d\n", rs2, imm); // -> sw rs2, umm(x2)
-                insn = ((imm << 20) & 0x7f) | (rs2 << 20) | (rs1 << 15) | (0b010 << 12) | ((imm << 7) & 0x1f) | 0b0100011; // sw
-                break;
-            }
-            case 0b0100:
-            case 0b0101: {
-                uint imm = ((ic << 4) & 0b11000000) | ((ic >> 7) & 0b100000) | ((ic >> 2) & 0b11100);
-                uint rd = (ic >> 7) & 0x1f;
-                if (rd != 0) {
-                    printf("c.lwsp %d, %d\n", rd, imm); // -> lw rd, umm(x2)
-                    uint rn = 2;
-                    insn = ((imm & 0xfff) << 20) | (rn << 15) | (0b010 << 12) | (rd << 7) | 0b0000011; // lw
-                }
-                break;
+        /* c.lui */
+        imm = rvc_imm6(c);
+        if (imm == 0)
+            return 0;
+        return ((uint32_t) rvc_sext(imm, 6) << 12) | (rd << 7) | 0x37;
+    case 0x11:
+        rd = rvc_reg(c, 7);
+        switch ((c >> 10) & 3) {
+        case 0: /* c.srli */
+        case 1: /* c.srai */
+            imm = rvc_imm6(c);
+            if (imm & 0x20) /* shamt[5] is reserved on RV32 */
+                return 0;
+            return rvc_i(imm | (c & 0x400), rd, 5, rd, 0x13);
+        case 2: /* c.andi */
+            return rvc_i(rvc_sext(rvc_imm6(c), 6), rd, 7, rd, 0x13);
+        default:
+            if (c & 0x1000) /* c.subw, c.addw on RV64 */
+                return 0;
+            switch ((c >> 5) & 3) {
+            case 0: /* c.sub */
+                return rvc_r(0x20, rvc_reg(c, 2), rd, 0, rd);
+            case 1: /* c.xor */
+                return rvc_r(0, rvc_reg(c, 2), rd, 4, rd);
+            case 2: /* c.or */
+                return rvc_r(0, rvc_reg(c, 2), rd, 6, rd);
+            default: /* c.and */
+                return rvc_r(0, rvc_reg(c, 2), rd, 7, rd);
             }
         }
-    } else if (opcode == 0b00) {
-        uint func3 = (ic >> 13) & 0x7;
-        if (func3 == 0b000) { // 
-            uint rd = ((ic >> 2) & 0x1f) + 8;
-            uint imm = ((ic >> 1) & 0b1111000000) | ((ic >> 7) & 0b110000) | ((ic >> 2) & 0b1000) | ((ic >> 4) & 0b100);
-            printf("c.addi4spn %d %d\n", rd, imm); // -> addi rd, x2, imm
-            insn = (imm << 20) | (2 << 15) | (rd << 7) | 0b0010011; // addi
-        } else {
-            uint rd = ((ic >> 2) & 0x1f) + 8; // rs2
-            uint rn = ((ic >> 7) & 0x1f) + 8; // rs1
-            uint imm = ((ic >> 7) & 0b111000) | ((ic >> 4) & 0x4);
-            if ((ic << 1) & 1) {
-                imm |= 0xffffff80;
-            }
-            if (func3 == 0b110) {
-                insn = ((imm << 20) & 0x7f) | (rd << 20) | (rn << 15) | (0b010 << 12) | ((imm << 7) & 0x1f) | 0b0100011; // sw
-                printf("c.sw imm: %d, rs1: %d, rs2: %d\n", imm, rn, rd);
-            } else if (func3 == 0b010) {
-                insn = ((imm & 0xfff) << 20) | (rn << 15) | (0b010 << 12) | (rd << 7) | 0b0000011; // lw
-                printf("c.lw imm: %d, rs1: %d, rs2: %d\n", imm, rn, rd);
-            }
+    case 0x15: /* c.j */
+        return rvc_jal(rvc_j_imm(c), 0);
+    case 0x19: /* c.beqz */
+    case 0x1d: /* c.bnez */
+        imm = ((c >> 4) & 0x100) | ((c << 1) & 0xc0) | ((c << 3) & 0x20) |
+              ((c >> 7) & 0x18) | ((c >> 2) & 6);
+        return rvc_b(rvc_sext(imm, 9), rvc_reg(c, 7), (c >> 13) & 1);
+
+    case 0x02: /* c.slli */
+        imm = rvc_imm6(c);
+        if (imm & 0x20)
+            return 0;
+        return rvc_i(imm, rd, 1, rd, 0x13);
+    case 0x0a: /* c.lwsp */
+        if (rd == 0)
+            return 0;
+        imm = ((c >> 7) & 0x20) | ((c >> 2) & 0x1c) | ((c << 4) & 0xc0);
+        return rvc_i(imm, 2, 2, rd, 0x03);
+    case 0x12:
+        if ((c & 0x1000) == 0) {
+            if (rs2) /* c.mv */
+                return rvc_r(0, rs2, 0, 0, rd);
+            if (rd == 0)
+                return 0;
+            return rvc_i(0, rd, 0, 0, 0x67); /* c.jr */
         }
+        if (rs2) /* c.add */
+            return rvc_r(0, rs2, rd, 0, rd);
+        if (rd == 0) /* c.ebreak */
+            return 0x00100073;
+        return rvc_i(0, rd, 0, 1, 0x67); /* c.jalr */
+    case 0x1a: /* c.swsp */
+        imm = ((c >> 7) & 0x3c) | ((c >> 1) & 0xc0);
+        return rvc_sw(imm, rs2, 2);
+    default:
+        return 0;
     }
-    return insn;
 }
 
-uint32_t get_insn(uint32_t pc)
+/* rvc_expand() of every 16-bit value, 0 for the low halves of 32-bit
+ * instructions. Filled before main() so the harts share it read-only. */
+static uint32_t rvc_table[0x10000];
+
+static void __attribute__((constructor)) rvc_table_init(void)
+{
+    for (uint32_t c = 0; c < 0x10000; c++)
+        rvc_table[c] = (c & 3) == 3 ? 0 : rvc_expand(c);
+}
+
+/* read 32-bit or 16-bit instruction from memory by PC and set next_pc, a
+ * 16-bit instruction is returned expanded */
+
+uint32_t get_insn(struct hart *h, uint32_t pc)
 {
 #ifdef DEBUG_EXTRA
     if (pc && pc < minmemr)
@@ -952,26 +1833,116 @@ uint32_t get_insn(uint32_t pc)
     if (pc + 3 > maxmemr)
         maxmemr = pc + 3;
 #endif
-    uint32_t ptr = pc - ram_start;
-    if (ptr > RAM_SIZE)
+    uint32_t ptr = pc - h->m->ram_start;
+    if (ptr > h->m->ram_size - 2)
+        return 1;
+    uint32_t insn = ram_read_u16(h->m->ram + ptr);
+
+    if ((insn & 3) != 3) {
+        h->next_pc = pc + 2;
+        return rvc_table[insn];
+    }
+    if (ptr > h->m->ram_size - 4)
+        return 1;
+    h->next_pc = pc + 4;
+    return ram_read_u32(h->m->ram + ptr);
+}
+
+/* read a 16-bit parcel of an instruction from memory, -1 outside of RAM */
+
+static inline int32_t get_insn16(struct hart *h, uint32_t paddr)
+{
+#ifdef DEBUG_EXTRA
+    if (paddr && paddr < minmemr)
+        minmemr = paddr;
+    if (paddr + 1 > maxmemr)
+        maxmemr = paddr + 1;
+#endif
+    uint32_t ptr = paddr - h->m->ram_start;
+    if (ptr > h->m->ram_size - 2)
+        return -1;
+    return ram_read_u16(h->m->ram + ptr);
+}
+
+/* fetch_insn() of a compressed instruction, or of one at the end of a page
+ * or outside of RAM */
+static int fetch_insn_parcels(struct hart *h, uint32_t pc, uint32_t paddr,
+                              uint32_t *pinsn, uint32_t *plen,
+                              uint32_t *plast)
+{
+    int32_t lo = get_insn16(h, paddr), hi;
+
+    *plen = 4;
+    *plast = paddr + 2;
+    if (lo < 0) {
+        *pinsn = 0;
+        return 0;
+    }
+    if ((lo & 3) != 3) {
+        if (!(h->misa & MCPUID_C)) {
+            *pinsn = lo;
+            return 0;
+        }
+        *plen = 2;
+        *plast = paddr;
+        *pinsn = rvc_table[lo];
+        return 0;
+    }
+    if ((paddr & (RAM_PAGE_SIZE - 1)) != RAM_PAGE_SIZE - 2) {
+        *pinsn = get_insn32(h, paddr);
+        return 0;
+    }
+    /* the upper half is on the next page */
+    *plast = pc + 2;
+    if (fetch_translate(h, plast))
         return 1;
-    uint8_t *p = ram + ptr;
-    uint32_t insn = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+    hi = get_insn16(h, *plast);
+    *pinsn = hi < 0 ? 0 : (uint32_t) lo | (uint32_t) hi << 16;
+    return 0;
+}
 
-    if ((insn & 3) == 3) {
-        next_pc = pc + 4;
-        return insn;
+/* fetch the instruction at 'pc', whose first parcel is at the physical
+ * address 'paddr'. A compressed instruction (when C is enabled in misa) is
+ * expanded. Sets *plen to its size and *plast to the physical address of
+ * its last parcel, which is on another page if a 32-bit instruction
+ * crosses one. Returns non-zero with pending_exception set if that page
+ * can't be fetched. Outside of RAM an illegal instruction is read. */
+static inline int fetch_insn(struct hart *h, uint32_t pc, uint32_t paddr,
+                             uint32_t *pinsn, uint32_t *plen,
+                             uint32_t *plast)
+{
+    uint32_t ptr = paddr - h->m->ram_start;
+
+    /* a 32-bit instruction within a page */
+    if (ptr < h->m->ram_size &&
+        (ptr & (RAM_PAGE_SIZE - 1)) != RAM_PAGE_SIZE - 2) {
+        uint32_t insn = ram_read_u32(h->m->ram + ptr);
+        if ((insn & 3) == 3) {
+#ifdef DEBUG_EXTRA
+            if (paddr && paddr < minmemr)
+                minmemr = paddr;
+            if (paddr + 3 > maxmemr)
+                maxmemr = paddr + 3;
+#endif
+            *plen = 4;
+            *plast = paddr + 2;
+            *pinsn = insn;
+            return 0;
+        }
     }
-    next_pc = pc + 2;
-    uint ic = insn & 0xffff;
-    insn = convert_insn_from_c(ic);
-    printf("C op %04x -> %08x\n", ic, insn);
-    return insn;
+    return fetch_insn_parcels(h, pc, paddr, pinsn, plen, plast);
+}
+
+/* low bits of a PC which must be zero: 16-bit aligned with C enabled in
+ * misa, otherwise 32-bit */
+static inline uint32_t pc_align_mask(const struct hart *h)
+{
+    return h->misa & MCPUID_C ? 1 : 3;
 }
 
 /* read 8-bit data from memory */
 
-int target_read_u8(uint8_t *pval, uint32_t addr)
+int target_read_u8(struct hart *h, uint8_t *pval, uint32_t addr)
 {
 #ifdef DEBUG_EXTRA
     if ((addr >> 28) != 4 && addr < minmemr)
@@ -979,22 +1950,31 @@ int target_read_u8(uint8_t *pval, uint32_t addr)
     if (addr > maxmemr)
         maxmemr = addr;
 #endif
-    addr -= ram_start;
-    if (addr > RAM_SIZE) {
+    if (data_translate(h, &addr, ACCESS_READ))
+        return 1;
+    if (h->m->io_pages[addr >> RAM_PAGE_BITS]) {
+        uint32_t val;
+        int ret = device_read(h, addr, 1, &val);
+        *pval = val;
+        return ret;
+    }
+    addr -= h->m->ram_start;
+    if (addr > h->m->ram_size - 1) {
         *pval = 0;
-        debug_out("illegal read 8, PC: 0x%08x, address: 0x%08x\n", pc,
-               addr + ram_start);
+        debug_out("illegal read 8, PC: 0x%08x, address: 0x%08x\n", h->pc,
+               addr + h->m->ram_start);
+        h->pending_exception = CAUSE_FAULT_LOAD;
+        h->pending_tval = addr + h->m->ram_start;
         return 1;
     } else {
-        uint8_t *p = ram + addr;
-        *pval = p[0];
+        *pval = h->m->ram[addr];
     }
     return 0;
 }
 
 /* read 16-bit data from memory */
 
-int target_read_u16(uint16_t *pval, uint32_t addr)
+int target_read_u16(struct hart *h, uint16_t *pval, uint32_t addr)
 {
 #ifdef DEBUG_EXTRA
     if ((addr >> 28) != 4 && addr < minmemr)
@@ -1003,26 +1983,35 @@ int target_read_u16(uint16_t *pval, uint32_t addr)
         maxmemr = addr + 1;
 #endif
     if (addr & 1) {
-        pending_exception = CAUSE_MISALIGNED_LOAD;
-        pending_tval = addr;
+        h->pending_exception = CAUSE_MISALIGNED_LOAD;
+        h->pending_tval = addr;
+        return 1;
+    }
+    if (data_translate(h, &addr, ACCESS_READ))
         return 1;
+    if (h->m->io_pages[addr >> RAM_PAGE_BITS]) {
+        uint32_t val;
+        int ret = device_read(h, addr, 2, &val);
+        *pval = val;
+        return ret;
     }
-    addr -= ram_start;
-    if (addr > RAM_SIZE) {
+    addr -= h->m->ram_start;
+    if (addr > h->m->ram_size - 2) {
         *pval = 0;
-        debug_out("illegal read 16, PC: 0x%08x, address: 0x%08x\n", pc,
-               addr + ram_start);
+        debug_out("illegal read 16, PC: 0x%08x, address: 0x%08x\n", h->pc,
+               addr + h->m->ram_start);
+        h->pending_exception = CAUSE_FAULT_LOAD;
+        h->pending_tval = addr + h->m->ram_start;
         return 1;
     } else {
-        uint8_t *p = ram + addr;
-        *pval = p[0] | (p[1] << 8);
+        *pval = ram_read_u16(h->m->ram + addr);
     }
     return 0;
 }
 
 /* read 32-bit data from memory */
 
-int target_read_u32(uint32_t *pval, uint32_t addr)
+int target_read_u32(struct hart *h, uint32_t *pval, uint32_t addr)
 {
 #ifdef DEBUG_EXTRA
     if ((addr >> 28) != 4 && addr < minmemr)
@@ -1031,36 +2020,31 @@ int target_read_u32(uint32_t *pval, uint32_t addr)
         maxmemr = addr + 3;
 #endif
     if (addr & 3) {
-        pending_exception = CAUSE_MISALIGNED_LOAD;
-        pending_tval = addr;
+        h->pending_exception = CAUSE_MISALIGNED_LOAD;
+        h->pending_tval = addr;
         return 1;
     }
-    if (addr == MTIMECMP_ADDR) {
-        *pval = (uint32_t) mtimecmp;
-    } else if (addr == MTIMECMP_ADDR + 4) {
-        *pval = (uint32_t)(mtimecmp >> 32);
-    } else if (addr == MTIME_ADDR) {
-        *pval = (uint32_t) mtime;
-    } else if (addr == MTIME_ADDR + 4) {
-        *pval = (uint32_t)(mtime >> 32);
+    if (data_translate(h, &addr, ACCESS_READ))
+        return 1;
+    if (h->m->io_pages[addr >> RAM_PAGE_BITS])
+        return device_read(h, addr, 4, pval);
+    addr -= h->m->ram_start;
+    if (addr > h->m->ram_size - 4) {
+        *pval = 0;
+        debug_out("illegal read 32, PC: 0x%08x, address: 0x%08x\n", h->pc,
+               addr + h->m->ram_start);
+        h->pending_exception = CAUSE_FAULT_LOAD;
+        h->pending_tval = addr + h->m->ram_start;
+        return 1;
     } else {
-        addr -= ram_start;
-        if (addr > RAM_SIZE) {
-            *pval = 0;
-            debug_out("illegal read 32, PC: 0x%08x, address: 0x%08x\n", pc,
-                   addr + ram_start);
-            return 1;
-        } else {
-            uint8_t *p = ram + addr;
-            *pval = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
-        }
+        *pval = ram_read_u32(h->m->ram + addr);
     }
     return 0;
 }
 
 /* write 8-bit data to memory */
 
-int target_write_u8(uint32_t addr, uint8_t val)
+int target_write_u8(struct hart *h, uint32_t addr, uint8_t val)
 {
 #ifdef DEBUG_EXTRA
     if ((addr >> 28) != 4 && addr < minmemw)
@@ -1068,26 +2052,27 @@ int target_write_u8(uint32_t addr, uint8_t val)
     if (addr > maxmemw)
         maxmemw = addr;
 #endif
-    if (addr == UART_TX_ADDR) {
-        /* test for UART output, compatible with QEMU */
-        debug_out("%c", val);
+    if (data_translate(h, &addr, ACCESS_WRITE))
+        return 1;
+    if (h->m->io_pages[addr >> RAM_PAGE_BITS])
+        return device_write(h, addr, 1, val);
+    addr -= h->m->ram_start;
+    if (addr > h->m->ram_size - 1) {
+        debug_out("illegal write 8, PC: 0x%08x, address: 0x%08x\n", h->pc,
+               addr + h->m->ram_start);
+        h->pending_exception = CAUSE_FAULT_STORE;
+        h->pending_tval = addr + h->m->ram_start;
+        return 1;
     } else {
-        addr -= ram_start;
-        if (addr > RAM_SIZE - 1) {
-            debug_out("illegal write 8, PC: 0x%08x, address: 0x%08x\n", pc,
-                   addr + ram_start);
-            return 1;
-        } else {
-            uint8_t *p = ram + addr;
-            p[0] = val & 0xff;
-        }
+        h->m->ram[addr] = val;
+        ram_written(h, addr);
     }
     return 0;
 }
 
 /* write 16-bit data to memory */
 
-int target_write_u16(uint32_t addr, uint16_t val)
+int target_write_u16(struct hart *h, uint32_t addr, uint16_t val)
 {
 #ifdef DEBUG_EXTRA
     if ((addr >> 28) != 4 && addr < minmemw)
@@ -1096,26 +2081,31 @@ int target_write_u16(uint32_t addr, uint16_t val)
         maxmemw = addr + 1;
 #endif
     if (addr & 1) {
-        pending_exception = CAUSE_MISALIGNED_STORE;
-        pending_tval = addr;
+        h->pending_exception = CAUSE_MISALIGNED_STORE;
+        h->pending_tval = addr;
         return 1;
     }
-    addr -= ram_start;
-    if (addr > RAM_SIZE - 2) {
-        debug_out("illegal write 16, PC: 0x%08x, address: 0x%08x\n", pc,
-               addr + ram_start);
+    if (data_translate(h, &addr, ACCESS_WRITE))
+        return 1;
+    if (h->m->io_pages[addr >> RAM_PAGE_BITS])
+        return device_write(h, addr, 2, val);
+    addr -= h->m->ram_start;
+    if (addr > h->m->ram_size - 2) {
+        debug_out("illegal write 16, PC: 0x%08x, address: 0x%08x\n", h->pc,
+               addr + h->m->ram_start);
+        h->pending_exception = CAUSE_FAULT_STORE;
+        h->pending_tval = addr + h->m->ram_start;
         return 1;
     } else {
-        uint8_t *p = ram + addr;
-        p[0] = val & 0xff;
-        p[1] = (val >> 8) & 0xff;
+        ram_write_u16(h->m->ram + addr, val);
+        ram_written(h, addr);
     }
     return 0;
 }
 
 /* write 32-bit data to memory */
 
-int target_write_u32(uint32_t addr, uint32_t val)
+int target_write_u32(struct hart *h, uint32_t addr, uint32_t val)
 {
 #ifdef DEBUG_EXTRA
     if ((addr >> 28) != 4 && addr < minmemw)
@@ -1124,142 +2114,525 @@ int target_write_u32(uint32_t addr, uint32_t val)
         maxmemw = addr + 3;
 #endif
     if (addr & 3) {
-        pending_exception = CAUSE_MISALIGNED_STORE;
-        pending_tval = addr;
+        h->pending_exception = CAUSE_MISALIGNED_STORE;
+        h->pending_tval = addr;
         return 1;
     }
-    if (addr == MTIMECMP_ADDR) {
-        mtimecmp = (mtimecmp & 0xffffffff00000000ll) | val;
-        mip &= ~MIP_MTIP;
-    } else if (addr == MTIMECMP_ADDR + 4) {
-        mtimecmp = (mtimecmp & 0xffffffffll) | (((uint64_t) val) << 32);
-        mip &= ~MIP_MTIP;
+    if (data_translate(h, &addr, ACCESS_WRITE))
+        return 1;
+    if (h->m->io_pages[addr >> RAM_PAGE_BITS])
+        return device_write(h, addr, 4, val);
+    addr -= h->m->ram_start;
+    if (addr > h->m->ram_size - 4) {
+        debug_out("illegal write 32, PC: 0x%08x, address: 0x%08x\n", h->pc,
+               addr + h->m->ram_start);
+        h->pending_exception = CAUSE_FAULT_STORE;
+        h->pending_tval = addr + h->m->ram_start;
+        return 1;
     } else {
-        addr -= ram_start;
-        if (addr > RAM_SIZE - 4) {
-            debug_out("illegal write 32, PC: 0x%08x, address: 0x%08x\n", pc,
-                   addr + ram_start);
-            return 1;
-        } else {
-            uint8_t *p = ram + addr;
-            p[0] = val & 0xff;
-            p[1] = (val >> 8) & 0xff;
-            p[2] = (val >> 16) & 0xff;
-            p[3] = (val >> 24) & 0xff;
-        }
+        ram_write_u32(h->m->ram + addr, val);
+        ram_written(h, addr);
     }
     return 0;
 }
 
-#ifndef STRICT_RV32I
+/* LR/SC and AMOs are done with host atomics on the RAM word so they are
+ * atomic with respect to the other harts. This returns the host address of
+ * the aligned word at 'addr', or NULL with pending_exception set. Device
+ * registers are not supported as atomic targets. The host is expected to be
+ * little-endian like the guest. */
+static uint32_t *atomic_ptr(struct hart *h, uint32_t addr, int store)
+{
+    uint32_t offset;
 
-int32_t div32(int32_t a, int32_t b)
+    h->pending_tval = addr;
+    if (addr & 3) {
+        h->pending_exception =
+            store ? CAUSE_MISALIGNED_STORE : CAUSE_MISALIGNED_LOAD;
+        return NULL;
+    }
+    if (data_translate(h, &addr, store ? ACCESS_WRITE : ACCESS_READ))
+        return NULL;
+    offset = addr - h->m->ram_start;
+    if (offset > h->m->ram_size - 4 ||
+        h->m->io_pages[addr >> RAM_PAGE_BITS]) {
+        debug_out("illegal atomic access, PC: 0x%08x, address: 0x%08x\n",
+                  h->pc, addr);
+        h->pending_exception = store ? CAUSE_FAULT_STORE : CAUSE_FAULT_LOAD;
+        return NULL;
+    }
+    if (store)
+        ram_written(h, offset);
+    return (uint32_t *) (h->m->ram + offset);
+}
+
+/* atomic read-modify-write selected by the AMO funct5, returns the old
+ * value */
+static uint32_t atomic_amo(uint32_t *p, uint32_t funct5, uint32_t val)
 {
-    if (b == 0) {
-        return -1;
-    } else if (a == ((int32_t) 1 << (XLEN - 1)) && b == -1) {
-        return a;
-    } else {
-        return a / b;
+    uint32_t old, new;
+
+    switch (funct5) {
+    case 1: /* amoswap.w */
+        return __atomic_exchange_n(p, val, __ATOMIC_SEQ_CST);
+    case 0: /* amoadd.w */
+        return __atomic_fetch_add(p, val, __ATOMIC_SEQ_CST);
+    case 4: /* amoxor.w */
+        return __atomic_fetch_xor(p, val, __ATOMIC_SEQ_CST);
+    case 0xc: /* amoand.w */
+        return __atomic_fetch_and(p, val, __ATOMIC_SEQ_CST);
+    case 0x8: /* amoor.w */
+        return __atomic_fetch_or(p, val, __ATOMIC_SEQ_CST);
     }
+    /* min/max have no host instruction, loop on compare-and-swap */
+    old = __atomic_load_n(p, __ATOMIC_SEQ_CST);
+    do {
+        new = val;
+        switch (funct5) {
+        case 0x10: /* amomin.w */
+            if ((int32_t) old < (int32_t) val)
+                new = old;
+            break;
+        case 0x14: /* amomax.w */
+            if ((int32_t) old > (int32_t) val)
+                new = old;
+            break;
+        case 0x18: /* amominu.w */
+            if (old < val)
+                new = old;
+            break;
+        case 0x1c: /* amomaxu.w */
+            if (old > val)
+                new = old;
+            break;
+        }
+    } while (!__atomic_compare_exchange_n(p, &old, new, TRUE,
+                                          __ATOMIC_SEQ_CST,
+                                          __ATOMIC_SEQ_CST));
+    return old;
+}
+
+/* lr.w: remember the address and the value seen */
+static int atomic_lr(struct hart *h, uint32_t addr, uint32_t *pval)
+{
+    uint32_t *p = atomic_ptr(h, addr, FALSE);
+    if (!p)
+        return 1;
+    *pval = __atomic_load_n(p, __ATOMIC_SEQ_CST);
+    h->load_res = addr;
+    h->load_val = *pval;
+    return 0;
+}
+
+/* sc.w succeeds (*pval = 0) if the reserved word still holds the value seen
+ * by lr.w. Like on hosts without LL/SC this cannot detect an ABA sequence
+ * of stores by other harts, which the RISC-V forward progress rules allow
+ * software to ignore. */
+static int atomic_sc(struct hart *h, uint32_t addr, uint32_t val,
+                     uint32_t *pval)
+{
+    uint32_t *p = atomic_ptr(h, addr, TRUE);
+    uint32_t expected = h->load_val;
+    if (!p)
+        return 1;
+    *pval = 1;
+    if (h->load_res == addr &&
+        __atomic_compare_exchange_n(p, &expected, val, FALSE,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        *pval = 0;
+    /* the reservation is consumed by any sc.w */
+    h->load_res = ~0;
+    return 0;
+}
+
+/* amoxxx.w */
+static int atomic_rmw(struct hart *h, uint32_t addr, uint32_t funct5,
+                      uint32_t val, uint32_t *pval)
+{
+    uint32_t *p = atomic_ptr(h, addr, TRUE);
+    if (!p)
+        return 1;
+    *pval = atomic_amo(p, funct5, val);
+    return 0;
+}
+
+/* Division by zero and INT_MIN / -1 don't trap on RISC-V. The kernels
+ * divide by 1 instead and patch the result with masks, so they compile to a
+ * host division without branches: x / 0 is -1 and x % 0 is x, x / -1 is the
+ * (wrapping) negation of x / 1 and x % -1 is 0. */
+int32_t div32(int32_t a, int32_t b)
+{
+    uint32_t zero = -(uint32_t)(b == 0), neg = -(uint32_t)(b == -1);
+    uint32_t q = a / (b + (b == 0) + 2 * (b == -1));
+
+    return ((q ^ neg) - neg) | zero;
 }
 
 uint32_t divu32(uint32_t a, uint32_t b)
 {
-    if (b == 0) {
-        return -1;
-    }
-    return a / b;
+    return a / (b + (b == 0)) | -(uint32_t)(b == 0);
 }
 
 int32_t rem32(int32_t a, int32_t b)
 {
-    if (b == 0) {
-        return a;
-    } else if (a == ((int32_t) 1 << (XLEN - 1)) && b == -1) {
-        return 0;
-    }
-    return a % b;
+    return a % (b + (b == 0) + 2 * (b == -1)) | (a & -(b == 0));
 }
 
 uint32_t remu32(uint32_t a, uint32_t b)
 {
-    if (b == 0) {
-        return a;
-    }
-    return a % b;
+    return a % (b + (b == 0)) | (a & -(uint32_t)(b == 0));
 }
 
-static uint32_t mulh32(int32_t a, int32_t b)
+/* one 64-bit host multiply each */
+static inline uint32_t mulh32(int32_t a, int32_t b)
 {
-    return ((int64_t) a * (int64_t) b) >> 32;
+    return ((int64_t) a * b) >> 32;
 }
 
-static uint32_t mulhsu32(int32_t a, uint32_t b)
+static inline uint32_t mulhsu32(int32_t a, uint32_t b)
 {
-    return ((int64_t) a * (int64_t) b) >> 32;
+    return ((int64_t) a * b) >> 32;
 }
 
-static uint32_t mulhu32(uint32_t a, uint32_t b)
+static inline uint32_t mulhu32(uint32_t a, uint32_t b)
 {
-    return ((int64_t) a * (int64_t) b) >> 32;
+    return ((uint64_t) a * b) >> 32;
 }
 
-#endif
-
 #ifdef DEBUG_EXTRA
 
 /* dumps all registers, useful for in-depth debugging */
 
-static void dump_regs()
+static void dump_regs(struct hart *h)
 {
     printf("\nRegisters:\n");
-    printf("x0 zero: %08x\n", reg[0]);
-    printf("x1 ra:   %08x\n", reg[1]);
-    printf("x2 sp:   %08x\n", reg[2]);
-    printf("x3 gp:   %08x\n", reg[3]);
-    printf("x4 tp:   %08x\n", reg[4]);
-    printf("x5 t0:   %08x\n", reg[5]);
-    printf("x6 t1:   %08x\n", reg[6]);
-    printf("x7 t2:   %08x\n", reg[7]);
-    printf("x8 s0:   %08x\n", reg[8]);
-    printf("x9 s1:   %08x\n", reg[9]);
-    printf("x10 a0:  %08x\n", reg[10]);
-    printf("x11 a1:  %08x\n", reg[11]);
-    printf("x12 a2:  %08x\n", reg[12]);
-    printf("x13 a3:  %08x\n", reg[13]);
-    printf("x14 a4:  %08x\n", reg[14]);
-    printf("x15 a5:  %08x\n", reg[15]);
-    printf("x16 a6:  %08x\n", reg[16]);
-    printf("x17 a7:  %08x\n", reg[17]);
-    printf("x18 s2:  %08x\n", reg[18]);
-    printf("x19 s3:  %08x\n", reg[19]);
-    printf("x20 s4:  %08x\n", reg[20]);
-    printf("x21 s5:  %08x\n", reg[21]);
-    printf("x22 s6:  %08x\n", reg[22]);
-    printf("x23 s7:  %08x\n", reg[23]);
-    printf("x24 s8:  %08x\n", reg[24]);
-    printf("x25 s9:  %08x\n", reg[25]);
-    printf("x26 s10: %08x\n", reg[26]);
-    printf("x27 s11: %08x\n", reg[27]);
-    printf("x28 t3:  %08x\n", reg[28]);
-    printf("x29 t4:  %08x\n", reg[29]);
-    printf("x30 t5:  %08x\n", reg[30]);
-    printf("x31 t6:  %08x\n", reg[31]);
-}
-
-#endif
-
-void execute_instruction()
+    printf("x0 zero: %08x\n", h->reg[0]);
+    printf("x1 ra:   %08x\n", h->reg[1]);
+    printf("x2 sp:   %08x\n", h->reg[2]);
+    printf("x3 gp:   %08x\n", h->reg[3]);
+    printf("x4 tp:   %08x\n", h->reg[4]);
+    printf("x5 t0:   %08x\n", h->reg[5]);
+    printf("x6 t1:   %08x\n", h->reg[6]);
+    printf("x7 t2:   %08x\n", h->reg[7]);
+    printf("x8 s0:   %08x\n", h->reg[8]);
+    printf("x9 s1:   %08x\n", h->reg[9]);
+    printf("x10 a0:  %08x\n", h->reg[10]);
+    printf("x11 a1:  %08x\n", h->reg[11]);
+    printf("x12 a2:  %08x\n", h->reg[12]);
+    printf("x13 a3:  %08x\n", h->reg[13]);
+    printf("x14 a4:  %08x\n", h->reg[14]);
+    printf("x15 a5:  %08x\n", h->reg[15]);
+    printf("x16 a6:  %08x\n", h->reg[16]);
+    printf("x17 a7:  %08x\n", h->reg[17]);
+    printf("x18 s2:  %08x\n", h->reg[18]);
+    printf("x19 s3:  %08x\n", h->reg[19]);
+    printf("x20 s4:  %08x\n", h->reg[20]);
+    printf("x21 s5:  %08x\n", h->reg[21]);
+    printf("x22 s6:  %08x\n", h->reg[22]);
+    printf("x23 s7:  %08x\n", h->reg[23]);
+    printf("x24 s8:  %08x\n", h->reg[24]);
+    printf("x25 s9:  %08x\n", h->reg[25]);
+    printf("x26 s10: %08x\n", h->reg[26]);
+    printf("x27 s11: %08x\n", h->reg[27]);
+    printf("x28 t3:  %08x\n", h->reg[28]);
+    printf("x29 t4:  %08x\n", h->reg[29]);
+    printf("x30 t5:  %08x\n", h->reg[30]);
+    printf("x31 t6:  %08x\n", h->reg[31]);
+}
+
+#endif
+
+/* instruction identifiers, numbered like the statistics table */
+enum {
+    INSN_LUI = 0,
+    INSN_AUIPC,
+    INSN_JAL,
+    INSN_JALR,
+    INSN_BEQ,
+    INSN_BNE,
+    INSN_BLT,
+    INSN_BGE,
+    INSN_BLTU,
+    INSN_BGEU,
+    INSN_LB,
+    INSN_LH,
+    INSN_LW,
+    INSN_LBU,
+    INSN_LHU,
+    INSN_SB,
+    INSN_SH,
+    INSN_SW,
+    INSN_ADDI,
+    INSN_SLTI,
+    INSN_SLTIU,
+    INSN_XORI,
+    INSN_ORI,
+    INSN_ANDI,
+    INSN_SLLI,
+    INSN_SRLI,
+    INSN_SRAI,
+    INSN_ADD,
+    INSN_SUB,
+    INSN_SLL,
+    INSN_SLT,
+    INSN_SLTU,
+    INSN_XOR,
+    INSN_SRL,
+    INSN_SRA,
+    INSN_OR,
+    INSN_AND,
+    INSN_LI = 47,
+    INSN_MUL,
+    INSN_MULH,
+    INSN_MULHSU,
+    INSN_MULHU,
+    INSN_DIV,
+    INSN_DIVU,
+    INSN_REM,
+    INSN_REMU,
+    INSN_LR_W,
+    INSN_SC_W,
+    INSN_AMO = 63,
+    /* Zba */
+    INSN_SH1ADD,
+    INSN_SH2ADD,
+    INSN_SH3ADD,
+    /* Zbb */
+    INSN_ANDN,
+    INSN_ORN,
+    INSN_XNOR,
+    INSN_CLZ,
+    INSN_CTZ,
+    INSN_CPOP,
+    INSN_MAX,
+    INSN_MAXU,
+    INSN_MIN,
+    INSN_MINU,
+    INSN_SEXT_B,
+    INSN_SEXT_H,
+    INSN_ZEXT_H,
+    INSN_ROL,
+    INSN_ROR,
+    INSN_RORI,
+    INSN_ORC_B,
+    INSN_REV8,
+    /* Zbs */
+    INSN_BCLR,
+    INSN_BCLRI,
+    INSN_BEXT,
+    INSN_BEXTI,
+    INSN_BINV,
+    INSN_BINVI,
+    INSN_BSET,
+    INSN_BSETI,
+    /* the AMOs share a single statistics entry */
+    INSN_AMOSWAP_W,
+    INSN_AMOADD_W,
+    INSN_AMOXOR_W,
+    INSN_AMOAND_W,
+    INSN_AMOOR_W,
+    INSN_AMOMIN_W,
+    INSN_AMOMAX_W,
+    INSN_AMOMINU_W,
+    INSN_AMOMAXU_W,
+    /* register writes to x0 */
+    INSN_NOP,
+    /* everything not decoded here goes through execute_instruction() */
+    INSN_FALLBACK,
+    /* MULH, MULHSU or MULHU fused with the MUL after it, see mul_fuse() */
+    INSN_MULH_MUL,
+    INSN_MULHSU_MUL,
+    INSN_MULHU_MUL,
+    INSN_COUNT
+};
+
+/* instruction decoded once and kept in the translation cache. The handler
+ * returns non-zero when the rest of the block must be skipped. */
+struct decoded_insn {
+    uint32_t pc;
+    uint32_t insn;
+    int (*handler)(struct hart *h, const struct decoded_insn *d);
+    int32_t imm;
+    uint8_t rd, rs1, rs2;
+    uint8_t id; /* see INSN_x */
+    uint8_t op; /* dispatch index of the threaded core, INSN_x or INSN_NOP */
+    uint8_t len; /* 2 for a compressed instruction, otherwise 4 */
+};
+
+/* straight-line guest code, ended by a jump, a branch or an instruction
+ * left to execute_instruction() */
+struct block {
+    uint32_t pc_start;
+    uint32_t pc_end; /* address after the last instruction */
+    uint32_t n_insn;
+    struct decoded_insn *insn;
+    struct block *succ[2]; /* chained successors: fall-through, taken */
+    uint32_t hits;         /* executions, to find hot blocks for the JIT */
+    void *native;          /* JIT compiled code or NULL */
+    uint32_t priv;         /* block_priv() it was decoded for */
+};
+
+#define BLOCK_MAX_INSNS 64
+#define BLOCK_POOL_SIZE 4096
+#define INSN_POOL_SIZE 65536
+#define BLOCK_MAP_BITS 12
+#define BLOCK_MAP_SIZE (1 << BLOCK_MAP_BITS)
+
+/* blocks and their decoded instructions are allocated linearly from the
+ * per hart pools and only released all at once when one of the pools is
+ * exhausted. block_map is direct mapped by start PC. */
+
+void block_cache_flush(struct hart *h)
+{
+    for (uint32_t i = 0; i < h->n_blocks; i++)
+        h->block_pool[i].succ[0] = h->block_pool[i].succ[1] = NULL;
+    for (int i = 0; i < BLOCK_MAP_SIZE; i++)
+        h->block_map[i] = NULL;
+    h->n_blocks = 0;
+    h->n_pool_insns = 0;
+    h->code_gen = __atomic_load_n(&h->m->code_gen, __ATOMIC_ACQUIRE);
+}
+
+/* encodings of the Zba, Zbb and Zbs instructions: opcode, funct7, funct3
+ * and the rs2 field of those which don't have a register or shift amount
+ * there */
+static const struct {
+    uint8_t opcode, funct7, funct3;
+    int8_t rs2; /* -1 if any */
+    uint8_t id;
+} bitmanip_encodings[] = {
+    {0x33, 0x10, 2, -1, INSN_SH1ADD}, {0x33, 0x10, 4, -1, INSN_SH2ADD},
+    {0x33, 0x10, 6, -1, INSN_SH3ADD}, {0x33, 0x20, 7, -1, INSN_ANDN},
+    {0x33, 0x20, 6, -1, INSN_ORN},    {0x33, 0x20, 4, -1, INSN_XNOR},
+    {0x13, 0x30, 1, 0, INSN_CLZ},     {0x13, 0x30, 1, 1, INSN_CTZ},
+    {0x13, 0x30, 1, 2, INSN_CPOP},    {0x33, 0x05, 6, -1, INSN_MAX},
+    {0x33, 0x05, 7, -1, INSN_MAXU},   {0x33, 0x05, 4, -1, INSN_MIN},
+    {0x33, 0x05, 5, -1, INSN_MINU},   {0x13, 0x30, 1, 4, INSN_SEXT_B},
+    {0x13, 0x30, 1, 5, INSN_SEXT_H},  {0x33, 0x04, 4, 0, INSN_ZEXT_H},
+    {0x33, 0x30, 1, -1, INSN_ROL},    {0x33, 0x30, 5, -1, INSN_ROR},
+    {0x13, 0x30, 5, -1, INSN_RORI},   {0x13, 0x14, 5, 7, INSN_ORC_B},
+    {0x13, 0x34, 5, 0x18, INSN_REV8}, {0x33, 0x24, 1, -1, INSN_BCLR},
+    {0x13, 0x24, 1, -1, INSN_BCLRI},  {0x33, 0x24, 5, -1, INSN_BEXT},
+    {0x13, 0x24, 5, -1, INSN_BEXTI},  {0x33, 0x34, 1, -1, INSN_BINV},
+    {0x13, 0x34, 1, -1, INSN_BINVI},  {0x33, 0x14, 1, -1, INSN_BSET},
+    {0x13, 0x14, 1, -1, INSN_BSETI}};
+
+/* INSN_x of the Zba, Zbb or Zbs instruction 'insn', 0 if it isn't one or its
+ * extension is not in 'zext' */
+static int bitmanip_id(uint32_t insn, uint32_t zext)
+{
+    uint32_t opcode = insn & 0x7f, funct7 = insn >> 25;
+    uint32_t funct3 = (insn >> 12) & 7, rs2 = (insn >> 20) & 0x1f;
+
+    for (size_t i = 0;
+         i < sizeof(bitmanip_encodings) / sizeof(bitmanip_encodings[0]); i++) {
+        int id = bitmanip_encodings[i].id;
+        if (bitmanip_encodings[i].opcode != opcode ||
+            bitmanip_encodings[i].funct7 != funct7 ||
+            bitmanip_encodings[i].funct3 != funct3 ||
+            (bitmanip_encodings[i].rs2 >= 0 &&
+             (uint32_t) bitmanip_encodings[i].rs2 != rs2))
+            continue;
+        if (!(zext & (id <= INSN_SH3ADD ? ZEXT_ZBA
+                      : id <= INSN_REV8 ? ZEXT_ZBB
+                                        : ZEXT_ZBS)))
+            return 0;
+        return id;
+    }
+    return 0;
+}
+
+/* result of the bit manipulation instruction 'id' for the operands 'a' and
+ * 'b' (rs2 or the shift amount) */
+static inline uint32_t bitmanip_exec(int id, uint32_t a, uint32_t b)
+{
+    switch (id) {
+    case INSN_SH1ADD:
+        return (a << 1) + b;
+    case INSN_SH2ADD:
+        return (a << 2) + b;
+    case INSN_SH3ADD:
+        return (a << 3) + b;
+    case INSN_ANDN:
+        return a & ~b;
+    case INSN_ORN:
+        return a | ~b;
+    case INSN_XNOR:
+        return ~(a ^ b);
+    case INSN_CLZ:
+        return clz32(a);
+    case INSN_CTZ:
+        return ctz32(a);
+    case INSN_CPOP:
+        return popcount32(a);
+    case INSN_MAX:
+        return (int32_t) a > (int32_t) b ? a : b;
+    case INSN_MAXU:
+        return a > b ? a : b;
+    case INSN_MIN:
+        return (int32_t) a < (int32_t) b ? a : b;
+    case INSN_MINU:
+        return a < b ? a : b;
+    case INSN_SEXT_B:
+        return (int32_t)(int8_t) a;
+    case INSN_SEXT_H:
+        return (int32_t)(int16_t) a;
+    case INSN_ZEXT_H:
+        return (uint16_t) a;
+    case INSN_ROL:
+        return (a << (b & (XLEN - 1))) | (a >> (-b & (XLEN - 1)));
+    case INSN_ROR:
+    case INSN_RORI:
+        return (a >> (b & (XLEN - 1))) | (a << (-b & (XLEN - 1)));
+    case INSN_ORC_B:
+        /* 0x80 in each non-zero byte, spread to the whole byte */
+        a = (((a & 0x7f7f7f7f) + 0x7f7f7f7f) | a) & 0x80808080;
+        return (a >> 7) * 0xff;
+    case INSN_REV8:
+        return bswap32(a);
+    case INSN_BCLR:
+    case INSN_BCLRI:
+        return a & ~((uint32_t) 1 << (b & (XLEN - 1)));
+    case INSN_BEXT:
+    case INSN_BEXTI:
+        return (a >> (b & (XLEN - 1))) & 1;
+    case INSN_BINV:
+    case INSN_BINVI:
+        return a ^ ((uint32_t) 1 << (b & (XLEN - 1)));
+    case INSN_BSET:
+    case INSN_BSETI:
+        return a | ((uint32_t) 1 << (b & (XLEN - 1)));
+    }
+    return 0;
+}
+
+/* execute the bit manipulation instruction h->insn with the operands 'a'
+ * and 'b', returns -1 if it is not one of the extensions of the hart */
+static int bitmanip_insn(struct hart *h, uint32_t a, uint32_t b,
+                         uint32_t *pval)
+{
+    int id = bitmanip_id(h->insn, h->zext);
+
+    if (id == 0)
+        return -1;
+#ifdef DEBUG_EXTRA
+    debug_out(">>> %s\n", statnames[id]);
+    stats[id]++;
+#endif
+    *pval = bitmanip_exec(id, a, b);
+    return 0;
+}
+
+void execute_instruction(struct hart *h)
 {
     uint32_t opcode, rd, rs1, rs2, funct3;
     int32_t imm, cond, err;
     uint32_t addr, val = 0, val2;
 
-    opcode = insn & 0x7f;
-    rd = (insn >> 7) & 0x1f;
-    rs1 = (insn >> 15) & 0x1f;
-    rs2 = (insn >> 20) & 0x1f;
+    opcode = h->insn & 0x7f;
+    rd = (h->insn >> 7) & 0x1f;
+    rs1 = (h->insn >> 15) & 0x1f;
+    rs2 = (h->insn >> 20) & 0x1f;
 
     switch (opcode) {
     case 0x37: /* lui */
@@ -1269,7 +2642,7 @@ void execute_instruction()
         stats[0]++;
 #endif
         if (rd != 0)
-            reg[rd] = (int32_t)(insn & 0xfffff000);
+            h->reg[rd] = (int32_t)(h->insn & 0xfffff000);
         break;
 
     case 0x17: /* auipc */
@@ -1279,7 +2652,7 @@ void execute_instruction()
         stats[1]++;
 #endif
         if (rd != 0)
-            reg[rd] = (int32_t)(pc + (int32_t)(insn & 0xfffff000));
+            h->reg[rd] = (int32_t)(h->pc + (int32_t)(h->insn & 0xfffff000));
         break;
 
     case 0x6f: /* jal */
@@ -1288,17 +2661,18 @@ void execute_instruction()
         debug_out(">>> JAL\n");
         stats[2]++;
 #endif
-        imm = ((insn >> (31 - 20)) & (1 << 20)) | ((insn >> (21 - 1)) & 0x7fe) |
-              ((insn >> (20 - 11)) & (1 << 11)) | (insn & 0xff000);
+        imm = ((h->insn >> (31 - 20)) & (1 << 20)) |
+              ((h->insn >> (21 - 1)) & 0x7fe) |
+              ((h->insn >> (20 - 11)) & (1 << 11)) | (h->insn & 0xff000);
         imm = (imm << 11) >> 11;
         if (rd != 0)
-            reg[rd] = pc + 4;
-        next_pc = (int32_t)(pc + imm);
-        if (next_pc > pc)
-            forward_counter++;
+            h->reg[rd] = h->next_pc;
+        h->next_pc = (int32_t)(h->pc + imm);
+        if (h->next_pc > h->pc)
+            h->forward_counter++;
         else
-            backward_counter++;
-        jump_counter++;
+            h->backward_counter++;
+        h->jump_counter++;
         break;
 
     case 0x67: /* jalr */
@@ -1307,21 +2681,21 @@ void execute_instruction()
         debug_out(">>> JALR\n");
         stats[3]++;
 #endif
-        imm = (int32_t) insn >> 20;
-        val = pc + 4;
-        next_pc = (int32_t)(reg[rs1] + imm) & ~1;
+        imm = (int32_t) h->insn >> 20;
+        val = h->next_pc;
+        h->next_pc = (int32_t)(h->reg[rs1] + imm) & ~1;
         if (rd != 0)
-            reg[rd] = val;
-        if (next_pc > pc)
-            forward_counter++;
+            h->reg[rd] = val;
+        if (h->next_pc > h->pc)
+            h->forward_counter++;
         else
-            backward_counter++;
-        jump_counter++;
+            h->backward_counter++;
+        h->jump_counter++;
         break;
 
     case 0x63: /* BRANCH */
 
-        funct3 = (insn >> 12) & 7;
+        funct3 = (h->insn >> 12) & 7;
         switch (funct3 >> 1) {
         case 0: /* beq/bne */
 #ifdef DEBUG_EXTRA
@@ -1333,7 +2707,7 @@ void execute_instruction()
                 stats[5]++;
             }
 #endif
-            cond = (reg[rs1] == reg[rs2]);
+            cond = (h->reg[rs1] == h->reg[rs2]);
             break;
         case 2: /* blt/bge */
 #ifdef DEBUG_EXTRA
@@ -1345,7 +2719,7 @@ void execute_instruction()
                 stats[7]++;
             }
 #endif
-            cond = ((int32_t) reg[rs1] < (int32_t) reg[rs2]);
+            cond = ((int32_t) h->reg[rs1] < (int32_t) h->reg[rs2]);
             break;
         case 3: /* bltu/bgeu */
 #ifdef DEBUG_EXTRA
@@ -1357,35 +2731,36 @@ void execute_instruction()
                 stats[9]++;
             }
 #endif
-            cond = (reg[rs1] < reg[rs2]);
+            cond = (h->reg[rs1] < h->reg[rs2]);
             break;
         default:
-            raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+            raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
             return;
         }
         cond ^= (funct3 & 1);
         if (cond) {
-            imm = ((insn >> (31 - 12)) & (1 << 12)) |
-                  ((insn >> (25 - 5)) & 0x7e0) | ((insn >> (8 - 1)) & 0x1e) |
-                  ((insn << (11 - 7)) & (1 << 11));
+            imm = ((h->insn >> (31 - 12)) & (1 << 12)) |
+                  ((h->insn >> (25 - 5)) & 0x7e0) |
+                  ((h->insn >> (8 - 1)) & 0x1e) |
+                  ((h->insn << (11 - 7)) & (1 << 11));
             imm = (imm << 19) >> 19;
-            next_pc = (int32_t)(pc + imm);
-            if (next_pc > pc)
-                forward_counter++;
+            h->next_pc = (int32_t)(h->pc + imm);
+            if (h->next_pc > h->pc)
+                h->forward_counter++;
             else
-                backward_counter++;
-            jump_counter++;
-            true_counter++;
+                h->backward_counter++;
+            h->jump_counter++;
+            h->true_counter++;
             break;
         } else
-            false_counter++;
+            h->false_counter++;
         break;
 
     case 0x03: /* LOAD */
 
-        funct3 = (insn >> 12) & 7;
-        imm = (int32_t) insn >> 20;
-        addr = reg[rs1] + imm;
+        funct3 = (h->insn >> 12) & 7;
+        imm = (int32_t) h->insn >> 20;
+        addr = h->reg[rs1] + imm;
         switch (funct3) {
         case 0: /* lb */
         {
@@ -1394,8 +2769,8 @@ void execute_instruction()
             stats[10]++;
 #endif
             uint8_t rval;
-            if (target_read_u8(&rval, addr)) {
-                raise_exception(pending_exception, pending_tval);
+            if (target_read_u8(h, &rval, addr)) {
+                raise_exception(h, h->pending_exception, h->pending_tval);
                 return;
             }
             val = (int8_t) rval;
@@ -1408,8 +2783,8 @@ void execute_instruction()
             stats[11]++;
 #endif
             uint16_t rval;
-            if (target_read_u16(&rval, addr)) {
-                raise_exception(pending_exception, pending_tval);
+            if (target_read_u16(h, &rval, addr)) {
+                raise_exception(h, h->pending_exception, h->pending_tval);
                 return;
             }
             val = (int16_t) rval;
@@ -1422,8 +2797,8 @@ void execute_instruction()
             stats[12]++;
 #endif
             uint32_t rval;
-            if (target_read_u32(&rval, addr)) {
-                raise_exception(pending_exception, pending_tval);
+            if (target_read_u32(h, &rval, addr)) {
+                raise_exception(h, h->pending_exception, h->pending_tval);
                 return;
             }
             val = (int32_t) rval;
@@ -1436,8 +2811,8 @@ void execute_instruction()
             stats[13]++;
 #endif
             uint8_t rval;
-            if (target_read_u8(&rval, addr)) {
-                raise_exception(pending_exception, pending_tval);
+            if (target_read_u8(h, &rval, addr)) {
+                raise_exception(h, h->pending_exception, h->pending_tval);
                 return;
             }
             val = rval;
@@ -1450,36 +2825,36 @@ void execute_instruction()
             stats[14]++;
 #endif
             uint16_t rval;
-            if (target_read_u16(&rval, addr)) {
-                raise_exception(pending_exception, pending_tval);
+            if (target_read_u16(h, &rval, addr)) {
+                raise_exception(h, h->pending_exception, h->pending_tval);
                 return;
             }
             val = rval;
         } break;
 
         default:
-            raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+            raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
             return;
         }
         if (rd != 0)
-            reg[rd] = val;
+            h->reg[rd] = val;
         break;
 
     case 0x23: /* STORE */
 
-        funct3 = (insn >> 12) & 7;
-        imm = rd | ((insn >> (25 - 5)) & 0xfe0);
+        funct3 = (h->insn >> 12) & 7;
+        imm = rd | ((h->insn >> (25 - 5)) & 0xfe0);
         imm = (imm << 20) >> 20;
-        addr = reg[rs1] + imm;
-        val = reg[rs2];
+        addr = h->reg[rs1] + imm;
+        val = h->reg[rs2];
         switch (funct3) {
         case 0: /* sb */
 #ifdef DEBUG_EXTRA
             debug_out(">>> SB\n");
             stats[15]++;
 #endif
-            if (target_write_u8(addr, val)) {
-                raise_exception(pending_exception, pending_tval);
+            if (target_write_u8(h, addr, val)) {
+                raise_exception(h, h->pending_exception, h->pending_tval);
                 return;
             }
             break;
@@ -1489,8 +2864,8 @@ void execute_instruction()
             debug_out(">>> SH\n");
             stats[16]++;
 #endif
-            if (target_write_u16(addr, val)) {
-                raise_exception(pending_exception, pending_tval);
+            if (target_write_u16(h, addr, val)) {
+                raise_exception(h, h->pending_exception, h->pending_tval);
                 return;
             }
             break;
@@ -1500,22 +2875,22 @@ void execute_instruction()
             debug_out(">>> SW\n");
             stats[17]++;
 #endif
-            if (target_write_u32(addr, val)) {
-                raise_exception(pending_exception, pending_tval);
+            if (target_write_u32(h, addr, val)) {
+                raise_exception(h, h->pending_exception, h->pending_tval);
                 return;
             }
             break;
 
         default:
-            raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+            raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
             return;
         }
         break;
 
     case 0x13: /* OP-IMM */
 
-        funct3 = (insn >> 12) & 7;
-        imm = (int32_t) insn >> 20;
+        funct3 = (h->insn >> 12) & 7;
+        imm = (int32_t) h->insn >> 20;
         switch (funct3) {
         case 0: /* addi */
 #ifdef DEBUG_EXTRA
@@ -1524,57 +2899,63 @@ void execute_instruction()
             if (rs1 == 0)
                 stats[47]++; /* li */
 #endif
-            val = (int32_t)(reg[rs1] + imm);
+            val = (int32_t)(h->reg[rs1] + imm);
             break;
         case 1: /* slli */
+            if ((imm & ~(XLEN - 1)) != 0) {
+                if (bitmanip_insn(h, h->reg[rs1], imm & (XLEN - 1), &val)) {
+                    raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
+                    return;
+                }
+                break;
+            }
 #ifdef DEBUG_EXTRA
             debug_out(">>> SLLI\n");
             stats[24]++;
 #endif
-            if ((imm & ~(XLEN - 1)) != 0) {
-                raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
-                return;
-            }
-            val = (int32_t)(reg[rs1] << (imm & (XLEN - 1)));
+            val = (int32_t)(h->reg[rs1] << (imm & (XLEN - 1)));
             break;
         case 2: /* slti */
 #ifdef DEBUG_EXTRA
             debug_out(">>> SLTI\n");
             stats[19]++;
 #endif
-            val = (int32_t) reg[rs1] < (int32_t) imm;
+            val = (int32_t) h->reg[rs1] < (int32_t) imm;
             break;
         case 3: /* sltiu */
 #ifdef DEBUG_EXTRA
             debug_out(">>> SLTIU\n");
             stats[20]++;
 #endif
-            val = reg[rs1] < (uint32_t) imm;
+            val = h->reg[rs1] < (uint32_t) imm;
             break;
         case 4: /* xori */
 #ifdef DEBUG_EXTRA
             debug_out(">>> XORI\n");
             stats[21]++;
 #endif
-            val = reg[rs1] ^ imm;
+            val = h->reg[rs1] ^ imm;
             break;
         case 5: /* srli/srai */
             if ((imm & ~((XLEN - 1) | 0x400)) != 0) {
-                raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
-                return;
+                if (bitmanip_insn(h, h->reg[rs1], imm & (XLEN - 1), &val)) {
+                    raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
+                    return;
+                }
+                break;
             }
             if (imm & 0x400) {
 #ifdef DEBUG_EXTRA
                 debug_out(">>> SRAI\n");
                 stats[26]++;
 #endif
-                val = (int32_t) reg[rs1] >> (imm & (XLEN - 1));
+                val = (int32_t) h->reg[rs1] >> (imm & (XLEN - 1));
             } else {
 #ifdef DEBUG_EXTRA
                 debug_out(">>> SRLI\n");
                 stats[25]++;
 #endif
-                val = (int32_t)((uint32_t) reg[rs1] >> (imm & (XLEN - 1)));
+                val = (int32_t)((uint32_t) h->reg[rs1] >> (imm & (XLEN - 1)));
             }
             break;
         case 6: /* ori */
@@ -1582,28 +2963,27 @@ void execute_instruction()
             debug_out(">>> ORI\n");
             stats[22]++;
 #endif
-            val = reg[rs1] | imm;
+            val = h->reg[rs1] | imm;
             break;
         case 7: /* andi */
 #ifdef DEBUG_EXTRA
             debug_out(">>> ANDI\n");
             stats[23]++;
 #endif
-            val = reg[rs1] & imm;
+            val = h->reg[rs1] & imm;
             break;
         }
         if (rd != 0)
-            reg[rd] = val;
+            h->reg[rd] = val;
         break;
 
     case 0x33: /* OP */
 
-        imm = insn >> 25;
-        val = reg[rs1];
-        val2 = reg[rs2];
-#ifndef STRICT_RV32I
-        if (imm == 1) {
-            funct3 = (insn >> 12) & 7;
+        imm = h->insn >> 25;
+        val = h->reg[rs1];
+        val2 = h->reg[rs2];
+        if (imm == 1 && (h->misa & MCPUID_M)) {
+            funct3 = (h->insn >> 12) & 7;
             switch (funct3) {
             case 0: /* mul */
 #ifdef DEBUG_EXTRA
@@ -1662,17 +3042,14 @@ void execute_instruction()
                 val = (int32_t) remu32(val, val2);
                 break;
             default:
-                raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
-                return;
-            }
-        } else
-#endif
-        {
-            if (imm & ~0x20) {
-                raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+                raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                 return;
             }
-            funct3 = ((insn >> 12) & 7) | ((insn >> (30 - 3)) & (1 << 3));
+        } else {
+            funct3 = ((h->insn >> 12) & 7) | ((h->insn >> (30 - 3)) & (1 << 3));
+            /* not RV32I, see the default case */
+            if (imm & ~0x20)
+                funct3 = 16;
             switch (funct3) {
             case 0: /* add */
 #ifdef DEBUG_EXTRA
@@ -1745,27 +3122,30 @@ void execute_instruction()
                 val = val & val2;
                 break;
             default:
-                raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
-                return;
+                if (bitmanip_insn(h, val, val2, &val)) {
+                    raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
+                    return;
+                }
+                break;
             }
         }
         if (rd != 0)
-            reg[rd] = val;
+            h->reg[rd] = val;
         break;
 
     case 0x73: /* SYSTEM */
 
-        funct3 = (insn >> 12) & 7;
-        imm = insn >> 20;
+        funct3 = (h->insn >> 12) & 7;
+        imm = h->insn >> 20;
         if (funct3 & 4)
             val = rs1;
         else
-            val = reg[rs1];
+            val = h->reg[rs1];
         funct3 &= 3;
         switch (funct3) {
         case 1: /* csrrw & csrrwi */
 #ifdef DEBUG_EXTRA
-            if ((insn >> 12) & 4) {
+            if ((h->insn >> 12) & 4) {
                 debug_out(">>> CSRRWI\n");
                 stats[44]++;
             } else {
@@ -1773,18 +3153,18 @@ void execute_instruction()
                 stats[41]++;
             }
 #endif
-            if (csr_read(&val2, imm, TRUE)) {
-                raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+            if (csr_read(h, &val2, imm, TRUE)) {
+                raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                 return;
             }
             val2 = (int32_t) val2;
-            err = csr_write(imm, val);
+            err = csr_write(h, imm, val);
             if (err < 0) {
-                raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+                raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                 return;
             }
             if (rd != 0)
-                reg[rd] = val2;
+                h->reg[rd] = val2;
             if (err > 0) {
                 /* pc = pc + 4; */
             }
@@ -1792,13 +3172,13 @@ void execute_instruction()
 
         case 2: /* csrrs & csrrsi */
         case 3: /* csrrc & csrrci */
-            if (csr_read(&val2, imm, (rs1 != 0))) {
-                raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+            if (csr_read(h, &val2, imm, (rs1 != 0))) {
+                raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                 return;
             }
             val2 = (int32_t) val2;
 #ifdef DEBUG_EXTRA
-            switch ((insn >> 12) & 7) {
+            switch ((h->insn >> 12) & 7) {
             case 2:
                 debug_out(">>> CSRRS\n");
                 stats[42]++;
@@ -1823,16 +3203,16 @@ void execute_instruction()
                 } else {
                     val = val2 & ~val;
                 }
-                err = csr_write(imm, val);
+                err = csr_write(h, imm, val);
                 if (err < 0) {
-                    raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+                    raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                     return;
                 }
             } else {
                 err = 0;
             }
             if (rd != 0)
-                reg[rd] = val2;
+                h->reg[rd] = val2;
             break;
 
         case 0:
@@ -1842,8 +3222,8 @@ void execute_instruction()
                 debug_out(">>> ECALL\n");
                 stats[39]++;
 #endif
-                if (insn & 0x000fff80) {
-                    raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+                if (h->insn & 0x000fff80) {
+                    raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                     return;
                 }
                 /*
@@ -1851,20 +3231,21 @@ void execute_instruction()
                  * syscall, otherwise it is the program end, with the exit code
                  * in the bits 31:1
                  */
-                if (begin_signature) {
-                    if (reg[3] & 1) {
-                        debug_out("program end, result: %04x\n", reg[3] >> 1);
-                        machine_running = FALSE;
+                if (h->m->begin_signature) {
+                    if (h->reg[3] & 1) {
+                        debug_out("program end, result: %04x\n",
+                                  h->reg[3] >> 1);
+                        machine_stop(h->m, STOP_EXIT);
                         return;
 
                     } else {
-                        debug_out("syscall: %04x\n", reg[3]);
-                        raise_exception(CAUSE_USER_ECALL + priv, 0);
+                        debug_out("syscall: %04x\n", h->reg[3]);
+                        raise_exception(h, CAUSE_USER_ECALL + h->priv, 0);
                     }
                 } else {
                     /* on real hardware, an exception is raised, the I-ECALL-01
                      * compliance test tests this as well */
-                    raise_exception(CAUSE_USER_ECALL + priv, 0);
+                    raise_exception(h, CAUSE_USER_ECALL + h->priv, 0);
                     return;
                 }
                 break;
@@ -1874,11 +3255,11 @@ void execute_instruction()
                 debug_out(">>> EBREAK\n");
                 stats[40]++;
 #endif
-                if (insn & 0x000fff80) {
-                    raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+                if (h->insn & 0x000fff80) {
+                    raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                     return;
                 }
-                raise_exception(CAUSE_BREAKPOINT, 0);
+                raise_exception(h, CAUSE_BREAKPOINT, 0);
                 return;
 
             case 0x102: /* sret */
@@ -1887,11 +3268,11 @@ void execute_instruction()
                 debug_out(">>> SRET\n");
                 stats[59]++;
 #endif
-                if ((insn & 0x000fff80) || (priv < PRV_S)) {
-                    raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+                if ((h->insn & 0x000fff80) || (h->priv < PRV_S)) {
+                    raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                     return;
                 }
-                handle_sret();
+                handle_sret(h);
                 return;
             } break;
 
@@ -1909,11 +3290,11 @@ void execute_instruction()
                 debug_out(">>> MRET\n");
                 stats[60]++;
 #endif
-                if ((insn & 0x000fff80) || (priv < PRV_M)) {
-                    raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+                if ((h->insn & 0x000fff80) || (h->priv < PRV_M)) {
+                    raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                     return;
                 }
-                handle_mret();
+                handle_mret(h);
                 return;
             } break;
 
@@ -1924,12 +3305,15 @@ void execute_instruction()
                     stats[62]++;
 #endif
                     /* sfence.vma */
-                    if ((insn & 0x00007f80) || (priv == PRV_U)) {
-                        raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+                    if ((h->insn & 0x00007f80) || (h->priv == PRV_U)) {
+                        raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                         return;
                     }
+                    /* the page tables may have changed */
+                    tlb_flush(h);
+                    block_cache_flush(h);
                 } else {
-                    raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+                    raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                     return;
                 }
                 break;
@@ -1937,24 +3321,26 @@ void execute_instruction()
             break;
 
         default:
-            raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+            raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
             return;
         }
         break;
 
     case 0x0f: /* MISC-MEM */
 
-        funct3 = (insn >> 12) & 7;
+        funct3 = (h->insn >> 12) & 7;
         switch (funct3) {
         case 0: /* fence */
 #ifdef DEBUG_EXTRA
             debug_out(">>> FENCE\n");
             stats[37]++;
 #endif
-            if (insn & 0xf00fff80) {
-                raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+            if (h->insn & 0xf00fff80) {
+                raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                 return;
             }
+            /* order the memory accesses seen by the other harts */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
             break;
 
         case 1: /* fence.i */
@@ -1962,29 +3348,33 @@ void execute_instruction()
             debug_out(">>> FENCE.I\n");
             stats[38]++;
 #endif
-            if (insn != 0x0000100f) {
-                raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+            if (h->insn != 0x0000100f) {
+                raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                 return;
             }
+            /* the instruction stream may have been modified */
+            block_cache_flush(h);
             break;
 
         default:
-            raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+            raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
             return;
         }
         break;
 
-#ifndef STRICT_RV32I
-
     case 0x2f: /* AMO */
 
-        funct3 = (insn >> 12) & 7;
+        if (!(h->misa & MCPUID_A)) {
+            raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
+            return;
+        }
+        funct3 = (h->insn >> 12) & 7;
         switch (funct3) {
         case 2: {
             uint32_t rval;
 
-            addr = reg[rs1];
-            funct3 = insn >> 27;
+            addr = h->reg[rs1];
+            funct3 = h->insn >> 27;
             switch (funct3) {
             case 2: /* lr.w */
 #ifdef DEBUG_EXTRA
@@ -1992,15 +3382,14 @@ void execute_instruction()
                 stats[56]++;
 #endif
                 if (rs2 != 0) {
-                    raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+                    raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                     return;
                 }
-                if (target_read_u32(&rval, addr)) {
-                    raise_exception(pending_exception, pending_tval);
+                if (atomic_lr(h, addr, &rval)) {
+                    raise_exception(h, h->pending_exception, h->pending_tval);
                     return;
                 }
                 val = (int32_t) rval;
-                load_res = addr;
                 break;
 
             case 3: /* sc.w */
@@ -2008,15 +3397,11 @@ void execute_instruction()
                 debug_out(">>> SC.W\n");
                 stats[57]++;
 #endif
-                if (load_res == addr) {
-                    if (target_write_u32(addr, reg[rs2])) {
-                        raise_exception(pending_exception, pending_tval);
-                        return;
-                    }
-                    val = 0;
-                } else {
-                    val = 1;
+                if (atomic_sc(h, addr, h->reg[rs2], &rval)) {
+                    raise_exception(h, h->pending_exception, h->pending_tval);
+                    return;
                 }
+                val = (int32_t) rval;
                 break;
 
             case 1:    /* amiswap.w */
@@ -2033,69 +3418,1534 @@ void execute_instruction()
                 debug_out(">>> AM...\n");
                 stats[63]++;
 #endif
-                if (target_read_u32(&rval, addr)) {
-                    raise_exception(pending_exception, pending_tval);
+                if (atomic_rmw(h, addr, funct3, h->reg[rs2], &rval)) {
+                    raise_exception(h, h->pending_exception, h->pending_tval);
                     return;
                 }
                 val = (int32_t) rval;
-                val2 = reg[rs2];
-                switch (funct3) {
-                case 1: /* amiswap.w */
-                    break;
-                case 0: /* amoadd.w */
-                    val2 = (int32_t)(val + val2);
-                    break;
-                case 4: /* amoxor.w */
-                    val2 = (int32_t)(val ^ val2);
-                    break;
-                case 0xc: /* amoand.w */
-                    val2 = (int32_t)(val & val2);
-                    break;
-                case 0x8: /* amoor.w */
-                    val2 = (int32_t)(val | val2);
-                    break;
-                case 0x10: /* amomin.w */
-                    if ((int32_t) val < (int32_t) val2)
-                        val2 = (int32_t) val;
-                    break;
-                case 0x14: /* amomax.w */
-                    if ((int32_t) val > (int32_t) val2)
-                        val2 = (int32_t) val;
-                    break;
-                case 0x18: /* amominu.w */
-                    if ((uint32_t) val < (uint32_t) val2)
-                        val2 = (int32_t) val;
-                    break;
-                case 0x1c: /* amomaxu.w */
-                    if ((uint32_t) val > (uint32_t) val2)
-                        val2 = (int32_t) val;
-                    break;
-                default:
-                    raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
-                    return;
-                }
-                if (target_write_u32(addr, val2)) {
-                    raise_exception(pending_exception, pending_tval);
-                    return;
-                }
                 break;
             default:
-                raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+                raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
                 return;
             }
         } break;
         default:
-            raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+            raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
             return;
         }
         if (rd != 0)
-            reg[rd] = val;
+            h->reg[rd] = val;
         break;
 
+    default:
+        raise_exception(h, CAUSE_ILLEGAL_INSTRUCTION, h->insn);
+        return;
+    }
+}
+
+static int exec_nop(struct hart *h, const struct decoded_insn *d)
+{
+    (void) h, (void) d;
+    return 0;
+}
+
+static int exec_lui(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = d->imm;
+    return 0;
+}
+
+static int exec_auipc(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = d->pc + d->imm;
+    return 0;
+}
+
+/* jump to next_pc, a misaligned target raises the exception on the jump */
+static inline int jump(struct hart *h, const struct decoded_insn *d)
+{
+    if (h->next_pc > d->pc)
+        h->forward_counter++;
+    else
+        h->backward_counter++;
+    h->jump_counter++;
+    if (h->next_pc & pc_align_mask(h)) {
+        h->pc = d->pc;
+        raise_exception(h, CAUSE_MISALIGNED_FETCH, h->next_pc);
+        return 1;
+    }
+    return 0;
+}
+
+static int exec_jal(struct hart *h, const struct decoded_insn *d)
+{
+    if (d->rd != 0)
+        h->reg[d->rd] = d->pc + d->len;
+    h->next_pc = d->pc + d->imm;
+    return jump(h, d);
+}
+
+static int exec_jalr(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t val = d->pc + d->len;
+    h->next_pc = (h->reg[d->rs1] + d->imm) & ~1;
+    if (d->rd != 0)
+        h->reg[d->rd] = val;
+    return jump(h, d);
+}
+
+static inline int branch(struct hart *h, const struct decoded_insn *d, int cond)
+{
+    if (cond) {
+        h->true_counter++;
+        h->next_pc = d->pc + d->imm;
+        return jump(h, d);
+    }
+    h->false_counter++;
+    return 0;
+}
+
+static int exec_beq(struct hart *h, const struct decoded_insn *d)
+{
+    return branch(h, d, h->reg[d->rs1] == h->reg[d->rs2]);
+}
+
+static int exec_bne(struct hart *h, const struct decoded_insn *d)
+{
+    return branch(h, d, h->reg[d->rs1] != h->reg[d->rs2]);
+}
+
+static int exec_blt(struct hart *h, const struct decoded_insn *d)
+{
+    return branch(h, d, (int32_t) h->reg[d->rs1] < (int32_t) h->reg[d->rs2]);
+}
+
+static int exec_bge(struct hart *h, const struct decoded_insn *d)
+{
+    return branch(h, d, (int32_t) h->reg[d->rs1] >= (int32_t) h->reg[d->rs2]);
+}
+
+static int exec_bltu(struct hart *h, const struct decoded_insn *d)
+{
+    return branch(h, d, h->reg[d->rs1] < h->reg[d->rs2]);
+}
+
+static int exec_bgeu(struct hart *h, const struct decoded_insn *d)
+{
+    return branch(h, d, h->reg[d->rs1] >= h->reg[d->rs2]);
+}
+
+/* In the guard page mode (see machine_map_guest()) aligned loads and stores
+ * access the host mapping of the guest address space directly. Everything
+ * but RAM faults and is redone by guard_fault() with target_read_x() and
+ * target_write_x(). */
+static inline uint8_t *guest_ptr(struct hart *h, const struct decoded_insn *d,
+                                 uint32_t addr)
+{
+    h->mem_insn = d;
+    /* seen by guard_signal() if the access faults */
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    return h->guest_base + addr;
+}
+
+static inline void guest_dirty(struct hart *h, uint32_t addr)
+{
+    ram_written(h, addr - h->m->ram_start);
+}
+
+/* address of the load 'd', which may read mtime (see insn_retired()) */
+static inline uint32_t load_addr(struct hart *h, const struct decoded_insn *d)
+{
+    h->mem_insn = d;
+    return h->reg[d->rs1] + d->imm;
+}
+
+static int exec_lb(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t addr = load_addr(h, d);
+    uint8_t rval;
+
+    if (h->guest_base) {
+        rval = *guest_ptr(h, d, addr);
+    } else if (target_read_u8(h, &rval, addr)) {
+        h->pc = d->pc;
+        raise_exception(h, h->pending_exception, h->pending_tval);
+        return 1;
+    }
+    if (d->rd != 0)
+        h->reg[d->rd] = (int8_t) rval;
+    return 0;
+}
+
+static int exec_lh(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t addr = load_addr(h, d);
+    uint16_t rval;
+
+    if (h->guest_base && !(addr & 1)) {
+        rval = ram_read_u16(guest_ptr(h, d, addr));
+    } else if (target_read_u16(h, &rval, addr)) {
+        h->pc = d->pc;
+        raise_exception(h, h->pending_exception, h->pending_tval);
+        return 1;
+    }
+    if (d->rd != 0)
+        h->reg[d->rd] = (int16_t) rval;
+    return 0;
+}
+
+static int exec_lw(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t addr = load_addr(h, d);
+    uint32_t rval;
+
+    if (h->guest_base && !(addr & 3)) {
+        rval = ram_read_u32(guest_ptr(h, d, addr));
+    } else if (target_read_u32(h, &rval, addr)) {
+        h->pc = d->pc;
+        raise_exception(h, h->pending_exception, h->pending_tval);
+        return 1;
+    }
+    if (d->rd != 0)
+        h->reg[d->rd] = rval;
+    return 0;
+}
+
+static int exec_lbu(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t addr = load_addr(h, d);
+    uint8_t rval;
+
+    if (h->guest_base) {
+        rval = *guest_ptr(h, d, addr);
+    } else if (target_read_u8(h, &rval, addr)) {
+        h->pc = d->pc;
+        raise_exception(h, h->pending_exception, h->pending_tval);
+        return 1;
+    }
+    if (d->rd != 0)
+        h->reg[d->rd] = rval;
+    return 0;
+}
+
+static int exec_lhu(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t addr = load_addr(h, d);
+    uint16_t rval;
+
+    if (h->guest_base && !(addr & 1)) {
+        rval = ram_read_u16(guest_ptr(h, d, addr));
+    } else if (target_read_u16(h, &rval, addr)) {
+        h->pc = d->pc;
+        raise_exception(h, h->pending_exception, h->pending_tval);
+        return 1;
+    }
+    if (d->rd != 0)
+        h->reg[d->rd] = rval;
+    return 0;
+}
+
+static int exec_sb(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t addr = h->reg[d->rs1] + d->imm;
+
+    if (h->guest_base) {
+        *guest_ptr(h, d, addr) = h->reg[d->rs2];
+        guest_dirty(h, addr);
+    } else if (target_write_u8(h, addr, h->reg[d->rs2])) {
+        h->pc = d->pc;
+        raise_exception(h, h->pending_exception, h->pending_tval);
+        return 1;
+    }
+    return 0;
+}
+
+static int exec_sh(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t addr = h->reg[d->rs1] + d->imm;
+
+    if (h->guest_base && !(addr & 1)) {
+        ram_write_u16(guest_ptr(h, d, addr), h->reg[d->rs2]);
+        guest_dirty(h, addr);
+    } else if (target_write_u16(h, addr, h->reg[d->rs2])) {
+        h->pc = d->pc;
+        raise_exception(h, h->pending_exception, h->pending_tval);
+        return 1;
+    }
+    return 0;
+}
+
+static int exec_sw(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t addr = h->reg[d->rs1] + d->imm;
+
+    if (h->guest_base && !(addr & 3)) {
+        ram_write_u32(guest_ptr(h, d, addr), h->reg[d->rs2]);
+        guest_dirty(h, addr);
+    } else if (target_write_u32(h, addr, h->reg[d->rs2])) {
+        h->pc = d->pc;
+        raise_exception(h, h->pending_exception, h->pending_tval);
+        return 1;
+    }
+    return 0;
+}
+
+/* for the ALU operations rd != 0 is ensured by decode_insn() */
+
+static int exec_addi(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] + d->imm;
+    return 0;
+}
+
+static int exec_slti(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = (int32_t) h->reg[d->rs1] < d->imm;
+    return 0;
+}
+
+static int exec_sltiu(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] < (uint32_t) d->imm;
+    return 0;
+}
+
+static int exec_xori(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] ^ d->imm;
+    return 0;
+}
+
+static int exec_ori(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] | d->imm;
+    return 0;
+}
+
+static int exec_andi(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] & d->imm;
+    return 0;
+}
+
+static int exec_slli(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] << d->imm;
+    return 0;
+}
+
+static int exec_srli(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] >> d->imm;
+    return 0;
+}
+
+static int exec_srai(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = (int32_t) h->reg[d->rs1] >> d->imm;
+    return 0;
+}
+
+static int exec_add(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] + h->reg[d->rs2];
+    return 0;
+}
+
+static int exec_sub(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] - h->reg[d->rs2];
+    return 0;
+}
+
+static int exec_sll(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] << (h->reg[d->rs2] & (XLEN - 1));
+    return 0;
+}
+
+static int exec_slt(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = (int32_t) h->reg[d->rs1] < (int32_t) h->reg[d->rs2];
+    return 0;
+}
+
+static int exec_sltu(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] < h->reg[d->rs2];
+    return 0;
+}
+
+static int exec_xor(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] ^ h->reg[d->rs2];
+    return 0;
+}
+
+static int exec_srl(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] >> (h->reg[d->rs2] & (XLEN - 1));
+    return 0;
+}
+
+static int exec_sra(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = (int32_t) h->reg[d->rs1] >> (h->reg[d->rs2] & (XLEN - 1));
+    return 0;
+}
+
+static int exec_or(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] | h->reg[d->rs2];
+    return 0;
+}
+
+static int exec_and(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = h->reg[d->rs1] & h->reg[d->rs2];
+    return 0;
+}
+
+static int exec_mul(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = (int32_t) h->reg[d->rs1] * (int32_t) h->reg[d->rs2];
+    return 0;
+}
+
+static int exec_mulh(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = mulh32(h->reg[d->rs1], h->reg[d->rs2]);
+    return 0;
+}
+
+static int exec_mulhsu(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = mulhsu32(h->reg[d->rs1], h->reg[d->rs2]);
+    return 0;
+}
+
+static int exec_mulhu(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = mulhu32(h->reg[d->rs1], h->reg[d->rs2]);
+    return 0;
+}
+
+/* the MULH[[S]U] 'd' and the MUL after it, whose low half goes to the rd of
+ * d[1], from one multiply */
+static int exec_mulh_mul(struct hart *h, const struct decoded_insn *d)
+{
+    int64_t p = (int64_t)(int32_t) h->reg[d->rs1] * (int32_t) h->reg[d->rs2];
+    h->reg[d->rd] = p >> 32;
+    h->reg[d[1].rd] = p;
+    return 0;
+}
+
+static int exec_mulhsu_mul(struct hart *h, const struct decoded_insn *d)
+{
+    int64_t p = (int64_t)(int32_t) h->reg[d->rs1] * h->reg[d->rs2];
+    h->reg[d->rd] = p >> 32;
+    h->reg[d[1].rd] = p;
+    return 0;
+}
+
+static int exec_mulhu_mul(struct hart *h, const struct decoded_insn *d)
+{
+    uint64_t p = (uint64_t) h->reg[d->rs1] * h->reg[d->rs2];
+    h->reg[d->rd] = p >> 32;
+    h->reg[d[1].rd] = p;
+    return 0;
+}
+
+static int exec_div(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = div32(h->reg[d->rs1], h->reg[d->rs2]);
+    return 0;
+}
+
+static int exec_divu(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = divu32(h->reg[d->rs1], h->reg[d->rs2]);
+    return 0;
+}
+
+static int exec_rem(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = rem32(h->reg[d->rs1], h->reg[d->rs2]);
+    return 0;
+}
+
+static int exec_remu(struct hart *h, const struct decoded_insn *d)
+{
+    h->reg[d->rd] = remu32(h->reg[d->rs1], h->reg[d->rs2]);
+    return 0;
+}
+
+/* Zba, Zbb and Zbs, the second operand of the immediate and unary forms is
+ * the shift amount in imm */
+#define BITMANIP_HANDLER(name, id, src2)                                   \
+    static int exec_##name(struct hart *h, const struct decoded_insn *d) \
+    {                                                                      \
+        h->reg[d->rd] = bitmanip_exec(id, h->reg[d->rs1], src2);           \
+        return 0;                                                          \
+    }
+
+BITMANIP_HANDLER(sh1add, INSN_SH1ADD, h->reg[d->rs2])
+BITMANIP_HANDLER(sh2add, INSN_SH2ADD, h->reg[d->rs2])
+BITMANIP_HANDLER(sh3add, INSN_SH3ADD, h->reg[d->rs2])
+BITMANIP_HANDLER(andn, INSN_ANDN, h->reg[d->rs2])
+BITMANIP_HANDLER(orn, INSN_ORN, h->reg[d->rs2])
+BITMANIP_HANDLER(xnor, INSN_XNOR, h->reg[d->rs2])
+BITMANIP_HANDLER(clz, INSN_CLZ, d->imm)
+BITMANIP_HANDLER(ctz, INSN_CTZ, d->imm)
+BITMANIP_HANDLER(cpop, INSN_CPOP, d->imm)
+BITMANIP_HANDLER(max, INSN_MAX, h->reg[d->rs2])
+BITMANIP_HANDLER(maxu, INSN_MAXU, h->reg[d->rs2])
+BITMANIP_HANDLER(min, INSN_MIN, h->reg[d->rs2])
+BITMANIP_HANDLER(minu, INSN_MINU, h->reg[d->rs2])
+BITMANIP_HANDLER(sext_b, INSN_SEXT_B, d->imm)
+BITMANIP_HANDLER(sext_h, INSN_SEXT_H, d->imm)
+BITMANIP_HANDLER(zext_h, INSN_ZEXT_H, d->imm)
+BITMANIP_HANDLER(rol, INSN_ROL, h->reg[d->rs2])
+BITMANIP_HANDLER(ror, INSN_ROR, h->reg[d->rs2])
+BITMANIP_HANDLER(rori, INSN_RORI, d->imm)
+BITMANIP_HANDLER(orc_b, INSN_ORC_B, d->imm)
+BITMANIP_HANDLER(rev8, INSN_REV8, d->imm)
+BITMANIP_HANDLER(bclr, INSN_BCLR, h->reg[d->rs2])
+BITMANIP_HANDLER(bclri, INSN_BCLRI, d->imm)
+BITMANIP_HANDLER(bext, INSN_BEXT, h->reg[d->rs2])
+BITMANIP_HANDLER(bexti, INSN_BEXTI, d->imm)
+BITMANIP_HANDLER(binv, INSN_BINV, h->reg[d->rs2])
+BITMANIP_HANDLER(binvi, INSN_BINVI, d->imm)
+BITMANIP_HANDLER(bset, INSN_BSET, h->reg[d->rs2])
+BITMANIP_HANDLER(bseti, INSN_BSETI, d->imm)
+
+#undef BITMANIP_HANDLER
+
+static int exec_lr_w(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t rval;
+    if (atomic_lr(h, h->reg[d->rs1], &rval)) {
+        h->pc = d->pc;
+        raise_exception(h, h->pending_exception, h->pending_tval);
+        return 1;
+    }
+    if (d->rd != 0)
+        h->reg[d->rd] = rval;
+    return 0;
+}
+
+static int exec_sc_w(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t val;
+    if (atomic_sc(h, h->reg[d->rs1], h->reg[d->rs2], &val)) {
+        h->pc = d->pc;
+        raise_exception(h, h->pending_exception, h->pending_tval);
+        return 1;
+    }
+    if (d->rd != 0)
+        h->reg[d->rd] = val;
+    return 0;
+}
+
+/* read-modify-write of the word at reg[rs1], rd gets the old value */
+static inline int amo(struct hart *h, const struct decoded_insn *d)
+{
+    uint32_t val;
+    if (atomic_rmw(h, h->reg[d->rs1], d->insn >> 27, h->reg[d->rs2], &val)) {
+        h->pc = d->pc;
+        raise_exception(h, h->pending_exception, h->pending_tval);
+        return 1;
+    }
+    if (d->rd != 0)
+        h->reg[d->rd] = val;
+    return 0;
+}
+
+static int exec_amo(struct hart *h, const struct decoded_insn *d)
+{
+    return amo(h, d);
+}
+
+/* SYSTEM, MISC-MEM and illegal encodings, these end the block */
+static int exec_fallback(struct hart *h, const struct decoded_insn *d)
+{
+    h->pc = d->pc;
+    h->next_pc = h->pc + d->len;
+    h->insn = d->insn;
+    execute_instruction(h);
+    return 1;
+}
+
+/* only the value of rd is changed, a write to x0 can be dropped */
+static inline int writes_rd_only(int id)
+{
+    return id <= INSN_AUIPC || (id >= INSN_ADDI && id <= INSN_AND) ||
+           (id >= INSN_MUL && id <= INSN_REMU) ||
+           (id >= INSN_SH1ADD && id <= INSN_BSETI);
+}
+
+/* decode 'insn' of 'len' bytes at 'pc' into 'd' for a hart with the
+ * extensions 'misa' and 'zext'. SYSTEM and MISC-MEM instructions and those of
+ * disabled extensions are left to execute_instruction(). */
+void decode_insn(struct decoded_insn *d, uint32_t pc, uint32_t insn,
+                 uint32_t len, uint32_t misa, uint32_t zext)
+{
+    static int (*const branch_handler[8])(
+        struct hart *, const struct decoded_insn *) = {
+        exec_beq, exec_bne, NULL, NULL, exec_blt, exec_bge, exec_bltu,
+        exec_bgeu};
+    static int (*const load_handler[8])(
+        struct hart *, const struct decoded_insn *) = {
+        exec_lb, exec_lh, exec_lw, NULL, exec_lbu, exec_lhu, NULL, NULL};
+    static int (*const store_handler[8])(
+        struct hart *, const struct decoded_insn *) = {
+        exec_sb, exec_sh, exec_sw, NULL, NULL, NULL, NULL, NULL};
+    static int (*const op_imm_handler[8])(
+        struct hart *, const struct decoded_insn *) = {
+        exec_addi, exec_slli, exec_slti, exec_sltiu,
+        exec_xori, exec_srli, exec_ori,  exec_andi};
+    static int (*const op_handler[16])(
+        struct hart *, const struct decoded_insn *) = {
+        exec_add, exec_sll, exec_slt, exec_sltu, exec_xor, exec_srl,
+        exec_or,  exec_and, exec_sub, NULL,      NULL,     NULL,
+        NULL,     exec_sra, NULL,     NULL};
+    static const uint8_t op_imm_id[8] = {INSN_ADDI, INSN_SLLI, INSN_SLTI,
+                                         INSN_SLTIU, INSN_XORI, INSN_SRLI,
+                                         INSN_ORI,  INSN_ANDI};
+    static const uint8_t op_id[16] = {
+        INSN_ADD, INSN_SLL, INSN_SLT, INSN_SLTU, INSN_XOR, INSN_SRL,
+        INSN_OR,  INSN_AND, INSN_SUB, 0,         0,        0,
+        0,        INSN_SRA, 0,        0};
+    static int (*const m_handler[8])(
+        struct hart *, const struct decoded_insn *) = {
+        exec_mul, exec_mulh, exec_mulhsu, exec_mulhu,
+        exec_div, exec_divu, exec_rem,    exec_remu};
+    static int (*const bitmanip_handler[INSN_BSETI - INSN_SH1ADD + 1])(
+        struct hart *, const struct decoded_insn *) = {
+        exec_sh1add, exec_sh2add, exec_sh3add, exec_andn, exec_orn, exec_xnor,
+        exec_clz, exec_ctz, exec_cpop, exec_max, exec_maxu, exec_min, exec_minu,
+        exec_sext_b, exec_sext_h, exec_zext_h, exec_rol, exec_ror, exec_rori,
+        exec_orc_b, exec_rev8, exec_bclr, exec_bclri, exec_bext, exec_bexti,
+        exec_binv, exec_binvi, exec_bset, exec_bseti};
+    /* funct5 of the AMOs in INSN_AMOSWAP_W order */
+    static const uint8_t amo_funct5[9] = {1,    0,    4,    0xc, 0x8,
+                                          0x10, 0x14, 0x18, 0x1c};
+    uint32_t funct3 = (insn >> 12) & 7;
+    uint32_t funct7 = insn >> 25;
+
+    d->pc = pc;
+    d->insn = insn;
+    d->len = len;
+    d->rd = (insn >> 7) & 0x1f;
+    d->rs1 = (insn >> 15) & 0x1f;
+    d->rs2 = (insn >> 20) & 0x1f;
+    d->imm = (int32_t) insn >> 20;
+    d->handler = NULL;
+
+    switch (insn & 0x7f) {
+    case 0x37: /* lui */
+    case 0x17: /* auipc */
+        d->id = (insn & 0x7f) == 0x37 ? INSN_LUI : INSN_AUIPC;
+        d->handler = d->id == INSN_LUI ? exec_lui : exec_auipc;
+        d->imm = (int32_t)(insn & 0xfffff000);
+        break;
+
+    case 0x6f: /* jal */
+        d->id = INSN_JAL;
+        d->handler = exec_jal;
+        d->imm = ((insn >> (31 - 20)) & (1 << 20)) |
+                 ((insn >> (21 - 1)) & 0x7fe) |
+                 ((insn >> (20 - 11)) & (1 << 11)) | (insn & 0xff000);
+        d->imm = (d->imm << 11) >> 11;
+        break;
+
+    case 0x67: /* jalr */
+        d->id = INSN_JALR;
+        d->handler = exec_jalr;
+        break;
+
+    case 0x63: /* BRANCH */
+        d->id = INSN_BEQ + funct3 - (funct3 >= 4 ? 2 : 0);
+        d->handler = branch_handler[funct3];
+        d->imm = ((insn >> (31 - 12)) & (1 << 12)) |
+                 ((insn >> (25 - 5)) & 0x7e0) | ((insn >> (8 - 1)) & 0x1e) |
+                 ((insn << (11 - 7)) & (1 << 11));
+        d->imm = (d->imm << 19) >> 19;
+        break;
+
+    case 0x03: /* LOAD */
+        d->id = INSN_LB + funct3 - (funct3 >= 4 ? 1 : 0);
+        d->handler = load_handler[funct3];
+        break;
+
+    case 0x23: /* STORE */
+        d->id = INSN_SB + funct3;
+        d->handler = store_handler[funct3];
+        d->imm = d->rd | ((insn >> (25 - 5)) & 0xfe0);
+        d->imm = (d->imm << 20) >> 20;
+        break;
+
+    case 0x13: /* OP-IMM */
+        d->id = op_imm_id[funct3];
+        d->handler = op_imm_handler[funct3];
+        if (funct3 == 1) {
+            if (d->imm & ~(XLEN - 1))
+                d->handler = NULL;
+        } else if (funct3 == 5) {
+            if (d->imm & ~((XLEN - 1) | 0x400)) {
+                d->handler = NULL;
+            } else if (d->imm & 0x400) {
+                d->id = INSN_SRAI;
+                d->handler = exec_srai;
+            }
+            d->imm &= XLEN - 1;
+        }
+        break;
+
+    case 0x33: /* OP */
+        if (funct7 == 1 && (misa & MCPUID_M)) {
+            d->id = INSN_MUL + funct3;
+            d->handler = m_handler[funct3];
+            break;
+        }
+        if (funct7 & ~0x20)
+            break;
+        funct3 |= (funct7 >> 2) & 8;
+        d->id = op_id[funct3];
+        d->handler = op_handler[funct3];
+        break;
+
+    case 0x2f: /* AMO */
+        if (funct3 != 2 || !(misa & MCPUID_A))
+            break;
+        switch (insn >> 27) {
+        case 2: /* lr.w */
+            if (d->rs2 == 0) {
+                d->id = INSN_LR_W;
+                d->handler = exec_lr_w;
+            }
+            break;
+        case 3: /* sc.w */
+            d->id = INSN_SC_W;
+            d->handler = exec_sc_w;
+            break;
+        default:
+            for (int i = 0; i < 9; i++) {
+                if (amo_funct5[i] == (insn >> 27)) {
+                    d->id = INSN_AMOSWAP_W + i;
+                    d->handler = exec_amo;
+                }
+            }
+            break;
+        }
+        break;
+    }
+
+    /* Zba, Zbb and Zbs use OP and OP-IMM encodings the base ISA leaves out */
+    if (d->handler == NULL) {
+        int id = bitmanip_id(insn, zext);
+        if (id) {
+            d->id = id;
+            d->handler = bitmanip_handler[id - INSN_SH1ADD];
+            d->imm = d->rs2;
+        }
+    }
+
+    d->op = d->id;
+    if (d->handler == NULL) {
+        d->id = d->op = INSN_FALLBACK;
+        d->handler = exec_fallback;
+    } else if (d->rd == 0 && writes_rd_only(d->id)) {
+        /* writes to x0 are discarded */
+        d->op = INSN_NOP;
+        d->handler = exec_nop;
+    }
+}
+
+/* fuse 'd', a MUL, into the MULH[[S]U] 'prev' before it when both multiply
+ * the same registers, as in the recommended sequence
+ *     mulh[[s]u] rdh, rs1, rs2
+ *     mul rdl, rs1, rs2
+ * with rdh not one of the sources. The MUL stays in the block as a NOP, so
+ * the instruction count doesn't change. */
+static void mul_fuse(struct decoded_insn *prev, struct decoded_insn *d)
+{
+    static int (*const fused_handler[3])(
+        struct hart *, const struct decoded_insn *) = {
+        exec_mulh_mul, exec_mulhsu_mul, exec_mulhu_mul};
+
+    if (d->op != INSN_MUL || prev->op < INSN_MULH || prev->op > INSN_MULHU ||
+        prev->rs1 != d->rs1 || prev->rs2 != d->rs2 || prev->rd == d->rs1 ||
+        prev->rd == d->rs2)
+        return;
+    prev->op = INSN_MULH_MUL + prev->op - INSN_MULH;
+    prev->handler = fused_handler[prev->id - INSN_MULH];
+    d->op = INSN_NOP;
+    d->handler = exec_nop;
+}
+
+#ifdef DEBUG_EXTRA
+/* statistics for instructions not counted by execute_instruction() */
+static inline void count_insn(const struct decoded_insn *d)
+{
+    if (d->id == INSN_FALLBACK)
+        return;
+    if (d->id >= INSN_AMOSWAP_W) {
+        debug_out(">>> AM...\n");
+        stats[INSN_AMO]++;
+        return;
+    }
+    debug_out(">>> %s\n", statnames[d->id]);
+    stats[d->id]++;
+    if (d->id == INSN_ADDI && d->rs1 == 0)
+        stats[INSN_LI]++;
+}
 #endif
 
-    default:
-        raise_exception(CAUSE_ILLEGAL_INSTRUCTION, insn);
+/* privilege level blocks are decoded for: fetches from S and U-mode only
+ * differ from M-mode ones when they are translated or checked by the PMP */
+static inline uint32_t block_priv(const struct hart *h)
+{
+    return (h->satp & SATP_MODE) || h->pmp_active ? h->priv : PRV_M;
+}
+
+static inline int block_end(const struct decoded_insn *d)
+{
+    return (d->id >= INSN_JAL && d->id <= INSN_BGEU) || d->id == INSN_FALLBACK;
+}
+
+/* remember the RAM word holding code at the physical address 'paddr', see
+ * code_write() */
+static inline void code_mark(struct hart *h, uint32_t paddr)
+{
+    uint32_t offset = paddr - h->m->ram_start;
+
+    if (offset < h->m->ram_size) {
+        h->m->code_pages[offset >> RAM_PAGE_BITS] = 1;
+        __atomic_or_fetch(&h->m->code_words[offset >> 5],
+                          1 << ((offset >> 2) & 7), __ATOMIC_RELAXED);
+    }
+}
+
+/* decode the block starting at 'pc', returns NULL with pending_exception
+ * set if its first instruction can't be fetched. A block ends before a
+ * page (or with the PMP, an instruction) which can't be fetched. */
+struct block *block_translate(struct hart *h, uint32_t pc)
+{
+    struct block *b;
+    struct decoded_insn *d;
+    uint32_t paddr = pc, insn, len, last;
+
+    if (fetch_translate(h, &paddr))
+        return NULL;
+    if (h->n_blocks == BLOCK_POOL_SIZE ||
+        h->n_pool_insns + BLOCK_MAX_INSNS > INSN_POOL_SIZE)
+        block_cache_flush(h);
+
+    b = &h->block_pool[h->n_blocks++];
+    b->pc_start = pc;
+    b->insn = &h->insn_pool[h->n_pool_insns];
+    b->n_insn = 0;
+    b->succ[0] = b->succ[1] = NULL;
+    b->hits = 0;
+    b->native = NULL;
+    b->priv = block_priv(h);
+    for (;;) {
+        if (fetch_insn(h, pc, paddr, &insn, &len, &last)) {
+            /* a 32-bit instruction crossing into a page which can't be
+             * fetched */
+            if (b->n_insn == 0) {
+                h->n_blocks--;
+                return NULL;
+            }
+            break;
+        }
+        /* remember the RAM words code was decoded from */
+        code_mark(h, paddr);
+        if (len == 4)
+            code_mark(h, last);
+        d = &b->insn[b->n_insn++];
+        decode_insn(d, pc, insn, len, h->misa, h->zext);
+        if (b->n_insn > 1)
+            mul_fuse(d - 1, d);
+        pc += len;
+        paddr += len;
+        if (block_end(d) || b->n_insn == BLOCK_MAX_INSNS ||
+            pc == h->m->break_pc)
+            break;
+        /* the next instruction starts on a new page or the last one ended
+         * in it */
+        if ((pc & (RAM_PAGE_SIZE - 1)) < len || h->pmp_active) {
+            paddr = pc;
+            if (fetch_translate(h, &paddr))
+                break;
+        }
+    }
+    b->pc_end = pc;
+    h->n_pool_insns += b->n_insn;
+
+    h->block_map[(b->pc_start >> 2) & (BLOCK_MAP_SIZE - 1)] = b;
+    return b;
+}
+
+/* return the block starting at 'pc', or NULL with pending_exception set if
+ * it can't be fetched. The successors of the previously executed block are
+ * tried first, so that steady-state loops never touch the block map. */
+struct block *block_find(struct hart *h, struct block *prev, uint32_t pc)
+{
+    struct block *b;
+    uint32_t priv = block_priv(h);
+
+    /* translated code was overwritten, see code_write() */
+    if (h->code_gen != __atomic_load_n(&h->m->code_gen, __ATOMIC_ACQUIRE)) {
+        block_cache_flush(h);
+        prev = NULL;
+    }
+    /* only blocks decoded for the same privilege level are chained */
+    if (prev && prev->priv != priv)
+        prev = NULL;
+    if (prev) {
+        if (prev->succ[0] && prev->succ[0]->pc_start == pc)
+            return prev->succ[0];
+        if (prev->succ[1] && prev->succ[1]->pc_start == pc)
+            return prev->succ[1];
+    }
+    b = h->block_map[(pc >> 2) & (BLOCK_MAP_SIZE - 1)];
+    if (b == NULL || b->pc_start != pc || b->priv != priv) {
+        b = block_translate(h, pc);
+        if (b == NULL)
+            return NULL;
+    }
+    /* after a flush 'prev' may be a released block, linking it is harmless
+     * since block_translate() clears the links of reused blocks */
+    if (prev)
+        prev->succ[pc == prev->pc_end ? 0 : 1] = b;
+    return b;
+}
+
+/* execute a block, next_pc is set for the following one */
+static inline void block_exec(struct hart *h, struct block *b)
+{
+    struct decoded_insn *d = b->insn, *end = b->insn + b->n_insn;
+
+    h->insn_counter += b->n_insn;
+    h->next_pc = b->pc_end;
+    for (; d < end; d++) {
+        debug_out("[%08x]=%08x\n", d->pc, d->insn);
+#ifdef DEBUG_EXTRA
+        count_insn(d);
+#endif
+        if (d->handler(h, d)) {
+            /* the remaining instructions were not executed */
+            h->insn_counter -= end - d - 1;
+            break;
+        }
+    }
+}
+
+/* instructions retired by 'h', including the current one. The block engines
+ * count a whole block before running it, so during a load of h->block the
+ * instructions after it are taken off, the way guard_fault() does. */
+uint64_t insn_retired(struct hart *h)
+{
+    const struct block *b = h->block;
+    const struct decoded_insn *d = h->mem_insn;
+
+    if (b && d && d >= b->insn && d < b->insn + b->n_insn)
+        return h->insn_counter - (b->insn + b->n_insn - d - 1);
+    return h->insn_counter;
+}
+
+/* execution engines, see exec_engine and machine.engine */
+#define ENGINE_SWITCH 0   /* execute_instruction() per instruction */
+#define ENGINE_BLOCK 1    /* block_exec(), one handler call per instruction */
+#define ENGINE_THREADED 2 /* block_exec_threaded(), computed goto dispatch */
+#define ENGINE_JIT 3      /* x86-64 code for hot blocks, emu-rv32i-jit.h */
+
+#if defined(__GNUC__)
+#define HAVE_THREADED_CODE
+int exec_engine = ENGINE_THREADED;
+#else
+int exec_engine = ENGINE_BLOCK;
+#endif
+
+#ifdef HAVE_THREADED_CODE
+
+/* same as block_exec(), but every instruction jumps straight to the handler
+ * of the next one (GCC/Clang labels as values) instead of returning to a
+ * central loop, so each gets its own indirect branch to predict */
+void block_exec_threaded(struct hart *h, struct block *b)
+{
+    static const void *const dispatch_table[INSN_COUNT] = {
+        [INSN_LUI] = &&do_lui,       [INSN_AUIPC] = &&do_auipc,
+        [INSN_JAL] = &&do_jal,       [INSN_JALR] = &&do_jalr,
+        [INSN_BEQ] = &&do_beq,       [INSN_BNE] = &&do_bne,
+        [INSN_BLT] = &&do_blt,       [INSN_BGE] = &&do_bge,
+        [INSN_BLTU] = &&do_bltu,     [INSN_BGEU] = &&do_bgeu,
+        [INSN_LB] = &&do_lb,         [INSN_LH] = &&do_lh,
+        [INSN_LW] = &&do_lw,         [INSN_LBU] = &&do_lbu,
+        [INSN_LHU] = &&do_lhu,       [INSN_SB] = &&do_sb,
+        [INSN_SH] = &&do_sh,         [INSN_SW] = &&do_sw,
+        [INSN_ADDI] = &&do_addi,     [INSN_SLTI] = &&do_slti,
+        [INSN_SLTIU] = &&do_sltiu,   [INSN_XORI] = &&do_xori,
+        [INSN_ORI] = &&do_ori,       [INSN_ANDI] = &&do_andi,
+        [INSN_SLLI] = &&do_slli,     [INSN_SRLI] = &&do_srli,
+        [INSN_SRAI] = &&do_srai,     [INSN_ADD] = &&do_add,
+        [INSN_SUB] = &&do_sub,       [INSN_SLL] = &&do_sll,
+        [INSN_SLT] = &&do_slt,       [INSN_SLTU] = &&do_sltu,
+        [INSN_XOR] = &&do_xor,       [INSN_SRL] = &&do_srl,
+        [INSN_SRA] = &&do_sra,       [INSN_OR] = &&do_or,
+        [INSN_AND] = &&do_and,
+        [INSN_MUL] = &&do_mul,       [INSN_MULH] = &&do_mulh,
+        [INSN_MULHSU] = &&do_mulhsu, [INSN_MULHU] = &&do_mulhu,
+        [INSN_DIV] = &&do_div,       [INSN_DIVU] = &&do_divu,
+        [INSN_REM] = &&do_rem,       [INSN_REMU] = &&do_remu,
+        [INSN_LR_W] = &&do_lr_w,     [INSN_SC_W] = &&do_sc_w,
+        [INSN_SH1ADD] = &&do_sh1add, [INSN_SH2ADD] = &&do_sh2add,
+        [INSN_SH3ADD] = &&do_sh3add, [INSN_ANDN] = &&do_andn,
+        [INSN_ORN] = &&do_orn,       [INSN_XNOR] = &&do_xnor,
+        [INSN_CLZ] = &&do_clz,       [INSN_CTZ] = &&do_ctz,
+        [INSN_CPOP] = &&do_cpop,     [INSN_MAX] = &&do_max,
+        [INSN_MAXU] = &&do_maxu,     [INSN_MIN] = &&do_min,
+        [INSN_MINU] = &&do_minu,     [INSN_SEXT_B] = &&do_sext_b,
+        [INSN_SEXT_H] = &&do_sext_h, [INSN_ZEXT_H] = &&do_zext_h,
+        [INSN_ROL] = &&do_rol,       [INSN_ROR] = &&do_ror,
+        [INSN_RORI] = &&do_rori,     [INSN_ORC_B] = &&do_orc_b,
+        [INSN_REV8] = &&do_rev8,     [INSN_BCLR] = &&do_bclr,
+        [INSN_BCLRI] = &&do_bclri,   [INSN_BEXT] = &&do_bext,
+        [INSN_BEXTI] = &&do_bexti,   [INSN_BINV] = &&do_binv,
+        [INSN_BINVI] = &&do_binvi,   [INSN_BSET] = &&do_bset,
+        [INSN_BSETI] = &&do_bseti,
+        [INSN_AMOSWAP_W] = &&do_amo, [INSN_AMOADD_W] = &&do_amo,
+        [INSN_AMOXOR_W] = &&do_amo,  [INSN_AMOAND_W] = &&do_amo,
+        [INSN_AMOOR_W] = &&do_amo,   [INSN_AMOMIN_W] = &&do_amo,
+        [INSN_AMOMAX_W] = &&do_amo,  [INSN_AMOMINU_W] = &&do_amo,
+        [INSN_AMOMAXU_W] = &&do_amo,
+        [INSN_NOP] = &&do_nop,       [INSN_FALLBACK] = &&do_fallback,
+        [INSN_MULH_MUL] = &&do_mulh_mul,
+        [INSN_MULHSU_MUL] = &&do_mulhsu_mul,
+        [INSN_MULHU_MUL] = &&do_mulhu_mul};
+    struct decoded_insn *d = b->insn, *end = b->insn + b->n_insn;
+
+#ifdef DEBUG_EXTRA
+#define DISPATCH_DEBUG() count_insn(d)
+#else
+#define DISPATCH_DEBUG()
+#endif
+#define DISPATCH()                                       \
+    do {                                                 \
+        debug_out("[%08x]=%08x\n", d->pc, d->insn);      \
+        DISPATCH_DEBUG();                                \
+        goto *dispatch_table[d->op];                     \
+    } while (0)
+#define THREADED(label, handler) \
+    label:                       \
+    if (handler(h, d))           \
+        goto trap;               \
+    if (++d == end)              \
+        return;                  \
+    DISPATCH();
+
+    h->insn_counter += b->n_insn;
+    h->next_pc = b->pc_end;
+    DISPATCH();
+
+    THREADED(do_lui, exec_lui)
+    THREADED(do_auipc, exec_auipc)
+    THREADED(do_jal, exec_jal)
+    THREADED(do_jalr, exec_jalr)
+    THREADED(do_beq, exec_beq)
+    THREADED(do_bne, exec_bne)
+    THREADED(do_blt, exec_blt)
+    THREADED(do_bge, exec_bge)
+    THREADED(do_bltu, exec_bltu)
+    THREADED(do_bgeu, exec_bgeu)
+    THREADED(do_lb, exec_lb)
+    THREADED(do_lh, exec_lh)
+    THREADED(do_lw, exec_lw)
+    THREADED(do_lbu, exec_lbu)
+    THREADED(do_lhu, exec_lhu)
+    THREADED(do_sb, exec_sb)
+    THREADED(do_sh, exec_sh)
+    THREADED(do_sw, exec_sw)
+    THREADED(do_addi, exec_addi)
+    THREADED(do_slti, exec_slti)
+    THREADED(do_sltiu, exec_sltiu)
+    THREADED(do_xori, exec_xori)
+    THREADED(do_ori, exec_ori)
+    THREADED(do_andi, exec_andi)
+    THREADED(do_slli, exec_slli)
+    THREADED(do_srli, exec_srli)
+    THREADED(do_srai, exec_srai)
+    THREADED(do_add, exec_add)
+    THREADED(do_sub, exec_sub)
+    THREADED(do_sll, exec_sll)
+    THREADED(do_slt, exec_slt)
+    THREADED(do_sltu, exec_sltu)
+    THREADED(do_xor, exec_xor)
+    THREADED(do_srl, exec_srl)
+    THREADED(do_sra, exec_sra)
+    THREADED(do_or, exec_or)
+    THREADED(do_and, exec_and)
+    THREADED(do_mul, exec_mul)
+    THREADED(do_mulh, exec_mulh)
+    THREADED(do_mulhsu, exec_mulhsu)
+    THREADED(do_mulhu, exec_mulhu)
+    THREADED(do_div, exec_div)
+    THREADED(do_divu, exec_divu)
+    THREADED(do_rem, exec_rem)
+    THREADED(do_remu, exec_remu)
+    THREADED(do_lr_w, exec_lr_w)
+    THREADED(do_sc_w, exec_sc_w)
+    THREADED(do_amo, amo)
+    THREADED(do_sh1add, exec_sh1add)
+    THREADED(do_sh2add, exec_sh2add)
+    THREADED(do_sh3add, exec_sh3add)
+    THREADED(do_andn, exec_andn)
+    THREADED(do_orn, exec_orn)
+    THREADED(do_xnor, exec_xnor)
+    THREADED(do_clz, exec_clz)
+    THREADED(do_ctz, exec_ctz)
+    THREADED(do_cpop, exec_cpop)
+    THREADED(do_max, exec_max)
+    THREADED(do_maxu, exec_maxu)
+    THREADED(do_min, exec_min)
+    THREADED(do_minu, exec_minu)
+    THREADED(do_sext_b, exec_sext_b)
+    THREADED(do_sext_h, exec_sext_h)
+    THREADED(do_zext_h, exec_zext_h)
+    THREADED(do_rol, exec_rol)
+    THREADED(do_ror, exec_ror)
+    THREADED(do_rori, exec_rori)
+    THREADED(do_orc_b, exec_orc_b)
+    THREADED(do_rev8, exec_rev8)
+    THREADED(do_bclr, exec_bclr)
+    THREADED(do_bclri, exec_bclri)
+    THREADED(do_bext, exec_bext)
+    THREADED(do_bexti, exec_bexti)
+    THREADED(do_binv, exec_binv)
+    THREADED(do_binvi, exec_binvi)
+    THREADED(do_bset, exec_bset)
+    THREADED(do_bseti, exec_bseti)
+    THREADED(do_nop, exec_nop)
+    THREADED(do_fallback, exec_fallback)
+    THREADED(do_mulh_mul, exec_mulh_mul)
+    THREADED(do_mulhsu_mul, exec_mulhsu_mul)
+    THREADED(do_mulhu_mul, exec_mulhu_mul)
+
+trap:
+    /* the remaining instructions were not executed */
+    h->insn_counter -= end - d - 1;
+
+#undef THREADED
+#undef DISPATCH
+#undef DISPATCH_DEBUG
+}
+
+#endif
+
+void machine_free(struct machine *m)
+{
+    for (uint32_t i = 0; i < m->n_harts; i++) {
+        free(m->hart[i].block_pool);
+        free(m->hart[i].insn_pool);
+        free(m->hart[i].block_map);
+    }
+    if (m->guest_base)
+        munmap(m->guest_base, GUEST_SPACE);
+    else if (m->ram)
+        munmap(m->ram, m->ram_size);
+    free(m->dirty_pages);
+    free(m->used_pages);
+    free(m->code_pages);
+    free(m->code_words);
+    free(m->io_pages);
+    free(m);
+}
+
+/* attach a copy of 'dev' to the bus of 'm'. Its pages are not RAM anymore.
+ * Returns -1 if the bus is full or a page already belongs to a device. */
+int machine_add_device(struct machine *m, const struct device *dev)
+{
+    uint32_t first = dev->base >> RAM_PAGE_BITS;
+    uint64_t last = ((uint64_t) dev->base + dev->size - 1) >> RAM_PAGE_BITS;
+
+    if (m->n_devices == MAX_DEVICES || dev->size == 0 || last >= GUEST_PAGES)
+        return -1;
+    for (uint64_t i = first; i <= last; i++) {
+        if (m->io_pages[i])
+            return -1;
+    }
+    m->devices[m->n_devices++] = *dev;
+    for (uint64_t i = first; i <= last; i++)
+        m->io_pages[i] = m->n_devices;
+    return 0;
+}
+
+/* misa and ZEXT_x of the ISA string 'isa' such as "rv32imac_zbb", returns -1
+ * if it is not valid or has extensions the emulator doesn't support. S and
+ * U-mode are always there, as are the Zicsr and Zifencei extensions. */
+int isa_parse(const char *isa, uint32_t *pmisa, uint32_t *pzext)
+{
+    static const struct {
+        const char *name;
+        uint32_t zext;
+    } zexts[] = {{"zicsr", 0},
+                 {"zifencei", 0},
+                 {"zba", ZEXT_ZBA},
+                 {"zbb", ZEXT_ZBB},
+                 {"zbs", ZEXT_ZBS}};
+    uint32_t misa = MCPUID_SUPER | MCPUID_USER, zext = 0;
+    size_t n;
+
+    if (strncmp(isa, "rv32i", 5))
+        return -1;
+    for (isa += 4; *isa && *isa != '_'; isa++) {
+        if (strchr("imac", *isa) == NULL || (misa & (1 << (*isa - 'a'))))
+            return -1;
+        misa |= 1 << (*isa - 'a');
+    }
+    while (*isa == '_') {
+        isa++;
+        n = strcspn(isa, "_");
+        for (size_t i = 0;; i++) {
+            if (i == sizeof(zexts) / sizeof(zexts[0]))
+                return -1;
+            if (strlen(zexts[i].name) == n && !strncmp(isa, zexts[i].name, n)) {
+                zext |= zexts[i].zext;
+                break;
+            }
+        }
+        isa += n;
+    }
+    *pmisa = misa;
+    *pzext = zext;
+    return 0;
+}
+
+/* allocate a machine with 'ram_size' bytes of zeroed RAM (a multiple of
+ * RAM_PAGE_SIZE up to RAM_SIZE_MAX) and 'n_harts' harts in the reset state,
+ * returns NULL if out of memory or the parameters are not valid */
+struct machine *machine_new(uint32_t n_harts, uint32_t ram_size)
+{
+    struct machine *m;
+
+    if (n_harts < 1 || n_harts > MAX_HARTS || ram_size < RAM_PAGE_SIZE ||
+        ram_size > RAM_SIZE_MAX || (ram_size & (RAM_PAGE_SIZE - 1)))
+        return NULL;
+    m = calloc(1, sizeof(struct machine));
+    if (m == NULL)
+        return NULL;
+    m->running = TRUE;
+    m->break_pc = BREAK_NONE;
+    m->engine = exec_engine;
+    m->n_harts = n_harts;
+
+    /* zero pages cost nothing until they are touched */
+    m->ram = mmap(NULL, ram_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m->ram == MAP_FAILED) {
+        m->ram = NULL;
+        machine_free(m);
+        return NULL;
+    }
+    m->ram_size = ram_size;
+    m->ram_pages = ram_size >> RAM_PAGE_BITS;
+    m->dirty_pages = calloc(m->ram_pages, 1);
+    m->used_pages = calloc(m->ram_pages, 1);
+    m->code_pages = calloc(m->ram_pages, 1);
+    m->code_words = calloc(ram_size / 32, 1);
+    m->io_pages = calloc(GUEST_PAGES, 1);
+    if (m->dirty_pages == NULL || m->used_pages == NULL ||
+        m->code_pages == NULL || m->code_words == NULL ||
+        m->io_pages == NULL) {
+        machine_free(m);
+        return NULL;
+    }
+    machine_add_device(m, &clint_device);
+    machine_add_device(m, &uart_device);
+
+    for (uint32_t i = 0; i < n_harts; i++) {
+        struct hart *h = &m->hart[i];
+        h->m = m;
+        h->priv = PRV_M;
+        h->mhartid = i;
+        h->mxl = 1; /* 32-bit */
+        h->misa = MISA_DEFAULT;
+        h->zext = ZEXT_DEFAULT;
+        mmu_update(h);
+        h->block_pool = calloc(BLOCK_POOL_SIZE, sizeof(struct block));
+        h->insn_pool = calloc(INSN_POOL_SIZE, sizeof(struct decoded_insn));
+        h->block_map = calloc(BLOCK_MAP_SIZE, sizeof(struct block *));
+        if (h->block_pool == NULL || h->insn_pool == NULL ||
+            h->block_map == NULL) {
+            machine_free(m);
+            return NULL;
+        }
+    }
+    return m;
+}
+
+static __thread struct hart *guard_hart;
+
+/* SIGSEGV handler of the guard page mode. A fault of the direct access of a
+ * load or store handler goes back to the run loop of the hart, anything else
+ * crashes as usual. */
+static void guard_signal(int sig, siginfo_t *si, void *ctx)
+{
+    struct hart *h = guard_hart;
+    const struct decoded_insn *d = h ? h->mem_insn : NULL;
+
+    (void) ctx;
+    if (d && h->guest_base &&
+        (uint8_t *) si->si_addr ==
+            h->guest_base + (uint32_t)(h->reg[d->rs1] + d->imm))
+        siglongjmp(h->fault_env, 1);
+    signal(sig, SIG_DFL);
+}
+
+/* reserve the whole guest address space for 'm' and move its RAM to
+ * ram_start inside it. The rest stays inaccessible, so the load and store
+ * handlers access memory without bounds checks. Must be called once
+ * ram_start is set and before the harts run. Pages already loaded are
+ * copied, so loaders call it first and map files into the reservation
+ * afterwards (see machine_load_file()). Returns -1 if the host can't do it
+ * or a device shares a page with the RAM. */
+int machine_map_guest(struct machine *m)
+{
+    static int installed;
+    uint8_t *base, *ram;
+
+    if (sizeof(void *) < 8 || m->guest_base ||
+        (uint64_t) m->ram_start + m->ram_size > GUEST_SPACE ||
+        ram_has_devices(m))
+        return -1;
+    base = mmap(NULL, GUEST_SPACE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    ram = mmap(base + m->ram_start, m->ram_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+               0);
+    if (ram == MAP_FAILED) {
+        munmap(base, GUEST_SPACE);
+        return -1;
+    }
+    for (uint32_t i = 0; i < m->ram_pages; i++) {
+        if (m->used_pages[i] || m->dirty_pages[i])
+            memcpy(ram + ((size_t) i << RAM_PAGE_BITS),
+                   m->ram + ((size_t) i << RAM_PAGE_BITS), RAM_PAGE_SIZE);
+    }
+    munmap(m->ram, m->ram_size);
+    m->ram = ram;
+    m->guest_base = base;
+    for (uint32_t i = 0; i < m->n_harts; i++)
+        mmu_update(&m->hart[i]);
+
+    if (!__atomic_exchange_n(&installed, 1, __ATOMIC_SEQ_CST)) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = guard_signal;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, NULL);
+    }
+    return 0;
+}
+
+/* called by the run loop of 'h' after the access of h->mem_insn faulted. It
+ * is redone with the bounds checked target_read_x() and target_write_x(),
+ * for the MMIO registers or a guest exception, and ends the block. */
+void guard_fault(struct hart *h)
+{
+    const struct decoded_insn *d = h->mem_insn;
+    const struct block *b = h->block;
+
+    /* the rest of the block was not executed */
+    h->insn_counter -= b->insn + b->n_insn - d - 1;
+    h->mem_insn = NULL;
+    h->block = NULL;
+    h->next_pc = d->pc + d->len;
+    h->guest_base = NULL;
+    d->handler(h, d);
+    mmu_update(h);
+    h->pc = h->next_pc;
+}
+
+/* copy 'size' bytes of 'data' to the RAM of 'm' at 'offset', for loaders */
+void machine_load_ram(struct machine *m, uint32_t offset, const void *data,
+                      uint32_t size)
+{
+    if (size == 0)
         return;
+    memcpy(m->ram + offset, data, size);
+    for (uint32_t i = offset >> RAM_PAGE_BITS;
+         i <= (offset + size - 1) >> RAM_PAGE_BITS; i++)
+        m->dirty_pages[i] = 1;
+}
+
+/* read 'size' bytes at 'offset' of the file 'fd', returns -1 on error */
+static int file_read(int fd, void *buf, size_t size, uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t n = pread(fd, buf, size, offset);
+        if (n <= 0)
+            return -1;
+        buf = (uint8_t *) buf + n;
+        size -= n;
+        offset += n;
     }
+    return 0;
+}
+
+/* load 'size' bytes at 'file_offset' of the file 'fd' to the RAM of 'm' at
+ * 'offset', for loaders. The host pages inside the range are mapped copy on
+ * write from the file, so the cost does not grow with the size; only the
+ * partial pages at both ends are read (everything if the two offsets are
+ * not congruent modulo the host page size). Returns -1 on error. */
+int machine_load_file(struct machine *m, uint32_t offset, int fd,
+                      uint64_t file_offset, uint32_t size)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t addr = (uintptr_t)(m->ram + offset);
+    uint32_t start = offset + ((page - addr % page) % page);
+    uint32_t end = offset + size - (addr + size) % page;
+
+    if (size == 0)
+        return 0;
+    if ((addr - file_offset) % page || start >= end) {
+        start = end = offset + size;
+    } else if (mmap(m->ram + start, end - start, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, fd,
+                    file_offset + (start - offset)) == MAP_FAILED) {
+        return -1;
+    }
+    if (file_read(fd, m->ram + offset, start - offset, file_offset) ||
+        file_read(fd, m->ram + end, offset + size - end,
+                  file_offset + (end - offset)))
+        return -1;
+    for (uint32_t i = offset >> RAM_PAGE_BITS;
+         i <= (offset + size - 1) >> RAM_PAGE_BITS; i++)
+        m->dirty_pages[i] = 1;
+    return 0;
+}
+
+/* machine state saved by snapshot_take() */
+struct snapshot {
+    uint8_t *ram;
+    uint8_t *used_pages; /* like machine.used_pages */
+    uint32_t ram_size;
+    uint32_t ram_last;
+    struct hart hart[MAX_HARTS];
+};
+
+/* save the state of a stopped machine. Until the next snapshot, the pages
+ * written are tracked in dirty_pages so that restoring only copies those. */
+void snapshot_take(struct machine *m, struct snapshot *s)
+{
+    /* pages never written stay unallocated in both */
+    for (uint32_t i = 0; i < m->ram_pages; i++) {
+        m->used_pages[i] |= m->dirty_pages[i];
+        if (m->used_pages[i] || s->used_pages[i]) {
+            memcpy(s->ram + ((size_t) i << RAM_PAGE_BITS),
+                   m->ram + ((size_t) i << RAM_PAGE_BITS), RAM_PAGE_SIZE);
+            s->used_pages[i] = m->used_pages[i];
+        }
+    }
+    s->ram_last = m->ram_last;
+    memcpy(s->hart, m->hart, m->n_harts * sizeof(struct hart));
+    memset(m->dirty_pages, 0, m->ram_pages);
+    m->snapshot = s;
+}
+
+/* put a stopped machine back in the state of 's'. The decoded and native
+ * code caches stay with the harts, unless a page they were translated from
+ * is restored. */
+void snapshot_restore(struct machine *m, const struct snapshot *s)
+{
+    int flush = FALSE;
+
+    for (uint32_t i = 0; i < m->ram_pages; i++) {
+        /* all used pages if 's' is not the last snapshot taken */
+        if (m->dirty_pages[i] ||
+            (m->snapshot != s && (m->used_pages[i] || s->used_pages[i]))) {
+            memcpy(m->ram + ((size_t) i << RAM_PAGE_BITS),
+                   s->ram + ((size_t) i << RAM_PAGE_BITS), RAM_PAGE_SIZE);
+            m->used_pages[i] = s->used_pages[i];
+            if (m->code_pages[i])
+                flush = TRUE;
+        }
+    }
+    memset(m->dirty_pages, 0, m->ram_pages);
+    m->snapshot = s;
+    m->ram_last = s->ram_last;
+
+    for (uint32_t i = 0; i < m->n_harts; i++) {
+        struct hart *h = &m->hart[i];
+        struct hart caches = *h;
+
+        *h = s->hart[i];
+        h->m = m;
+        h->block_pool = caches.block_pool;
+        h->insn_pool = caches.insn_pool;
+        h->n_blocks = caches.n_blocks;
+        h->n_pool_insns = caches.n_pool_insns;
+        h->block_map = caches.block_map;
+        h->code_gen = caches.code_gen;
+        h->jit_code = caches.jit_code;
+        h->jit_code_used = caches.jit_code_used;
+        h->jit_ptr = caches.jit_ptr;
+        /* blocks decoded from virtual addresses and the TLB may not match
+         * the restored page tables, nor fetch checks the restored PMP */
+        tlb_flush(h);
+        mmu_update(h);
+        if (flush || (caches.satp & SATP_MODE) || caches.pmp_active ||
+            h->pmp_active)
+            block_cache_flush(h);
+        /* resynchronize mtime with the host clock */
+        h->timer_deadline = 0;
+        irq_update(h);
+    }
+    if (flush) {
+        for (uint32_t i = 0; i < m->ram_pages; i++) {
+            if (m->code_pages[i])
+                memset(m->code_words + i * (RAM_PAGE_SIZE / 32), 0,
+                       RAM_PAGE_SIZE / 32);
+        }
+        memset(m->code_pages, 0, m->ram_pages);
+    }
+    m->running = TRUE;
+    m->stop_reason = STOP_EXIT;
+}
+
+/* allocate a snapshot for the machine 'm' and save its state, returns NULL
+ * if out of memory */
+struct snapshot *snapshot_new(struct machine *m)
+{
+    struct snapshot *s = calloc(1, sizeof(struct snapshot));
+
+    if (s == NULL)
+        return NULL;
+    s->ram = mmap(NULL, m->ram_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    s->used_pages = calloc(m->ram_pages, 1);
+    if (s->ram == MAP_FAILED || s->used_pages == NULL) {
+        if (s->ram != MAP_FAILED)
+            munmap(s->ram, m->ram_size);
+        free(s->used_pages);
+        free(s);
+        return NULL;
+    }
+    s->ram_size = m->ram_size;
+    snapshot_take(m, s);
+    return s;
+}
+
+void snapshot_free(struct snapshot *s)
+{
+    if (s == NULL)
+        return;
+    munmap(s->ram, s->ram_size);
+    free(s->used_pages);
+    free(s);
 }